@@ -0,0 +1,129 @@
+#!/bin/sh
+##
+##  httpd_load.sh -- load mod_vlimit under each MPM and check that every counter returns to zero
+##
+##  usage: bench/httpd_load.sh [prefork] [worker] [event]
+##
+##  Needs an httpd 2.4 with the MPMs built as modules, ab and curl. Override
+##  the tools and the profile through the environment:
+##    HTTPD APXS AB CURL PORT REQUESTS CONCURRENCY
+##
+
+HTTPD=${HTTPD:-httpd}
+APXS=${APXS:-apxs}
+AB=${AB:-ab}
+CURL=${CURL:-curl}
+PORT=${PORT:-18080}
+STATUS_PORT=$((PORT + 1))
+REQUESTS=${REQUESTS:-20000}
+CONCURRENCY=${CONCURRENCY:-64}
+
+MODDIR=$($APXS -q LIBEXECDIR)
+VLIMIT_SO=$(cd "$(dirname "$0")/.." && pwd)/.libs/mod_vlimit.so
+MPMS=${*:-prefork worker event}
+FAILED=0
+
+if [ ! -f "$VLIMIT_SO" ]; then
+  echo "$VLIMIT_SO not found, run make first" >&2
+  exit 1
+fi
+
+# one server config and one section of each kind, limits low enough that some requests get 503;
+# vlimit-status has a port of its own so that its request is not in the counts it reports
+write_conf() {
+  cat > "$1/httpd.conf" <<EOF
+ServerRoot "$1"
+Listen 127.0.0.1:$PORT
+Listen 127.0.0.1:$STATUS_PORT
+ServerName 127.0.0.1
+PidFile "$1/httpd.pid"
+ErrorLog "$1/error_log"
+LogLevel warn
+DocumentRoot "$1/htdocs"
+
+LoadModule mpm_$2_module $MODDIR/mod_mpm_$2.so
+LoadModule authz_core_module $MODDIR/mod_authz_core.so
+LoadModule unixd_module $MODDIR/mod_unixd.so
+LoadModule vlimit_module $VLIMIT_SO
+
+StartServers 4
+MaxRequestWorkers 256
+ServerLimit 16
+<IfModule !mpm_prefork_module>
+  ThreadsPerChild 16
+</IfModule>
+KeepAlive On
+
+VlimitDebugLevel none
+VlimitAtomic On
+VlimitMutexStripes 16
+VlimitIP $CONCURRENCY
+
+<Directory "$1/htdocs">
+  Require all granted
+</Directory>
+<Files "a.txt">
+  VlimitFile 8
+</Files>
+<Files "b.txt">
+  VlimitIP 4 $1/htdocs/b.txt
+  VlimitIPRate 1000/1s
+</Files>
+<VirtualHost 127.0.0.1:$STATUS_PORT>
+  ServerName 127.0.0.1
+  <Location "/vlimit-status">
+    SetHandler vlimit-status
+  </Location>
+</VirtualHost>
+EOF
+}
+
+# requests per second and the number of 503 of one ab run
+run_ab() {
+  $AB -q -k -c "$1" -n "$2" "http://127.0.0.1:$PORT$3" 2>&1 |
+    awk -v path="$3" '/^Requests per second/ { rps = $4 } /^Non-2xx responses/ { r503 = $3 }
+                      END { printf "  %-8s %10s req/s  %6d non-2xx\n", path, rps, r503 }'
+}
+
+for mpm in $MPMS; do
+  dir=$(mktemp -d "${TMPDIR:-/tmp}/vlimit-bench.XXXXXX")
+  mkdir "$dir/htdocs"
+  echo index > "$dir/htdocs/index.html"
+  head -c 65536 /dev/zero > "$dir/htdocs/a.txt"
+  echo b > "$dir/htdocs/b.txt"
+  write_conf "$dir" "$mpm"
+
+  if ! $HTTPD -f "$dir/httpd.conf" -k start; then
+    echo "$mpm: httpd failed to start, see $dir/error_log" >&2
+    FAILED=1
+    continue
+  fi
+  for t in 1 2 3 4 5 6 7 8 9 10; do
+    $CURL -s -o /dev/null "http://127.0.0.1:$PORT/index.html" && break
+    sleep 1
+  done
+
+  echo "$mpm: $REQUESTS requests at concurrency $CONCURRENCY per path"
+  run_ab "$CONCURRENCY" "$REQUESTS" /index.html &
+  run_ab "$CONCURRENCY" "$REQUESTS" /a.txt &
+  run_ab "$CONCURRENCY" "$REQUESTS" /b.txt &
+  wait
+
+  # log_transaction of the last requests runs after ab has its responses
+  sleep 2
+  status=$($CURL -s "http://127.0.0.1:$STATUS_PORT/vlimit-status?format=json")
+  $HTTPD -f "$dir/httpd.conf" -k stop
+
+  if [ -z "$status" ]; then
+    echo "$mpm: FAILED, no vlimit-status" >&2
+    FAILED=1
+  elif echo "$status" | grep -q '"connections":[1-9]'; then
+    echo "$mpm: FAILED, counters left after the load: $status" >&2
+    FAILED=1
+  else
+    echo "$mpm: ok, every counter back to zero"
+    rm -rf "$dir"
+  fi
+done
+
+exit $FAILED
@@ -0,0 +1,512 @@
+/*
+// -------------------------------------------------------------------
+// vlimit_bench
+//   Hammer the slot tables of vlimit_shm.c from forked processes over
+//      shared memory, as the children of a prefork httpd would
+//
+//   Each process keeps up to -d counts held, like requests in flight,
+//   and reports inc/dec throughput and latency percentiles. Every
+//   counter has to be back to zero at the end, otherwise it fails.
+//
+//   usage: vlimit_bench [-t ip|file] [-p procs] [-n ops] [-k keys] [-z hot%]
+//                       [-s slots] [-m stripes] [-d depth] [-a] [-e]
+// -------------------------------------------------------------------
+*/
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <apr_general.h>
+#include <apr_getopt.h>
+#include <apr_strings.h>
+#include <apr_thread_proc.h>
+#include <apr_shm.h>
+
+#include "vlimit_shm.h"
+
+#define BENCH_MAX_PROCS 256
+#define BENCH_MAX_DEPTH 1024
+#define BENCH_SUB_BITS 4 /* 16 buckets per power of 2, under 7% error */
+#define BENCH_BUCKETS (64 << BENCH_SUB_BITS)
+
+/* latency of one kind of operation, ns */
+typedef struct bench_hist_str {
+  apr_uint64_t count;
+  apr_uint64_t sum;
+  apr_uint64_t max;
+  apr_uint32_t bucket[BENCH_BUCKETS];
+} bench_hist;
+
+/* written by one child, merged by the parent */
+typedef struct bench_result_str {
+  bench_hist inc;
+  bench_hist dec;
+  apr_uint64_t full;          /* inc returned -1 */
+  apr_uint64_t lock_failures; /* inc or dec returned -3 */
+  apr_uint64_t retries;       /* atomic inc fell back to the locked one */
+} bench_result;
+
+typedef struct bench_held_str {
+  int slot;
+  apr_uint32_t gen;
+} bench_held;
+
+static const char *bench_table = "ip";
+static int bench_procs = 4;
+static int bench_ops = 1000000;
+static int bench_keys = 1024;
+static int bench_hot = 0;
+static int bench_slots = 4096;
+static int bench_stripes = 16;
+static int bench_depth = 4;
+
+static SHM_DATA bench_stat;
+static ip_key *bench_ip_keys;
+static apr_uint32_t *bench_ip_hashes;
+static apr_uint64_t *bench_file_keys;
+static const char **bench_file_names;
+static bench_result *bench_results;
+static volatile apr_uint32_t *bench_start;
+
+/* ---------------------- */
+/* --- Time Histogram --- */
+/* ---------------------- */
+static apr_uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (apr_uint64_t)ts.tv_sec * 1000000000ULL + (apr_uint64_t)ts.tv_nsec;
+}
+
+/* log-linear, the power of 2 of value and its next BENCH_SUB_BITS bits */
+static int bench_bucket(apr_uint64_t value)
+{
+  int msb = 0;
+
+  if (value < (1U << BENCH_SUB_BITS)) {
+    return (int)value;
+  }
+  while ((value >> msb) > 1) {
+    msb++;
+  }
+
+  return ((msb - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS) +
+         (int)((value >> (msb - BENCH_SUB_BITS)) & ((1U << BENCH_SUB_BITS) - 1));
+}
+
+/* lowest value falling in bucket */
+static apr_uint64_t bench_bucket_value(int bucket)
+{
+  int shift = (bucket >> BENCH_SUB_BITS) - 1;
+  apr_uint64_t sub = (apr_uint64_t)(bucket & ((1 << BENCH_SUB_BITS) - 1));
+
+  if (shift < 0) {
+    return (apr_uint64_t)bucket;
+  }
+
+  return ((1ULL << BENCH_SUB_BITS) + sub) << shift;
+}
+
+static void bench_record(bench_hist *hist, apr_uint64_t ns)
+{
+  hist->count++;
+  hist->sum += ns;
+  if (ns > hist->max) {
+    hist->max = ns;
+  }
+  hist->bucket[bench_bucket(ns)]++;
+}
+
+static void bench_merge(bench_hist *to, const bench_hist *from)
+{
+  int i;
+
+  to->count += from->count;
+  to->sum += from->sum;
+  if (from->max > to->max) {
+    to->max = from->max;
+  }
+  for (i = 0; i < BENCH_BUCKETS; i++) {
+    to->bucket[i] += from->bucket[i];
+  }
+}
+
+static apr_uint64_t bench_percentile(const bench_hist *hist, double q)
+{
+  apr_uint64_t rank = (apr_uint64_t)(hist->count * q);
+  apr_uint64_t seen = 0;
+  int i;
+
+  for (i = 0; i < BENCH_BUCKETS; i++) {
+    seen += hist->bucket[i];
+    if (seen > rank) {
+      return bench_bucket_value(i);
+    }
+  }
+
+  return hist->max;
+}
+
+static void bench_print(const char *name, const bench_hist *hist, double seconds)
+{
+  printf("%-4s %10.0f ops/s  avg %6llu ns  p50 %6llu ns  p99 %6llu ns  p999 %7llu ns  max %8llu ns\n", name,
+         hist->count / seconds, (unsigned long long)(hist->count ? hist->sum / hist->count : 0),
+         (unsigned long long)bench_percentile(hist, 0.50), (unsigned long long)bench_percentile(hist, 0.99),
+         (unsigned long long)bench_percentile(hist, 0.999), (unsigned long long)hist->max);
+}
+
+/* -------------------- */
+/* --- Bench Worker --- */
+/* -------------------- */
+/* xorshift32, one state per process */
+static apr_uint32_t bench_random(apr_uint32_t *state)
+{
+  apr_uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+
+  return x;
+}
+
+/* the same steps as vlimit_check_limit: lock-free first when VlimitAtomic, then under the mutex */
+static int bench_inc(int key, bench_held *held, bench_result *res)
+{
+  int count = -2;
+
+  if (bench_table[0] == 'i') {
+    if (vlimit_atomic) {
+      count = inc_ip_counter_atomic(&bench_stat, &bench_ip_keys[key], bench_ip_hashes[key], &held->slot, &held->gen);
+    }
+    if (count == -2) {
+      res->retries += vlimit_atomic;
+      count = inc_ip_counter(&bench_stat, &bench_ip_keys[key], bench_ip_hashes[key], &held->slot, &held->gen);
+    }
+  } else {
+    if (vlimit_atomic) {
+      count = inc_file_counter_atomic(&bench_stat, bench_file_keys[key], &held->slot, &held->gen);
+    }
+    if (count == -2) {
+      res->retries += vlimit_atomic;
+      count = inc_file_counter(&bench_stat, bench_file_keys[key], bench_file_names[key], &held->slot, &held->gen);
+    }
+  }
+
+  return count;
+}
+
+static void bench_dec(bench_held *held, bench_result *res)
+{
+  apr_uint64_t start = bench_now_ns();
+  int count;
+
+  if (bench_table[0] == 'i') {
+    count = dec_ip_counter(&bench_stat, held->slot, held->gen);
+  } else {
+    count = dec_file_counter(&bench_stat, held->slot, held->gen);
+  }
+  bench_record(&res->dec, bench_now_ns() - start);
+
+  if (count == -3) {
+    res->lock_failures++;
+  }
+  held->slot = -1;
+}
+
+static void bench_worker(int n, apr_pool_t *p)
+{
+
+  bench_result *res = &bench_results[n];
+  bench_held held[BENCH_MAX_DEPTH];
+  apr_uint32_t seed = (apr_uint32_t)getpid() * 2654435761U + 1;
+  apr_uint64_t start;
+  int next = 0;
+  int count;
+  int key;
+  int i;
+
+  for (i = 0; i < bench_stripes; i++) {
+    apr_global_mutex_child_init(&vlimit_mutex[i], NULL, p);
+  }
+  for (i = 0; i < bench_depth; i++) {
+    held[i].slot = -1;
+  }
+
+  // all processes start together, fork time stays out of the figures
+  while (apr_atomic_read32(bench_start) == 0) {
+    sched_yield();
+  }
+
+  for (i = 0; i < bench_ops; i++) {
+    key = (int)(bench_random(&seed) % 100) < bench_hot ? 0 : (int)(bench_random(&seed) % bench_keys);
+    if (held[next].slot >= 0) {
+      bench_dec(&held[next], res);
+    }
+
+    start = bench_now_ns();
+    count = bench_inc(key, &held[next], res);
+    bench_record(&res->inc, bench_now_ns() - start);
+
+    if (count == -1) {
+      res->full++;
+      held[next].slot = -1;
+    } else if (count == -3) {
+      res->lock_failures++;
+      held[next].slot = -1;
+    }
+    next = (next + 1) % bench_depth;
+  }
+
+  for (i = 0; i < bench_depth; i++) {
+    if (held[i].slot >= 0) {
+      bench_dec(&held[i], res);
+    }
+  }
+}
+
+/* ------------------- */
+/* --- Bench Setup --- */
+/* ------------------- */
+static void bench_usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [-t ip|file] [-p procs] [-n ops] [-k keys] [-z hot%%] [-s slots] [-m stripes] [-d depth] [-a] "
+          "[-e]\n"
+          "  -t  slot table to hammer (default ip)\n"
+          "  -p  processes (default 4)\n"
+          "  -n  inc/dec pairs per process (default 1000000)\n"
+          "  -k  distinct keys (default 1024)\n"
+          "  -z  percent of requests going to one hot key (default 0)\n"
+          "  -s  slots of the table, VlimitMaxSlots (default 4096)\n"
+          "  -m  lock stripes, VlimitMutexStripes (default 16)\n"
+          "  -d  counts held per process, requests in flight (default 4)\n"
+          "  -a  VlimitAtomic On\n"
+          "  -e  VlimitOverflow evict\n",
+          prog);
+  exit(2);
+}
+
+static void bench_options(int argc, const char *const *argv, apr_pool_t *p)
+{
+  apr_getopt_t *opt;
+  apr_status_t status;
+  const char *arg;
+  char ch;
+
+  apr_getopt_init(&opt, p, argc, argv);
+  while ((status = apr_getopt(opt, "t:p:n:k:z:s:m:d:ae", &ch, &arg)) == APR_SUCCESS) {
+    switch (ch) {
+    case 't':
+      bench_table = arg;
+      break;
+    case 'p':
+      bench_procs = atoi(arg);
+      break;
+    case 'n':
+      bench_ops = atoi(arg);
+      break;
+    case 'k':
+      bench_keys = atoi(arg);
+      break;
+    case 'z':
+      bench_hot = atoi(arg);
+      break;
+    case 's':
+      bench_slots = atoi(arg);
+      break;
+    case 'm':
+      bench_stripes = atoi(arg);
+      break;
+    case 'd':
+      bench_depth = atoi(arg);
+      break;
+    case 'a':
+      vlimit_atomic = 1;
+      break;
+    case 'e':
+      vlimit_overflow_evict = 1;
+      break;
+    }
+  }
+
+  if (status != APR_EOF || (strcmp(bench_table, "ip") != 0 && strcmp(bench_table, "file") != 0) ||
+      bench_procs < 1 || bench_procs > BENCH_MAX_PROCS || bench_ops < 1 || bench_keys < 1 || bench_hot < 0 ||
+      bench_hot > 100 || bench_slots < 1 || bench_stripes < 1 || bench_depth < 1 || bench_depth > BENCH_MAX_DEPTH) {
+    bench_usage(argv[0]);
+  }
+}
+
+/* the layout vlimit_init gives one config, both tables in one stripe set */
+static void bench_layout(char *base)
+{
+
+  int slots = vlimit_slot_size(bench_slots);
+  int i;
+
+  bench_stat.max_slots = slots;
+  bench_stat.part_slots = slots / vlimit_mutex_stripes;
+  if (bench_stat.part_slots < VLIMIT_MIN_PART_SLOTS) {
+    bench_stat.part_slots = slots < VLIMIT_MIN_PART_SLOTS ? slots : VLIMIT_MIN_PART_SLOTS;
+  }
+  bench_stat.file_lock = 0;
+  bench_stat.ip_lock = 0;
+  for (i = 0; i < 4; i++) {
+    bench_stat.ip_mask4.word[i] = 0xffffffffU;
+    bench_stat.ip_mask6.word[i] = 0xffffffffU;
+  }
+
+  bench_stat.stat_shm = (conf_stat *)base;
+  base += VLIMIT_ALIGN_LINE(sizeof(conf_stat));
+  bench_stat.ip_stat_shm = (ip_stat *)base;
+  base += VLIMIT_ALIGN_LINE(sizeof(ip_stat) * slots);
+  bench_stat.file_stat_shm = (file_stat *)base;
+  base += VLIMIT_ALIGN_LINE(sizeof(file_stat) * slots);
+  bench_stat.file_name_shm = (file_name *)base;
+  base += VLIMIT_ALIGN_LINE(sizeof(file_name) * slots);
+  bench_results = (bench_result *)base;
+  base += VLIMIT_ALIGN_LINE(sizeof(bench_result) * bench_procs);
+  bench_start = (volatile apr_uint32_t *)base;
+}
+
+static void bench_make_keys(apr_pool_t *p)
+{
+  int i;
+
+  bench_ip_keys = (ip_key *)apr_pcalloc(p, sizeof(ip_key) * bench_keys);
+  bench_ip_hashes = (apr_uint32_t *)apr_palloc(p, sizeof(apr_uint32_t) * bench_keys);
+  bench_file_keys = (apr_uint64_t *)apr_palloc(p, sizeof(apr_uint64_t) * bench_keys);
+  bench_file_names = (const char **)apr_palloc(p, sizeof(char *) * bench_keys);
+
+  for (i = 0; i < bench_keys; i++) {
+    // 10.0.0.0/8 as v4-mapped addresses, as vlimit_ip_key stores them
+    bench_ip_keys[i].word[2] = htonl(0xffff);
+    bench_ip_keys[i].word[3] = htonl(0x0a000000U | (apr_uint32_t)i);
+    bench_ip_hashes[i] = vlimit_hash_bytes(bench_ip_keys[i].word, sizeof(bench_ip_keys[i].word));
+    bench_file_names[i] = apr_psprintf(p, "/var/www/bench/%d/index.html", i);
+    bench_file_keys[i] = vlimit_hash_string64(bench_file_names[i]);
+  }
+}
+
+/* slots still counted once every process is done, each one is a leaked count */
+static int bench_drift(void)
+{
+  int drift = 0;
+  int i;
+
+  for (i = 0; i < bench_stat.max_slots; i++) {
+    if (bench_stat.ip_stat_shm[i].counter != 0) {
+      fprintf(stderr, "drift: ip slot %d counter %u\n", i, bench_stat.ip_stat_shm[i].counter);
+      drift++;
+    }
+    if (bench_stat.file_stat_shm[i].counter != 0) {
+      fprintf(stderr, "drift: file slot %d (%s) counter %u\n", i, bench_stat.file_name_shm[i].filename,
+              bench_stat.file_stat_shm[i].counter);
+      drift++;
+    }
+  }
+
+  return drift;
+}
+
+int main(int argc, const char *const *argv)
+{
+
+  apr_pool_t *p;
+  apr_shm_t *bench_shm;
+  apr_proc_t procs[BENCH_MAX_PROCS];
+  apr_exit_why_e why;
+  apr_status_t status;
+  bench_result total;
+  apr_uint64_t start;
+  double seconds;
+  apr_size_t size;
+  int code;
+  int drift;
+  int failed = 0;
+  int i;
+
+  apr_app_initialize(&argc, &argv, NULL);
+  atexit(apr_terminate);
+  apr_pool_create(&p, NULL);
+  bench_options(argc, argv, p);
+
+  vlimit_debug_level = VLIMIT_DEBUG_NONE;
+  vlimit_mutex_stripes = vlimit_slot_size(bench_stripes);
+  vlimit_mutex = (apr_global_mutex_t **)apr_pcalloc(p, sizeof(apr_global_mutex_t *) * vlimit_mutex_stripes);
+  for (i = 0; i < vlimit_mutex_stripes; i++) {
+    status = apr_global_mutex_create(&vlimit_mutex[i], NULL, APR_LOCK_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+      fprintf(stderr, "apr_global_mutex_create failed: %d\n", status);
+      return 1;
+    }
+  }
+  bench_stripes = vlimit_mutex_stripes;
+
+  size = VLIMIT_ALIGN_LINE(sizeof(conf_stat)) + VLIMIT_ALIGN_LINE(sizeof(ip_stat) * vlimit_slot_size(bench_slots)) +
+         VLIMIT_ALIGN_LINE(sizeof(file_stat) * vlimit_slot_size(bench_slots)) +
+         VLIMIT_ALIGN_LINE(sizeof(file_name) * vlimit_slot_size(bench_slots)) +
+         VLIMIT_ALIGN_LINE(sizeof(bench_result) * bench_procs) + sizeof(apr_uint32_t);
+  status = apr_shm_create(&bench_shm, size + VLIMIT_SHM_SLACK, NULL, p);
+  if (status != APR_SUCCESS) {
+    fprintf(stderr, "apr_shm_create of %lu bytes failed: %d\n", (unsigned long)size, status);
+    return 1;
+  }
+  // the same line aligned base as mod_vlimit, so that the tables share lines like in httpd
+  memset(VLIMIT_SHM_BASE(bench_shm), 0, size);
+  bench_layout(VLIMIT_SHM_BASE(bench_shm));
+  bench_make_keys(p);
+
+  for (i = 0; i < bench_procs; i++) {
+    status = apr_proc_fork(&procs[i], p);
+    if (status == APR_INCHILD) {
+      bench_worker(i, p);
+      _exit(0);
+    }
+    if (status != APR_INPARENT) {
+      fprintf(stderr, "fork failed: %d\n", status);
+      return 1;
+    }
+  }
+
+  start = bench_now_ns();
+  apr_atomic_set32(bench_start, 1);
+  for (i = 0; i < bench_procs; i++) {
+    apr_proc_wait(&procs[i], &code, &why, APR_WAIT);
+    if (why != APR_PROC_EXIT || code != 0) {
+      fprintf(stderr, "process %d failed, why %d code %d\n", i, why, code);
+      failed++;
+    }
+  }
+  seconds = (double)(bench_now_ns() - start) / 1e9;
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < bench_procs; i++) {
+    bench_merge(&total.inc, &bench_results[i].inc);
+    bench_merge(&total.dec, &bench_results[i].dec);
+    total.full += bench_results[i].full;
+    total.lock_failures += bench_results[i].lock_failures;
+    total.retries += bench_results[i].retries;
+  }
+  drift = bench_drift();
+
+  printf("table %s procs %d ops %d keys %d hot %d%% slots %d part %d stripes %d depth %d atomic %s overflow %s\n",
+         bench_table, bench_procs, bench_ops, bench_keys, bench_hot, bench_stat.max_slots, bench_stat.part_slots,
+         bench_stripes, bench_depth, vlimit_atomic ? "on" : "off", vlimit_overflow_evict ? "evict" : "reject");
+  bench_print("inc", &total.inc, seconds);
+  bench_print("dec", &total.dec, seconds);
+  printf("full %llu lock_failures %llu atomic_retries %llu evictions %u drift %d  %.3fs\n",
+         (unsigned long long)total.full, (unsigned long long)total.lock_failures, (unsigned long long)total.retries,
+         bench_stat.stat_shm->evictions, drift, seconds);
+
+  apr_shm_destroy(bench_shm);
+
+  return failed || drift || total.lock_failures ? 1 : 0;
+}
@@ -23,8 +23,11 @@
 // -------------------------------------------------------------------
 */
 
-#include <libgen.h>
+#include <arpa/inet.h>
+#include <errno.h>
 #include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <unixd.h>
 
@@ -35,28 +38,54 @@
 #include <http_main.h>
 #include <http_protocol.h>
 #include <http_request.h>
-
+#include <ap_mpm.h>
+#include <mod_status.h>
+#include <scoreboard.h>
+#include <util_time.h>
+
+#include <apr_atomic.h>
+#include <apr_lib.h>
+#include <apr_network_io.h>
 #include <apr_shm.h>
 #include <apr_strings.h>
 #include <apr_global_mutex.h>
+#include <apr_hash.h>
+#include <apr_memcache.h>
+#include <apr_signal.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+
+#include "vlimit_shm.h"
 
-#define MODULE_NAME "mod_vlimit"
 #define MODULE_VERSION "1.00-odp3"
 #define SET_VLIMITDEFAULT 0
 #define SET_VLIMITIP 1
 #define SET_VLIMITFILE 2
-#define IP_MAX 15
-#define MAX_FILENAME 256
 
 /* change for environment */
-#define MAX_CLIENTS 512
+#define VLIMIT_DEFAULT_MAX_SLOTS 512
+#define VLIMIT_MAX_SLOTS_LIMIT 1048576
+#define VLIMIT_MAX_MUTEX_STRIPES 1024
+#define VLIMIT_MAX_WAIT_MS 60000
+#define VLIMIT_MAX_WAITERS 1024
+#define VLIMIT_LOAD_KNEE 500 /* per mille of MaxRequestWorkers busy before VlimitIP auto tightens */
+#define VLIMIT_MAX_RATE_INTERVAL 86400
+#define VLIMIT_MAX_LOG_BUFFER 1048576
+#define VLIMIT_LOG_FLUSH_INTERVAL apr_time_from_sec(1)
+#define VLIMIT_MIN_LEASES 64
+#define VLIMIT_LEASE_SWEEP_INTERVAL apr_time_from_sec(5)
+#define VLIMIT_DEFAULT_SYNC_INTERVAL 1
+#define VLIMIT_MAX_SYNC_INTERVAL 3600
+#define VLIMIT_SYNC_MAX_KEYS 4096 /* slots exchanged with the VlimitBackend per window at most */
+#define VLIMIT_SYNC_POLL apr_time_from_msec(100)
+#define VLIMIT_MEMCACHE_PORT 11211
+#define VLIMIT_MEMCACHE_SERVER_TTL 15
 #define VLIMIT_LOG_FILE "/tmp/mod_vlimit.log"
-#define VLIMIT_LOG_FLAG_FILE "/tmp/VLIMIT_LOG"
-#define VLIMIT_DEBUG_FLAG_FILE "/tmp/VLIMIT_DEBUG"
-#define VLIMIT_IP_STAT_FILE "/tmp/vlimit_ip_stat.list"
-#define VLIMIT_IP_STAT_FLAG_FILE "/tmp/VLIMIT_IP_STAT"
-#define VLIMIT_FILE_STAT_FILE "/tmp/vlimit_file_stat.list"
-#define VLIMIT_FILE_STAT_FLAG_FILE "/tmp/VLIMIT_FILE_STAT"
+#define VLIMIT_STATUS_HANDLER "vlimit-status"
+#define VLIMIT_STATUS_TOP 10
+#define VLIMIT_STATUS_MAX_TOP 100
+#define VLIMIT_MUTEX_TYPE "vlimit" /* Mutex directive name of the slot table mutexes, httpd 2.4 */
 
 #ifndef MAXSYMLINKS
 #define MAXSYMLINKS 256
@@ -69,64 +98,169 @@
 #ifdef __APACHE24__
 #define remote_ip client_ip
 #define unixd_set_global_mutex_perms ap_unixd_set_global_mutex_perms
+#define unixd_setup_child ap_unixd_setup_child
+#include <ap_expr.h>
+#include <util_mutex.h>
+#if AP_MODULE_MAGIC_AT_LEAST(20120211, 52)
+#define VLIMIT_HAVE_CONN_MASTER /* conn_rec->master, HTTP/2 streams run on secondary connections */
+#endif
 #endif
 
 module AP_MODULE_DECLARE_DATA vlimit_module;
 
-typedef struct {
-  int type;        /* max number of connections per IP */
-  int ip_limit;    /* max number of connections per IP */
-  int file_limit;  /* max number of connections per IP */
-  int conf_id;     /* directive id */
-  char *full_path; /* option target file realpath */
+/* VlimitExempt, multibit trie walked 4 bits at a time, a node fills one cache line */
+#define VLIMIT_EXEMPT_STRIDE 4
+#define VLIMIT_EXEMPT_FANOUT (1 << VLIMIT_EXEMPT_STRIDE)
+#define VLIMIT_EXEMPT_COVERED -1 /* child whose whole range is exempt */
+
+typedef struct vlimit_exempt_node_str {
+  int child[VLIMIT_EXEMPT_FANOUT]; /* index of the next node, 0 none, or VLIMIT_EXEMPT_COVERED */
+} vlimit_exempt_node;
+
+typedef struct vlimit_exempt_str {
+  apr_array_header_t *v4; /* vlimit_exempt_node, root first, NULL without an IPv4 prefix */
+  apr_array_header_t *v6; /* same for IPv6 */
+} vlimit_exempt;
+
+/* what a request under a registered config goes through, frozen by vlimit_init */
+#define VLIMIT_DECIDE_IP 0x01    /* count and check the ip table */
+#define VLIMIT_DECIDE_FILE 0x02  /* count and check the file table */
+#define VLIMIT_DECIDE_PATH 0x04  /* only requests for full_path, counted under path_key */
+#define VLIMIT_DECIDE_QUICK 0x08 /* server config, the ip table is checked by vlimit_quick_handler */
+#define VLIMIT_DECIDE_KEY 0x10   /* VlimitKey, count and check the file table of key_cfg */
+
+typedef struct vlimit_decision_str {
+  int flags;             /* VLIMIT_DECIDE_*, 0 when the config sets no limit */
+  SHM_DATA *limit_stat;  /* slot tables of the config */
+  apr_uint64_t path_key; /* file key of full_path */
+} vlimit_decision;
+
+typedef struct vlimit_config_str {
+  int type;                          /* max number of connections per IP */
+  int ip_limit;                      /* max number of connections per IP */
+  int ip_limit_min;                  /* VlimitIP auto, ip_limit at full load, -1 when ip_limit is fixed */
+  int file_limit;                    /* max number of connections per IP */
+  int conf_id;                       /* directive id, -1 until a limit is set */
+  int max_slots;                     /* VlimitMaxSlots, 0 means inherit */
+  int ip_rate;                       /* VlimitIPRate requests per ip_rate_interval */
+  int ip_rate_interval;              /* VlimitIPRate interval ms */
+  int file_rate;                     /* VlimitFileRate requests per file_rate_interval */
+  int file_rate_interval;            /* VlimitFileRate interval ms */
+  int ip_prefix4;                    /* VlimitIPPrefix bits of IPv4, 0 means inherit */
+  int ip_prefix6;                    /* VlimitIPPrefix bits of IPv6, 0 means inherit */
+  char *full_path;                   /* option target file realpath */
+  int full_path_ident;               /* full_path_dev/inode valid, full_path existed at config time */
+  apr_dev_t full_path_dev;           /* device of full_path */
+  apr_ino_t full_path_inode;         /* inode of full_path */
+  struct vlimit_config_str *srv_cfg; /* server config of the defining vhost */
+  server_rec *server;                /* registered configs, the defining vhost */
+  const char *section;               /* registered configs, path of the defining section, NULL server context */
+  SHM_DATA *limit_stat;              /* slot tables, set by vlimit_init */
+  apr_hash_t *host_names;            /* server config only, lowercase ServerName/ServerAlias */
+  apr_array_header_t *wild_names;    /* server config only, wildcard ServerAlias */
+  vlimit_exempt *exempt;             /* server config only, VlimitExempt, NULL when none */
+  vlimit_decision decision;          /* registered configs, set by vlimit_init */
+  struct vlimit_config_str *key_cfg; /* VlimitKey, registered config whose file table counts the key values */
+  struct vlimit_config_str *parent;  /* merged copies only, the enclosing section setting a limit, NULL none */
+  const char *sizing;                /* section set VlimitMaxSlots / VlimitIPPrefix, "<directive> in <path>" */
+  const char *key_name;              /* key_cfg only, VlimitKey name */
+#ifdef __APACHE24__
+  ap_expr_info_t *key_expr; /* key_cfg only, VlimitKey expression, parsed once at config time */
+#endif
 } vlimit_config;
 
-typedef struct ip_data {
-  char address[IP_MAX];
-  int counter;
-} ip_stat;
-
-typedef struct file_data {
-  char filename[MAX_FILENAME];
-  int counter;
-} file_stat;
-
-typedef struct shm_data_str {
-  file_stat file_stat_shm[MAX_CLIENTS];
-  ip_stat ip_stat_shm[MAX_CLIENTS];
-} SHM_DATA;
+/* whether a config needs the ip / file slot table */
+#define VLIMIT_IP_TRACKED(cfg) ((cfg)->ip_limit > 0 || (cfg)->ip_rate > 0)
+#define VLIMIT_FILE_TRACKED(cfg) ((cfg)->file_limit > 0 || (cfg)->file_rate > 0)
+
+/* counts one config took for a request in fixups, vlimit_response_end drops each */
+typedef struct vlimit_count_str {
+  vlimit_config *cfg;            /* registered config the counts were taken for */
+  int file_slot;                 /* file_stat slot incremented, -1 none */
+  int ip_slot;                   /* ip_stat slot incremented, -1 none */
+  apr_uint32_t file_gen;         /* gen of file_slot when counted */
+  apr_uint32_t ip_gen;           /* gen of ip_slot when counted */
+  int lease;                     /* lease_stat entry recording both slots, -1 none */
+  struct vlimit_count_str *next; /* counts of the config checked before, NULL none */
+} vlimit_count;
+
+/* per request, set by the first hook that needs it */
+typedef struct vlimit_request_note_str {
+  const char *access_host; /* Host header without port, lowercase */
+  int host_match;          /* -1 not checked yet, 1 access_host is a name of r->server, 0 not */
+  int exempt;              /* -1 not checked yet, 1 client address is in VlimitExempt, 0 not */
+  vlimit_count *counts;    /* counts taken in fixups, one per config of the section chain and VlimitKey */
+  vlimit_config *srv_cfg;  /* server config counted by vlimit_quick_handler */
+  int srv_ip_slot;         /* ip_stat slot incremented in quick_handler, -1 none */
+  apr_uint32_t srv_ip_gen; /* gen of srv_ip_slot when counted */
+  int srv_lease;           /* lease_stat entry of srv_ip_slot, -1 none */
+  struct vlimit_conn_note_str *conn; /* VlimitIPScope connection, connection whose active this request holds */
+} vlimit_request_note;
+
+/* VlimitIPScope connection, per master connection, set up by vlimit_pre_connection */
+#define VLIMIT_CONN_FREE 0     /* not counted */
+#define VLIMIT_CONN_COUNTING 1 /* a request is counting the connection, its siblings count themselves */
+#define VLIMIT_CONN_COUNTED 2  /* ip_slot holds one count until the connection pool is cleaned up */
+
+typedef struct vlimit_conn_note_str {
+  volatile apr_uint32_t state;  /* VLIMIT_CONN_*, the fields below are valid once COUNTED */
+  volatile apr_uint32_t active; /* requests of the connection in flight, HTTP/2 streams run in parallel */
+  vlimit_config *srv_cfg;       /* server config the connection is counted under */
+  int ip_slot;                  /* ip_stat slot of srv_cfg, -1 none */
+  apr_uint32_t ip_gen;          /* gen of ip_slot when counted */
+  int lease;                    /* lease_stat entry of ip_slot, -1 none */
+} vlimit_conn_note;
 
 // shared memory
 apr_shm_t *shm;
-SHM_DATA *shm_base = NULL;
+void *shm_base = NULL;
 apr_file_t *vlimit_log_fp = NULL;
 static int conf_counter = 0;
 
-// grobal mutex
-apr_global_mutex_t *vlimit_mutex;
-
-/* --------------------------------------- */
-/* --- Debug in SYSLOG Logging Routine --- */
-/* --------------------------------------- */
-char *vlimit_debug_log_buf = NULL;
-static int VLIMIT_DEBUG_SYSLOG(const char *key, const char *msg, apr_pool_t *p)
-{
-  char *vlimit_buf = NULL;
+// configs with a limit set, the shm segment is laid out from this list
+static apr_array_header_t *vlimit_conf_list = NULL;
 
-  if (access(VLIMIT_DEBUG_FLAG_FILE, F_OK) == 0) {
-    vlimit_buf = (char *)apr_psprintf(p, MODULE_NAME ": %s%s", key, msg);
+// sections with VlimitMaxSlots / VlimitIPPrefix, vlimit_init refuses those that end up without a limit
+static apr_array_header_t *vlimit_sizing_list = NULL;
 
-    openlog(NULL, LOG_PID, LOG_SYSLOG);
-   // syslog(LOG_DEBUG, vlimit_buf);
-    syslog(LOG_DEBUG, "%s", vlimit_buf);
-    closelog();
+// VlimitIP auto, VlimitAutoLoad: load_scale of the shm header, sampled by the parent in the monitor hook
+static volatile apr_uint32_t *vlimit_load_scale = NULL;
+static int vlimit_auto_used = 0;
+static double vlimit_auto_load = 0;
 
-    return 0;
+/* ip_limit of cfg now, between ip_limit_min and ip_limit as the load goes */
+static int vlimit_ip_limit(const vlimit_config *cfg)
+{
+  if (cfg->ip_limit_min < 0 || vlimit_load_scale == NULL) {
+    return cfg->ip_limit;
   }
 
-  return -1;
+  return cfg->ip_limit_min + (int)((apr_uint64_t)(cfg->ip_limit - cfg->ip_limit_min) *
+                                   apr_atomic_read32(vlimit_load_scale) / VLIMIT_LOAD_SCALE_ONE);
 }
 
+// VlimitRetain: keep shm block and mutexes across restarts while the layout is unchanged
+#define VLIMIT_RETAINED_KEY "mod_vlimit-retained"
+typedef struct vlimit_retained_str {
+  apr_shm_t *shm;
+  apr_global_mutex_t **mutex;
+  int stripes;
+} vlimit_retained;
+static int vlimit_retain = 0;
+
+// VlimitShmFile: name of the shm block, so that vlimitctl can attach it; anonymous when NULL
+static const char *vlimit_shm_file = NULL;
+
+// VlimitIPScope connection: the server VlimitIP counts connections instead of requests
+static int vlimit_ip_scope_conn = 0;
+
+// VlimitKey set anywhere, its requests hold a lease more
+static int vlimit_key_used = 0;
+
+// lease table after the shm header, one entry per in-flight request
+static lease_stat *vlimit_lease_shm = NULL;
+static int vlimit_lease_count = 0;
+
 /* ----------------------------------- */
 /* --- Create Share Config Routine --- */
 /* ----------------------------------- */
@@ -136,9 +270,33 @@ static vlimit_config *create_share_config(apr_pool_t *p)
 
   cfg->type = SET_VLIMITDEFAULT;
   cfg->ip_limit = 0;
+  cfg->ip_limit_min = -1;
   cfg->file_limit = 0;
   cfg->full_path = NULL;
-  cfg->conf_id = conf_counter++;
+  cfg->full_path_ident = 0;
+  cfg->max_slots = 0;
+  cfg->ip_rate = 0;
+  cfg->ip_rate_interval = 0;
+  cfg->file_rate = 0;
+  cfg->file_rate_interval = 0;
+  cfg->ip_prefix4 = 0;
+  cfg->ip_prefix6 = 0;
+  cfg->conf_id = -1;
+  cfg->srv_cfg = NULL;
+  cfg->limit_stat = NULL;
+  cfg->host_names = NULL;
+  cfg->wild_names = NULL;
+  cfg->exempt = NULL;
+  cfg->decision.flags = 0;
+  cfg->decision.limit_stat = NULL;
+  cfg->decision.path_key = 0;
+  cfg->key_cfg = NULL;
+  cfg->parent = NULL;
+  cfg->sizing = NULL;
+  cfg->key_name = NULL;
+#ifdef __APACHE24__
+  cfg->key_expr = NULL;
+#endif
 
   return cfg;
 }
@@ -146,10 +304,11 @@ static vlimit_config *create_share_config(apr_pool_t *p)
 /* ------------------------------------ */
 /* --- Create Server Config Routine --- */
 /* ------------------------------------ */
-/* Create per-server configuration structure. Used by the quick handler. */
+/* Create per-server configuration structure. Used by the quick handler, and by the normal handler as the
+ * root of the per-dir chain. */
 static void *vlimit_create_server_config(apr_pool_t *p, server_rec *s)
 {
-  VLIMIT_DEBUG_SYSLOG("vlimit_create_server_config: ", "create server config.", p);
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_create_server_config: ", "create server config.");
   return create_share_config(p);
 }
 
@@ -159,794 +318,2976 @@ static void *vlimit_create_server_config(apr_pool_t *p, server_rec *s)
 /* Create per-directory configuration structure. Used by the normal handler. */
 static void *vlimit_create_dir_config(apr_pool_t *p, char *path)
 {
-  VLIMIT_DEBUG_SYSLOG("vlimit_create_dir_config: ", "create dir config.", p);
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_create_dir_config: ", "create dir config.");
   return create_share_config(p);
 }
 
-/* -------------- */
-/* file stat data */
-/* -------------- */
-static int get_file_slot_id(SHM_DATA *limit_stat, request_rec *r)
+/* -------------------------------- */
+/* --- Merge Dir Config Routine --- */
+/* -------------------------------- */
+/* Every enclosing section setting a limit is checked: a section with a limit below another one gets a
+ * copy chained to it by parent, a section without one inherits the chain as is. Runs per request on the
+ * walks, so a copy only where two limits nest */
+static void *vlimit_merge_dir_config(apr_pool_t *p, void *basev, void *addv)
+{
+  vlimit_config *base = (vlimit_config *)basev;
+  vlimit_config *add = (vlimit_config *)addv;
+  vlimit_config *merged;
+
+  if (add->conf_id < 0) {
+    return basev;
+  }
+  if (base->conf_id < 0) {
+    return addv;
+  }
+  // the same section merged again is already on the chain
+  for (merged = base; merged != NULL; merged = merged->parent) {
+    if (merged->conf_id == add->conf_id) {
+      return basev;
+    }
+  }
+
+  merged = (vlimit_config *)apr_palloc(p, sizeof(*merged));
+  *merged = *add;
+  merged->parent = base;
+
+  return merged;
+}
+
+/* ----------------------------------- */
+/* --- Exempt Prefix Trie Routine --- */
+/* ----------------------------------- */
+/* nibble d of a network order address, most significant first */
+#define VLIMIT_EXEMPT_NIBBLE(addr, d) ((((const unsigned char *)(addr))[(d) / 2] >> ((d) % 2 ? 0 : 4)) & 0x0f)
+
+static int vlimit_exempt_new_node(apr_array_header_t *nodes)
+{
+  vlimit_exempt_node *node = (vlimit_exempt_node *)apr_array_push(nodes);
+
+  memset(node, 0, sizeof(*node));
+  return nodes->nelts - 1;
+}
+
+/* config time, a prefix below one already covered adds nothing, one above drops the nodes it covers */
+static void vlimit_exempt_insert(apr_array_header_t *nodes, const void *addr, int bits)
 {
 
+  vlimit_exempt_node *node;
+  int id = 0;
+  int child;
+  int high;
+  int d = 0;
   int i;
 
-  for (i = 0; i < MAX_CLIENTS; i++) {
-    if (strcmp(limit_stat->file_stat_shm[i].filename, basename(r->filename)) == 0) {
-      return i;
+  for (; bits > VLIMIT_EXEMPT_STRIDE; bits -= VLIMIT_EXEMPT_STRIDE, d++) {
+    child = APR_ARRAY_IDX(nodes, id, vlimit_exempt_node).child[VLIMIT_EXEMPT_NIBBLE(addr, d)];
+    if (child == VLIMIT_EXEMPT_COVERED) {
+      return;
+    }
+    if (child == 0) {
+      child = vlimit_exempt_new_node(nodes);
+      APR_ARRAY_IDX(nodes, id, vlimit_exempt_node).child[VLIMIT_EXEMPT_NIBBLE(addr, d)] = child;
     }
+    id = child;
   }
 
-  return -1;
+  // the last 0-4 bits cover a run of children, as many as the bits left open
+  node = &APR_ARRAY_IDX(nodes, id, vlimit_exempt_node);
+  high = VLIMIT_EXEMPT_NIBBLE(addr, d) & ~((1 << (VLIMIT_EXEMPT_STRIDE - bits)) - 1);
+  for (i = 0; i < (1 << (VLIMIT_EXEMPT_STRIDE - bits)); i++) {
+    node->child[high | i] = VLIMIT_EXEMPT_COVERED;
+  }
 }
 
-static int get_file_empty_slot_id(SHM_DATA *limit_stat, request_rec *r)
+/* at most 8 (IPv4) or 32 (IPv6) nodes, no lock and no shared memory */
+static int vlimit_exempt_lookup(const apr_array_header_t *nodes, const void *addr, int bits)
 {
 
-  int i;
+  const vlimit_exempt_node *node = (const vlimit_exempt_node *)nodes->elts;
+  int child;
+  int d;
 
-  for (i = 0; i < MAX_CLIENTS; i++) {
-    if (limit_stat->file_stat_shm[i].filename[0] == '\0') {
-      return i;
+  for (d = 0; d < bits / VLIMIT_EXEMPT_STRIDE; d++) {
+    child = node->child[VLIMIT_EXEMPT_NIBBLE(addr, d)];
+    if (child <= 0) {
+      return child == VLIMIT_EXEMPT_COVERED;
     }
+    node = &((const vlimit_exempt_node *)nodes->elts)[child];
   }
 
-  // slot full
-  return -1;
+  return 0;
 }
 
-static int get_file_counter(SHM_DATA *limit_stat, request_rec *r)
+/* address[/bits] of IPv4 or IPv6, ::ffff:a.b.c.d/96+n is put in the IPv4 trie */
+static const char *vlimit_exempt_add(apr_pool_t *p, vlimit_exempt *exempt, const char *arg)
 {
 
-  int id;
+  unsigned char addr[16];
+  apr_array_header_t **nodes;
+  char *str = apr_pstrdup(p, arg);
+  char *slash = strchr(str, '/');
+  char *end;
+  long bits;
+  int max;
+
+  if (slash != NULL) {
+    *slash++ = '\0';
+  }
+  if (inet_pton(AF_INET, str, addr) == 1) {
+    max = 32;
+  } else if (inet_pton(AF_INET6, str, addr) == 1) {
+    max = 128;
+  } else {
+    return apr_psprintf(p, "VlimitExempt: %s is not an IPv4 or IPv6 address", str);
+  }
 
-  id = get_file_slot_id(limit_stat, r);
+  bits = max;
+  if (slash != NULL) {
+    bits = strtol(slash, &end, 10);
+    if (end == slash || *end != '\0' || bits < 0 || bits > max) {
+      return apr_psprintf(p, "VlimitExempt: bad prefix length in %s", arg);
+    }
+  }
 
-  if (id == -1) {
-    id = get_file_empty_slot_id(limit_stat, r);
+  if (max == 128 && bits >= 96 && VLIMIT_IP_KEY_IS_V4((const ip_key *)addr)) {
+    memmove(addr, addr + 12, 4);
+    bits -= 96;
+    max = 32;
   }
 
-  if (id >= 0) {
-    return limit_stat->file_stat_shm[id].counter;
+  nodes = max == 32 ? &exempt->v4 : &exempt->v6;
+  if (*nodes == NULL) {
+    *nodes = apr_array_make(p, 8, sizeof(vlimit_exempt_node));
+    vlimit_exempt_new_node(*nodes);
   }
+  vlimit_exempt_insert(*nodes, addr, (int)bits);
 
-  // slot full
-  return -1;
+  return NULL;
 }
 
-static int inc_file_counter(SHM_DATA *limit_stat, request_rec *r)
+/* ------------------------ */
+/* --- Slot Key Routine --- */
+/* ------------------------ */
+/* per path, so /a/index.php and /b/index.php have a counter each */
+static apr_uint64_t get_file_key(request_rec *r)
 {
+  return vlimit_hash_string64(r->filename);
+}
 
-  int id;
-  int old, new;
+/* client address of the connection, masked by VlimitIPPrefix */
+static apr_uint32_t get_ip_key(SHM_DATA *limit_stat, request_rec *r, ip_key *key)
+{
+#ifdef __APACHE24__
+  return vlimit_ip_key(limit_stat, r->connection->client_addr, key);
+#else
+  return vlimit_ip_key(limit_stat, r->connection->remote_addr, key);
+#endif
+}
 
-  id = get_file_slot_id(limit_stat, r);
+/* ----------------------------- */
+/* --- Request Lease Routine --- */
+/* ----------------------------- */
+/* a child killed mid-request never reaches vlimit_response_end, the lease keeps its counts findable */
+static int claim_lease(request_rec *r, int conf_id, int file_slot, apr_uint32_t file_gen, int ip_slot,
+                       apr_uint32_t ip_gen)
+{
 
-  if (id == -1) {
-    id = get_file_empty_slot_id(limit_stat, r);
-    if (id != -1) {
-      strcpy(limit_stat->file_stat_shm[id].filename, basename(r->filename));
-    }
-  }
+  apr_uint32_t pid = (apr_uint32_t)getpid();
+  int id;
+  int t;
 
-  if (id >= 0) {
-    while (1) {
-      old = limit_stat->file_stat_shm[id].counter;
-      new = old + 1;
-      if (limit_stat->file_stat_shm[id].counter == old) {
-        limit_stat->file_stat_shm[id].counter = new;
-        break;
-      }
+  if (vlimit_lease_shm == NULL) {
+    return -1;
+  }
+
+  // start at the entry of the connection, worker threads rarely probe further
+  id = (int)(r->connection->id % vlimit_lease_count);
+  for (t = 0; t < vlimit_lease_count; t++) {
+    if (vlimit_lease_shm[id].pid == 0 && apr_atomic_cas32(&vlimit_lease_shm[id].pid, pid, 0) == 0) {
+      vlimit_lease_shm[id].generation = (apr_uint32_t)ap_my_generation;
+      vlimit_lease_shm[id].touched = vlimit_rate_now();
+      vlimit_lease_shm[id].conf_id = conf_id;
+      vlimit_lease_shm[id].file_gen = file_gen;
+      vlimit_lease_shm[id].ip_gen = ip_gen;
+      vlimit_lease_shm[id].file_slot = file_slot;
+      vlimit_lease_shm[id].ip_slot = ip_slot;
+      return id;
     }
-    return 0;
+    id = (id + 1) % vlimit_lease_count;
   }
 
-  // slot full
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "claim_lease: ", "lease table full, counts of this request untracked.");
   return -1;
 }
 
-static int dec_file_counter(SHM_DATA *limit_stat, request_rec *r)
+static void release_lease(int id)
 {
+  vlimit_lease_shm[id].file_slot = -1;
+  vlimit_lease_shm[id].ip_slot = -1;
+  apr_atomic_set32(&vlimit_lease_shm[id].pid, 0);
+}
 
-  int id;
-  int old, new;
+/* parent only, whether the process holding leases as pid of generation is gone. A pid the kernel still
+ * knows may have been handed to another process since, the owner is only alive as the child of that pid
+ * and that generation on the scoreboard */
+static int lease_owner_dead(apr_uint32_t pid, apr_uint32_t generation)
+{
 
-  id = get_file_slot_id(limit_stat, r);
+  apr_proc_t proc;
+  int slot;
 
-  if (id >= 0) {
-    while (1) {
-      old = limit_stat->file_stat_shm[id].counter;
-      new = old - 1;
-      if (limit_stat->file_stat_shm[id].counter == old) {
-        limit_stat->file_stat_shm[id].counter = new;
-        break;
-      }
-    }
+  if (kill((pid_t)pid, 0) == -1 && errno == ESRCH) {
+    return 1;
+  }
+  if (ap_scoreboard_image == NULL) {
     return 0;
   }
 
-  // unexpected error
-  VLIMIT_DEBUG_SYSLOG("dec_file_counter: ", "unexpected error. file slot not found.", r->pool);
-  return -1;
+  proc.pid = (pid_t)pid;
+  slot = ap_find_child_by_pid(&proc);
+
+  return slot < 0 || (apr_uint32_t)ap_scoreboard_image->parent[slot].generation != generation;
 }
 
-void unset_file_counter(SHM_DATA *limit_stat, request_rec *r)
+/* parent only, drop the counts of leases whose process is gone */
+static void sweep_leases(void)
 {
 
+  apr_uint32_t checked_pid = 0;
+  apr_uint32_t checked_generation = 0;
+  int checked_dead = 0;
+  vlimit_config *cfg;
+  lease_stat *lease;
   int id;
 
-  id = get_file_slot_id(limit_stat, r);
+  for (id = 0; id < vlimit_lease_count; id++) {
+    lease = &vlimit_lease_shm[id];
+    // claim_lease writes the generation before the slots, a lease without slots may still be filled in
+    if (lease->pid == 0 || (lease->file_slot < 0 && lease->ip_slot < 0)) {
+      continue;
+    }
+    // a child usually holds several leases, ask once per run of the same owner
+    if (lease->pid != checked_pid || lease->generation != checked_generation) {
+      checked_pid = lease->pid;
+      checked_generation = lease->generation;
+      checked_dead = lease_owner_dead(checked_pid, checked_generation);
+    }
+    if (!checked_dead || lease->conf_id < 0 || lease->conf_id >= vlimit_conf_list->nelts) {
+      continue;
+    }
 
-  if (limit_stat->file_stat_shm[id].counter == 0) {
-    limit_stat->file_stat_shm[id].filename[0] = '\0';
+    cfg = APR_ARRAY_IDX(vlimit_conf_list, lease->conf_id, vlimit_config *);
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "sweep_leases: ",
+                        "pid %u died, conf_id: %d file_slot: %d ip_slot: %d released after %u ms", checked_pid,
+                        lease->conf_id, lease->file_slot, lease->ip_slot, vlimit_rate_now() - lease->touched);
+    if (lease->file_slot >= 0) {
+      dec_file_counter(cfg->limit_stat, lease->file_slot, lease->file_gen);
+    }
+    if (lease->ip_slot >= 0) {
+      dec_ip_counter(cfg->limit_stat, lease->ip_slot, lease->ip_gen);
+    }
+    release_lease(id);
   }
 }
 
-/* ------------ */
-/* ip stat data */
-/* ------------ */
-static int get_ip_slot_id(SHM_DATA *limit_stat, request_rec *r)
+/* one lease per worker thread of every process, twice that for requests left in async write completion */
+static int vlimit_lease_table_size(void)
 {
 
-  int i;
+  int daemons = 0;
+  int threads = 0;
+  int count;
 
-  for (i = 0; i < MAX_CLIENTS; i++) {
-    if (strcmp(limit_stat->ip_stat_shm[i].address, r->connection->remote_ip) == 0) {
-      return i;
-    }
+  if (ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &daemons) != APR_SUCCESS || daemons < 1) {
+    daemons = 1;
+  }
+  if (ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &threads) != APR_SUCCESS || threads < 1) {
+    threads = 1;
   }
 
-  return -1;
+  count = daemons * threads * 2;
+  if (vlimit_key_used) {
+    count += daemons * threads;
+  }
+  // VlimitIPScope connection: open connections hold one each, event keeps idle ones past its threads
+  if (vlimit_ip_scope_conn) {
+    count *= 3;
+  }
+  return count < VLIMIT_MIN_LEASES ? VLIMIT_MIN_LEASES : count;
 }
 
-static int get_ip_empty_slot_id(SHM_DATA *limit_stat, request_rec *r)
-{
+/* ------------------------------- */
+/* --- Counter Backend Routine --- */
+/* ------------------------------- */
+/* the shm tables always count the requests of this node, a backend adds the counts of the other nodes */
+typedef struct vlimit_backend_str {
+  const char *name;
+  const char *(*configure)(cmd_parms *parms, const char *arg); /* VlimitBackend argument, config time */
+  apr_status_t (*init)(apr_pool_t *p, server_rec *s);           /* parent, post_config */
+  void (*sync)(apr_pool_t *p, apr_uint32_t window);             /* sync process, once per VlimitSyncInterval */
+} vlimit_backend;
+
+static const char *vlimit_memcache_configure(cmd_parms *parms, const char *arg);
+static apr_status_t vlimit_memcache_init(apr_pool_t *p, server_rec *s);
+static void vlimit_memcache_sync(apr_pool_t *p, apr_uint32_t window);
+
+static const vlimit_backend vlimit_backends[] = {
+    {"shm", NULL, NULL, NULL},
+    {"memcache", vlimit_memcache_configure, vlimit_memcache_init, vlimit_memcache_sync},
+    {NULL, NULL, NULL, NULL},
+};
 
-  int i;
+// VlimitBackend, VlimitSyncInterval
+static const vlimit_backend *vlimit_backend_used = &vlimit_backends[0];
+static int vlimit_sync_interval = VLIMIT_DEFAULT_SYNC_INTERVAL;
+static apr_pool_t *vlimit_sync_pool = NULL;
+static apr_uint32_t vlimit_synced_window = 0;
+static apr_proc_t *vlimit_sync_proc = NULL; /* parent, the process running the exchanges, NULL none */
 
-  for (i = 0; i < MAX_CLIENTS; i++) {
-    if (limit_stat->ip_stat_shm[i].address[0] == '\0') {
-      return i;
-    }
+static const char *vlimit_memcache_servers = NULL;
+static apr_memcache_t *vlimit_memcache = NULL;
+
+static const char *vlimit_memcache_configure(cmd_parms *parms, const char *arg)
+{
+  if (arg == NULL) {
+    return "VlimitBackend memcache needs host[:port][,host[:port]...]";
   }
+  vlimit_memcache_servers = arg;
 
-  // slot full
-  return -1;
+  return NULL;
 }
 
-static int get_ip_counter(SHM_DATA *limit_stat, request_rec *r)
+static apr_status_t vlimit_memcache_init(apr_pool_t *p, server_rec *s)
 {
 
-  int id;
+  apr_memcache_server_t *server;
+  apr_status_t status;
+  apr_port_t port;
+  char *servers = apr_pstrdup(p, vlimit_memcache_servers);
+  char *last;
+  char *token;
+  char *host;
+  char *scope;
+  int count = 1;
 
-  id = get_ip_slot_id(limit_stat, r);
+  for (token = servers; *token; token++) {
+    count += *token == ',';
+  }
 
-  if (id == -1) {
-    id = get_ip_empty_slot_id(limit_stat, r);
+  status = apr_memcache_create(p, (apr_uint16_t)count, 0, &vlimit_memcache);
+  if (status != APR_SUCCESS) {
+    return status;
   }
 
-  if (id >= 0) {
-    return limit_stat->ip_stat_shm[id].counter;
+  for (token = apr_strtok(servers, ",", &last); token != NULL; token = apr_strtok(NULL, ",", &last)) {
+    status = apr_parse_addr_port(&host, &scope, &port, token, p);
+    if (status != APR_SUCCESS || host == NULL) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_memcache_init: ", "bad memcache server %s", token);
+      return status != APR_SUCCESS ? status : APR_EGENERAL;
+    }
+    status = apr_memcache_server_create(p, host, port ? port : VLIMIT_MEMCACHE_PORT, 0, 1, 1,
+                                        apr_time_from_sec(VLIMIT_MEMCACHE_SERVER_TTL), &server);
+    if (status == APR_SUCCESS) {
+      status = apr_memcache_add_server(vlimit_memcache, server);
+    }
+    if (status != APR_SUCCESS) {
+      return status;
+    }
   }
 
-  // slot full
-  return -1;
+  return APR_SUCCESS;
 }
 
-static int inc_ip_counter(SHM_DATA *limit_stat, request_rec *r)
+/* add count to a window key, whichever node comes first creates it */
+static apr_status_t vlimit_memcache_add_count(apr_pool_t *p, const char *key, apr_uint32_t count)
 {
 
-  int id;
-
-  id = get_ip_slot_id(limit_stat, r);
+  apr_uint32_t value;
+  apr_status_t status;
+  char *data;
+  int t;
 
-  if (id == -1) {
-    id = get_ip_empty_slot_id(limit_stat, r);
-    if (id != -1) {
-      strcpy(limit_stat->ip_stat_shm[id].address, r->connection->remote_ip);
+  for (t = 0; t < 2; t++) {
+    status = apr_memcache_incr(vlimit_memcache, key, (apr_int32_t)count, &value);
+    if (status != APR_NOTFOUND) {
+      return status;
+    }
+    data = apr_psprintf(p, "%u", count);
+    status = apr_memcache_add(vlimit_memcache, key, data, strlen(data), vlimit_sync_interval * 3, 0);
+    if (status != APR_EEXIST) {
+      return status;
     }
   }
 
-  if (id >= 0) {
-    limit_stat->ip_stat_shm[id].counter++;
-    return 0;
-  }
-
-  // slot full
-  return -1;
+  return status;
 }
 
-static int dec_ip_counter(SHM_DATA *limit_stat, request_rec *r)
+/* requests counted by every node in the previous window, less ours, become remote of the slot */
+static apr_uint32_t vlimit_memcache_exchange(apr_pool_t *p, const char *key, apr_uint32_t window,
+                                             apr_uint32_t local, apr_uint32_t published)
 {
 
-  int id;
+  apr_uint32_t total;
+  apr_uint16_t flags;
+  apr_size_t len;
+  char *data;
 
-  id = get_ip_slot_id(limit_stat, r);
+  if (local > 0) {
+    vlimit_memcache_add_count(p, apr_psprintf(p, "%s:%u", key, window), local);
+  }
 
-  if (id >= 0) {
-    limit_stat->ip_stat_shm[id].counter--;
+  if (apr_memcache_getp(vlimit_memcache, p, apr_psprintf(p, "%s:%u", key, window - 1), &data, &len, &flags) !=
+      APR_SUCCESS) {
     return 0;
   }
+  total = (apr_uint32_t)strtoul(apr_pstrmemdup(p, data, len), NULL, 10);
 
-  // unexpected error
-  VLIMIT_DEBUG_SYSLOG("dec_ip_counter: ", "unexpected error. ip slot not found.", r->pool);
-  return -1;
+  return total > published ? total - published : 0;
 }
 
-void unset_ip_counter(SHM_DATA *limit_stat, request_rec *r)
+/* one more exchange this window, while under VLIMIT_SYNC_MAX_KEYS and before the window ends */
+static int vlimit_sync_budget(int *budget, apr_time_t deadline)
 {
-
-  int id;
-
-  id = get_ip_slot_id(limit_stat, r);
-
-  if (limit_stat->ip_stat_shm[id].counter == 0) {
-    limit_stat->ip_stat_shm[id].address[0] = '\0';
+  if (*budget <= 0) {
+    return 0;
+  }
+  if (apr_time_now() >= deadline) {
+    *budget = 0;
+    return 0;
   }
+  (*budget)--;
+
+  return 1;
 }
 
-static int make_ip_slot_list(SHM_DATA *limit_stat, request_rec *r)
+/* each active slot adds its counter to the key of the current window once, and reads the previous window */
+static void vlimit_memcache_sync(apr_pool_t *p, apr_uint32_t window)
 {
 
+  SHM_DATA *limit_stat;
+  vlimit_config *cfg;
+  ip_stat ip;
+  file_stat file;
+  apr_uint32_t published;
+  apr_uint32_t remote;
+  const char *key;
+  int consecutive = vlimit_synced_window + 1 == window;
+  apr_time_t deadline = apr_time_from_sec((apr_time_t)(window + 1) * vlimit_sync_interval);
+  int budget = VLIMIT_SYNC_MAX_KEYS;
+  int t;
   int i;
-  int len;
-  time_t t;
-  char *log_time;
-  char *vlimit_log_buf;
-
-  if (access(VLIMIT_IP_STAT_FLAG_FILE, F_OK) == 0 && access(VLIMIT_IP_STAT_FILE, F_OK) != 0) {
-    time(&t);
-    log_time = (char *)ctime(&t);
-    len = strlen(log_time);
-    log_time[len - 1] = '\0';
-
-    apr_file_t *vlimit_make_ip_slot_fp = NULL;
 
-    if (apr_file_open(&vlimit_make_ip_slot_fp, VLIMIT_IP_STAT_FILE, APR_WRITE | APR_APPEND | APR_CREATE, APR_OS_DEFAULT,
-                      r->pool) != APR_SUCCESS) {
-      return OK;
+  for (t = 0; t < vlimit_conf_list->nelts; t++) {
+    cfg = APR_ARRAY_IDX(vlimit_conf_list, t, vlimit_config *);
+    limit_stat = cfg->limit_stat;
+    if (limit_stat == NULL) {
+      continue;
     }
 
-    for (i = 0; i < MAX_CLIENTS; i++) {
-      if (limit_stat->ip_stat_shm[i].counter > 0) {
-        vlimit_log_buf = (char *)apr_psprintf(r->pool, "[%s] slot=[%d] ipaddress=[%s] counter=[%d]\n", log_time, i,
-                                              limit_stat->ip_stat_shm[i].address, limit_stat->ip_stat_shm[i].counter);
-        apr_file_puts(vlimit_log_buf, vlimit_make_ip_slot_fp);
+    for (i = 0; limit_stat->ip_stat_shm != NULL && i < limit_stat->max_slots; i++) {
+      ip = limit_stat->ip_stat_shm[i];
+      if (ip.state != VLIMIT_SLOT_USED || (ip.counter == 0 && ip.remote == 0)) {
+        continue;
+      }
+      // past the budget the slot sits this window out, nothing of it is in the window then
+      if (!vlimit_sync_budget(&budget, deadline)) {
+        limit_stat->ip_stat_shm[i].published = 0;
+        continue;
+      }
+      // counts published in a skipped window are not in the previous one
+      published = consecutive ? ip.published : 0;
+      key = apr_psprintf(p, "vlimit:%d:ip:%08x%08x%08x%08x", cfg->conf_id, ntohl(ip.address.word[0]),
+                         ntohl(ip.address.word[1]), ntohl(ip.address.word[2]), ntohl(ip.address.word[3]));
+      remote = vlimit_memcache_exchange(p, key, window, ip.counter, published);
+      // the slot may have been handed to another key meanwhile, its next sync sets it right
+      if (limit_stat->ip_stat_shm[i].gen == ip.gen && limit_stat->ip_stat_shm[i].hash == ip.hash) {
+        apr_atomic_set32(&limit_stat->ip_stat_shm[i].remote, remote);
+        limit_stat->ip_stat_shm[i].published = ip.counter;
       }
     }
 
-    apr_file_flush(vlimit_make_ip_slot_fp);
-
-    if (apr_file_close(vlimit_make_ip_slot_fp) != APR_SUCCESS) {
-      return OK;
+    for (i = 0; limit_stat->file_stat_shm != NULL && i < limit_stat->max_slots; i++) {
+      file = limit_stat->file_stat_shm[i];
+      if (file.state != VLIMIT_SLOT_USED || (file.counter == 0 && file.remote == 0)) {
+        continue;
+      }
+      if (!vlimit_sync_budget(&budget, deadline)) {
+        limit_stat->file_stat_shm[i].published = 0;
+        continue;
+      }
+      published = consecutive ? file.published : 0;
+      key = apr_psprintf(p, "vlimit:%d:file:%016llx", cfg->conf_id, (unsigned long long)file.key);
+      remote = vlimit_memcache_exchange(p, key, window, file.counter, published);
+      if (limit_stat->file_stat_shm[i].gen == file.gen && limit_stat->file_stat_shm[i].key == file.key) {
+        apr_atomic_set32(&limit_stat->file_stat_shm[i].remote, remote);
+        limit_stat->file_stat_shm[i].published = file.counter;
+      }
     }
-
-    return 0;
   }
-
-  return -1;
 }
 
-static int make_file_slot_list(SHM_DATA *limit_stat, request_rec *r)
+/* sync process: exchange once per window until the parent goes away or kills it; a slow or unreachable
+ * backend only delays the remote counts, never the parent */
+static void vlimit_sync_run(void)
 {
 
-  int i;
-  int len;
-  time_t t;
-  char *log_time;
-  char *vlimit_log_buf;
-
-  if (access(VLIMIT_FILE_STAT_FLAG_FILE, F_OK) == 0 && access(VLIMIT_FILE_STAT_FILE, F_OK) != 0) {
-    time(&t);
-    log_time = (char *)ctime(&t);
-    len = strlen(log_time);
-    log_time[len - 1] = '\0';
-
-    apr_file_t *vlimit_make_file_slot_fp = NULL;
-
-    if (apr_file_open(&vlimit_make_file_slot_fp, VLIMIT_FILE_STAT_FILE, APR_WRITE | APR_APPEND | APR_CREATE,
-                      APR_OS_DEFAULT, r->pool) != APR_SUCCESS) {
-      return OK;
+  pid_t parent = getppid();
+  apr_uint32_t window;
+
+  // the handlers of the parent would restart httpd from here
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGUSR1, SIG_DFL);
+  unixd_setup_child();
+
+  while (getppid() == parent) {
+    window = (apr_uint32_t)(apr_time_sec(apr_time_now()) / vlimit_sync_interval);
+    if (window != vlimit_synced_window) {
+      vlimit_backend_used->sync(vlimit_sync_pool, window);
+      vlimit_synced_window = window;
+      apr_pool_clear(vlimit_sync_pool);
     }
+    apr_sleep(VLIMIT_SYNC_POLL);
+  }
+}
 
-    for (i = 0; i < MAX_CLIENTS; i++) {
-      if (limit_stat->file_stat_shm[i].counter > 0) {
-        vlimit_log_buf =
-            (char *)apr_psprintf(r->pool, "[%s] slot=[%d] filename=[%s] counter=[%d]\n", log_time, i,
-                                 limit_stat->file_stat_shm[i].filename, limit_stat->file_stat_shm[i].counter);
-        apr_file_puts(vlimit_log_buf, vlimit_make_file_slot_fp);
-      }
+/* parent, the MPM reaps the sync process and tells here; the next monitor run starts another */
+static void vlimit_sync_maintenance(int reason, void *data, apr_wait_t status)
+{
+  apr_proc_t *proc = (apr_proc_t *)data;
+  apr_exit_why_e why;
+  int code;
+
+  switch (reason) {
+  case APR_OC_REASON_DEATH:
+  case APR_OC_REASON_LOST:
+    vlimit_sync_proc = NULL;
+    apr_proc_other_child_unregister(data);
+    break;
+  case APR_OC_REASON_RESTART:
+  case APR_OC_REASON_UNREGISTER:
+    // restart or pconf cleanup, the process holds the config of this generation
+    if (vlimit_sync_proc == proc) {
+      vlimit_sync_proc = NULL;
+      kill(proc->pid, SIGKILL);
+      apr_proc_wait(proc, &code, &why, APR_WAIT);
     }
-
-    apr_file_flush(vlimit_make_file_slot_fp);
-
-    if (apr_file_close(vlimit_make_file_slot_fp) != APR_SUCCESS) {
-      return OK;
+    if (reason == APR_OC_REASON_RESTART) {
+      apr_proc_other_child_unregister(data);
     }
-
-    return 0;
+    break;
   }
-
-  return -1;
 }
 
-/* ------------------------------------------- */
-/* --- Request Transaction Logging Routine --- */
-/* ------------------------------------------- */
-static int vlimit_logging(const char *msg, request_rec *r, vlimit_config *cfg, SHM_DATA *limit_stat)
+/* parent only, called from the monitor hook with pconf: keep the sync process running */
+static void vlimit_backend_sync(apr_pool_t *p)
 {
-  int len;
-  time_t t;
-  char *log_time;
-  char *vlimit_log_buf;
-
-  if (access(VLIMIT_LOG_FLAG_FILE, F_OK) == 0) {
-    time(&t);
-    log_time = (char *)ctime(&t);
-    len = strlen(log_time);
-    log_time[len - 1] = '\0';
-
-    vlimit_log_buf = (char *)apr_psprintf(r->pool, "[%s] pid=[%d] name=[%s] client=[%s] %s ip_count: %d/%d "
-                                                   "file_count: %d/%d file=[%s] \n",
-                                          log_time, getpid(), apr_table_get(r->headers_in, "HOST"),
-                                          r->connection->remote_ip, msg, get_ip_counter(limit_stat, r), cfg->ip_limit,
-                                          get_file_counter(limit_stat, r), cfg->file_limit, r->filename);
+  apr_proc_t *proc;
+  apr_status_t status;
 
-    apr_file_puts(vlimit_log_buf, vlimit_log_fp);
-    apr_file_flush(vlimit_log_fp);
+  if (vlimit_backend_used->sync == NULL || vlimit_sync_pool == NULL || vlimit_conf_list == NULL ||
+      vlimit_sync_proc != NULL) {
+    return;
+  }
 
-    return 0;
+  proc = (apr_proc_t *)apr_pcalloc(p, sizeof(*proc));
+  status = apr_proc_fork(proc, p);
+  if (status == APR_INCHILD) {
+    vlimit_sync_run();
+    _exit(0);
+  }
+  if (status != APR_INPARENT) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_backend_sync: ", "sync process can't be started: %d", status);
+    return;
   }
 
-  return -1;
+  vlimit_sync_proc = proc;
+  apr_proc_other_child_register(proc, vlimit_sync_maintenance, proc, NULL, p);
 }
 
-static int check_virtualhost_name(request_rec *r)
+/* ---------------------------------------------- */
+/* --- Status Handler Routine (vlimit-status) --- */
+/* ---------------------------------------------- */
+/* SetHandler vlimit-status, copies the tables of every config and reports from the copy, no mutex taken */
+typedef struct vlimit_status_entry_str {
+  int slot;
+  apr_uint32_t counter;
+  const char *key; /* address or filename tail */
+} vlimit_status_entry;
+
+typedef struct vlimit_status_table_str {
+  int slots;                /* 0 when the config has no such table */
+  int used;                 /* slots claimed, including those kept for a pending rate */
+  apr_uint32_t connections; /* sum of the counters */
+  int top_n;
+  vlimit_status_entry *top; /* counters in descending order */
+} vlimit_status_table;
+
+typedef struct vlimit_status_conf_str {
+  vlimit_config *cfg;
+  conf_stat stat;
+  conf_stat_shard hot; /* shards of stat added up */
+  vlimit_status_table ip;
+  vlimit_status_table file;
+} vlimit_status_conf;
+
+/* keep the top_max largest counters, top is sorted in descending order */
+static void status_top_insert(vlimit_status_table *table, int top_max, int slot, apr_uint32_t counter)
 {
-
   int i;
-  const char *header_name;
-  const char *alias_name;
-  char *access_host;
-  char *last;
 
-  header_name = apr_table_get(r->headers_in, "HOST");
-  if (header_name == NULL) {
-    header_name = "NoHostHeader";
+  if (table->top_n == top_max && table->top[top_max - 1].counter >= counter) {
+    return;
   }
 
-  access_host = apr_strtok((char *)header_name, ":", &last);
-  if (access_host == NULL) {
-    access_host = (char *)header_name;
+  i = table->top_n < top_max ? table->top_n++ : top_max - 1;
+  for (; i > 0 && table->top[i - 1].counter < counter; i--) {
+    table->top[i] = table->top[i - 1];
   }
+  table->top[i].slot = slot;
+  table->top[i].counter = counter;
+}
 
-  if (strcmp(access_host, r->server->server_hostname) == 0) {
-    vlimit_debug_log_buf =
-        apr_psprintf(r->pool, "Match: access_name=(%s) ServerName=(%s)", access_host, r->server->server_hostname);
-    VLIMIT_DEBUG_SYSLOG("check_virtualhost_name: ", vlimit_debug_log_buf, r->pool);
-    return 0;
-  }
+static void status_snapshot_ip(SHM_DATA *limit_stat, vlimit_status_table *table, int top_max, apr_pool_t *p)
+{
 
-  if (r->server->names) {
-    for (i = 0; i < r->server->names->nelts; i++) {
-      alias_name = ((char **)r->server->names->elts)[i];
-      vlimit_debug_log_buf = apr_psprintf(r->pool, "INFO: access_name=(%s) ServerAlias=(%s)", access_host, alias_name);
-      VLIMIT_DEBUG_SYSLOG("check_virtualhost_name: ", vlimit_debug_log_buf, r->pool);
-      if (strcmp(access_host, alias_name) == 0) {
-        vlimit_debug_log_buf =
-            apr_psprintf(r->pool, "Match: access_name=(%s) ServerAlias=(%s)", access_host, alias_name);
-        VLIMIT_DEBUG_SYSLOG("check_virtualhost_name: ", vlimit_debug_log_buf, r->pool);
-        return 0;
-      }
-    }
-  }
+  ip_stat *copy;
+  int i;
 
-  vlimit_debug_log_buf = apr_psprintf(r->pool, "Not Match: access_name=(%s)", access_host);
-  VLIMIT_DEBUG_SYSLOG("check_virtualhost_name: ", vlimit_debug_log_buf, r->pool);
+  copy = (ip_stat *)apr_palloc(p, sizeof(ip_stat) * limit_stat->max_slots);
+  memcpy(copy, limit_stat->ip_stat_shm, sizeof(ip_stat) * limit_stat->max_slots);
 
-  return 1;
+  table->slots = limit_stat->max_slots;
+  table->top = (vlimit_status_entry *)apr_pcalloc(p, sizeof(vlimit_status_entry) * top_max);
+  for (i = 0; i < limit_stat->max_slots; i++) {
+    if (copy[i].state != VLIMIT_SLOT_USED) {
+      continue;
+    }
+    table->used++;
+    if (copy[i].counter > 0) {
+      table->connections += copy[i].counter;
+      status_top_insert(table, top_max, i, copy[i].counter);
+    }
+  }
+  for (i = 0; i < table->top_n; i++) {
+    table->top[i].key = get_ip_key_string(&copy[table->top[i].slot].address, p);
+  }
 }
 
-/* ------------------------------------------------- */
-/* --- Check Connections from Clinets to Files  --- */
-/* ------------------------------------------------- */
-/* Generic function to check a request against a config. */
-static int vlimit_check_limit(request_rec *r, vlimit_config *cfg)
+static void status_snapshot_file(SHM_DATA *limit_stat, vlimit_status_table *table, int top_max, apr_pool_t *p)
 {
 
-  const char *header_name;
-  const char *access_host;
-  char *last;
+  file_stat *copy;
+  int i;
 
-  int ip_count = 0;
-  int file_count = 0;
-  int counter_stat = 0;
+  copy = (file_stat *)apr_palloc(p, sizeof(file_stat) * limit_stat->max_slots);
+  memcpy(copy, limit_stat->file_stat_shm, sizeof(file_stat) * limit_stat->max_slots);
 
-  if (!ap_is_initial_req(r)) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "SKIPPED: Initial Reqeusts.", r->pool);
-    return DECLINED;
+  table->slots = limit_stat->max_slots;
+  table->top = (vlimit_status_entry *)apr_pcalloc(p, sizeof(vlimit_status_entry) * top_max);
+  for (i = 0; i < limit_stat->max_slots; i++) {
+    if (copy[i].state != VLIMIT_SLOT_USED) {
+      continue;
+    }
+    table->used++;
+    if (copy[i].counter > 0) {
+      table->connections += copy[i].counter;
+      status_top_insert(table, top_max, i, copy[i].counter);
+    }
   }
-
-  if (cfg->ip_limit <= 0 && cfg->file_limit <= 0) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "SKIPPED: cfg->ip_limit <= 0 && cfg->file_limit <= 0", r->pool);
-    return DECLINED;
+  // only the names of the reported slots are copied
+  for (i = 0; i < table->top_n; i++) {
+    table->top[i].key = apr_pstrndup(p, limit_stat->file_name_shm[table->top[i].slot].filename, VLIMIT_FILE_NAME_LEN);
   }
+}
 
-  header_name = apr_table_get(r->headers_in, "HOST");
-  if (header_name == NULL) {
-    header_name = "NoHostHeader";
-  }
-  
-  access_host = apr_strtok((char *)header_name, ":", &last);
-  if (access_host == NULL) {
-    access_host = (char *)header_name;
+/* label and string values of both formats, quote and backslash escaped, control characters dropped */
+static const char *status_escape(apr_pool_t *p, const char *str)
+{
+  char *out = (char *)apr_palloc(p, strlen(str) * 2 + 1);
+  char *d = out;
+
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      *d++ = '\\';
+    } else if ((unsigned char)*str < 0x20) {
+      continue;
+    }
+    *d++ = *str;
   }
+  *d = '\0';
 
-  vlimit_debug_log_buf =
-      apr_psprintf(r->pool, "client info: address=(%s) access_host=(%s)", r->connection->remote_ip, access_host);
-  VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", vlimit_debug_log_buf, r->pool);
+  return out;
+}
 
-  SHM_DATA *limit_stat;
-  limit_stat = shm_base + cfg->conf_id;
+static void status_print_json_table(request_rec *r, const char *name, vlimit_status_table *table, int limit)
+{
+  int i;
 
-  if (make_ip_slot_list(limit_stat, r) != -1) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "make_ip_slot_list exec. create list(" VLIMIT_IP_STAT_FILE ").",
-                        r->pool);
+  ap_rprintf(r, ",\"%s\":{\"limit\":%d,\"slots\":%d,\"used\":%d,\"connections\":%u,\"top\":[", name, limit,
+             table->slots, table->used, table->connections);
+  for (i = 0; i < table->top_n; i++) {
+    ap_rprintf(r, "%s{\"key\":\"%s\",\"count\":%u}", i ? "," : "", status_escape(r->pool, table->top[i].key),
+               table->top[i].counter);
   }
+  ap_rputs("]}", r);
+}
 
-  if (make_file_slot_list(limit_stat, r) != -1) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "make_file_slot_list exec. create list(" VLIMIT_FILE_STAT_FILE ").",
-                        r->pool);
-  }
+/* "name":{"le":[bounds],"count":[per bucket],"sum":n}, the last bucket has no bound */
+static void status_print_json_histogram(request_rec *r, const char *name, const apr_uint32_t *buckets, int n,
+                                        int shift, apr_uint32_t sum)
+{
+  int i;
 
-  if (check_virtualhost_name(r)) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "access_host != server_hostname. return OK.", r->pool);
-    return OK;
+  ap_rprintf(r, ",\"%s\":{\"le\":[", name);
+  for (i = 0; i < n - 1; i++) {
+    ap_rprintf(r, "%s%u", i ? "," : "", 1U << (i * shift));
   }
-
-  // vlimit_mutex lock
-  VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "vlimit_mutex locked.", r->pool);
-  if (apr_global_mutex_lock(vlimit_mutex) != APR_SUCCESS) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "vlimit_mutex lock failed.", r->pool);
-    return OK;
+  ap_rputs("],\"count\":[", r);
+  for (i = 0; i < n; i++) {
+    ap_rprintf(r, "%s%u", i ? "," : "", buckets[i]);
   }
+  ap_rprintf(r, "],\"sum\":%u}", sum);
+}
 
-  if (cfg->file_limit > 0) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "type File: file_count++", r->pool);
-    counter_stat = inc_file_counter(limit_stat, r);
-    if (counter_stat == -1) {
-      VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "file counter slot full. maxclients?", r->pool);
-      return HTTP_SERVICE_UNAVAILABLE;
+static void status_print_json(request_rec *r, vlimit_status_conf *confs, int nconf)
+{
+  vlimit_status_conf *sc;
+  int t;
+
+  ap_rprintf(r, "{\"time\":%" APR_TIME_T_FMT ",\"configs\":[", apr_time_sec(r->request_time));
+  for (t = 0; t < nconf; t++) {
+    sc = &confs[t];
+    ap_rprintf(r, "%s{\"conf_id\":%d,\"full_path\":\"%s\"", t ? "," : "", sc->cfg->conf_id,
+               sc->cfg->full_path ? status_escape(r->pool, sc->cfg->full_path) : "");
+    if (sc->ip.slots > 0) {
+      status_print_json_table(r, "ip", &sc->ip, vlimit_ip_limit(sc->cfg));
     }
-    file_count = get_file_counter(limit_stat, r);
-  }
-  if (cfg->ip_limit > 0) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "type IP: ip_count++", r->pool);
-    counter_stat = inc_ip_counter(limit_stat, r);
-    if (counter_stat == -1) {
-      VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "ip counter slot full. maxclients?", r->pool);
-      return HTTP_SERVICE_UNAVAILABLE;
+    if (sc->file.slots > 0) {
+      status_print_json_table(r, sc->cfg->key_name ? "key" : "file", &sc->file, sc->cfg->file_limit);
     }
-    ip_count = get_ip_counter(limit_stat, r);
-  }
+    if (sc->cfg->key_name != NULL) {
+      ap_rprintf(r, ",\"key_name\":\"%s\"", status_escape(r->pool, sc->cfg->key_name));
+    }
+    ap_rprintf(r, ",\"accepted\":%u,\"rejects\":{\"ip\":%u,\"file\":%u,\"rate\":%u,\"full\":%u}", sc->hot.accepted,
+               sc->stat.ip_rejects, sc->stat.file_rejects, sc->stat.rate_rejects, sc->stat.full_rejects);
+    ap_rprintf(r, ",\"evictions\":%u,\"lock_failures\":%u", sc->stat.evictions, sc->stat.lock_failures);
+    ap_rprintf(r, ",\"waits\":{\"admitted\":%u,\"timeout\":%u}", sc->stat.waited, sc->stat.wait_timeouts);
+    status_print_json_histogram(r, "lock_wait_us", sc->hot.lock_wait, VLIMIT_LOCK_WAIT_BUCKETS, 2,
+                                sc->hot.lock_wait_sum);
+    status_print_json_histogram(r, "probe", sc->hot.probe, VLIMIT_PROBE_BUCKETS, 1, sc->hot.probe_sum);
+    ap_rputs("}", r);
+  }
+  ap_rputs("]}\n", r);
+}
 
-  // vlimit_mutex unlock
-  VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "vlimit_mutex unlocked.", r->pool);
-  if (apr_global_mutex_unlock(vlimit_mutex) != APR_SUCCESS) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "vlimit_mutex unlock failed.", r->pool);
-    return OK;
+/* field 0 slots, 1 used, 2 connections; samples of a metric have to stay together */
+static void status_print_prom_gauge(request_rec *r, vlimit_status_conf *confs, int nconf, const char *metric,
+                                    const char *help, int field)
+{
+  vlimit_status_table *table;
+  apr_uint32_t value;
+  int t;
+  int v;
+
+  ap_rprintf(r, "# HELP %s %s\n# TYPE %s gauge\n", metric, help, metric);
+  for (t = 0; t < nconf; t++) {
+    for (v = 0; v < 2; v++) {
+      table = v ? &confs[t].file : &confs[t].ip;
+      if (table->slots == 0) {
+        continue;
+      }
+      value = field == 0 ? (apr_uint32_t)table->slots : (apr_uint32_t)table->used;
+      if (field == 2) {
+        value = table->connections;
+      }
+      ap_rprintf(r, "%s{conf_id=\"%d\",table=\"%s\"} %u\n", metric, confs[t].cfg->conf_id, v ? "file" : "ip",
+                 value);
+    }
   }
+}
 
-  vlimit_debug_log_buf =
-      apr_psprintf(r->pool, "conf_id: %d name: %s  uri: %s  ip_count: %d/%d file_count: %d/%d", cfg->conf_id,
-                   r->server->server_hostname, r->filename, ip_count, cfg->ip_limit, file_count, cfg->file_limit);
-  VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", vlimit_debug_log_buf, r->pool);
-
-  if (cfg->ip_limit > 0 && ip_count > cfg->ip_limit) {
-    vlimit_debug_log_buf = apr_psprintf(r->pool, "Rejected, too many connections from this host(%s) to the file(%s) by "
-                                                 "VlimitIP[ip_limit=(%d) docroot=(%s)].",
-                                        r->connection->remote_ip, access_host, cfg->ip_limit, cfg->full_path);
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", vlimit_debug_log_buf, r->pool);
+/* which 0 lock wait, 1 probe length; buckets are cumulative in this format */
+static void status_print_prom_histogram(request_rec *r, vlimit_status_conf *confs, int nconf, const char *metric,
+                                        const char *help, int which)
+{
+  const apr_uint32_t *buckets;
+  apr_uint32_t count;
+  apr_uint32_t sum;
+  int shift = which ? 1 : 2;
+  int n = which ? VLIMIT_PROBE_BUCKETS : VLIMIT_LOCK_WAIT_BUCKETS;
+  int t;
+  int i;
 
-    if (counter_stat != -2) {
-      vlimit_logging("RESULT: 503 INC", r, cfg, limit_stat);
+  ap_rprintf(r, "# HELP %s %s\n# TYPE %s histogram\n", metric, help, metric);
+  for (t = 0; t < nconf; t++) {
+    buckets = which ? confs[t].hot.probe : confs[t].hot.lock_wait;
+    sum = which ? confs[t].hot.probe_sum : confs[t].hot.lock_wait_sum;
+    count = 0;
+    for (i = 0; i < n; i++) {
+      count += buckets[i];
+      if (i < n - 1) {
+        ap_rprintf(r, "%s_bucket{conf_id=\"%d\",le=\"%u\"} %u\n", metric, confs[t].cfg->conf_id, 1U << (i * shift),
+                   count);
+      } else {
+        ap_rprintf(r, "%s_bucket{conf_id=\"%d\",le=\"+Inf\"} %u\n", metric, confs[t].cfg->conf_id, count);
+      }
     }
+    ap_rprintf(r, "%s_sum{conf_id=\"%d\"} %u\n%s_count{conf_id=\"%d\"} %u\n", metric, confs[t].cfg->conf_id, sum,
+               metric, confs[t].cfg->conf_id, count);
+  }
+}
 
-    return HTTP_SERVICE_UNAVAILABLE;
+static void status_print_prom(request_rec *r, vlimit_status_conf *confs, int nconf)
+{
+  vlimit_status_table *table;
+  int t;
+  int v;
+  int i;
+
+  status_print_prom_gauge(r, confs, nconf, "vlimit_slots", "Slots of the table.", 0);
+  status_print_prom_gauge(r, confs, nconf, "vlimit_slots_used", "Slots claimed by an address or file.", 1);
+  status_print_prom_gauge(r, confs, nconf, "vlimit_connections", "Requests counted in the table.", 2);
+
+  ap_rputs("# HELP vlimit_accepted_total Requests passed by the config.\n"
+           "# TYPE vlimit_accepted_total counter\n", r);
+  for (t = 0; t < nconf; t++) {
+    ap_rprintf(r, "vlimit_accepted_total{conf_id=\"%d\"} %u\n", confs[t].cfg->conf_id, confs[t].hot.accepted);
+  }
+
+  ap_rputs("# HELP vlimit_rejects_total Requests answered 503 by the config.\n"
+           "# TYPE vlimit_rejects_total counter\n", r);
+  for (t = 0; t < nconf; t++) {
+    ap_rprintf(r, "vlimit_rejects_total{conf_id=\"%d\",reason=\"ip\"} %u\n", confs[t].cfg->conf_id,
+               confs[t].stat.ip_rejects);
+    ap_rprintf(r, "vlimit_rejects_total{conf_id=\"%d\",reason=\"file\"} %u\n", confs[t].cfg->conf_id,
+               confs[t].stat.file_rejects);
+    ap_rprintf(r, "vlimit_rejects_total{conf_id=\"%d\",reason=\"rate\"} %u\n", confs[t].cfg->conf_id,
+               confs[t].stat.rate_rejects);
+    ap_rprintf(r, "vlimit_rejects_total{conf_id=\"%d\",reason=\"full\"} %u\n", confs[t].cfg->conf_id,
+               confs[t].stat.full_rejects);
+  }
+
+  ap_rputs("# HELP vlimit_evictions_total Slots handed to another key by VlimitOverflow evict.\n"
+           "# TYPE vlimit_evictions_total counter\n", r);
+  for (t = 0; t < nconf; t++) {
+    ap_rprintf(r, "vlimit_evictions_total{conf_id=\"%d\"} %u\n", confs[t].cfg->conf_id, confs[t].stat.evictions);
+  }
+
+  ap_rputs("# HELP vlimit_lock_failures_total vlimit_mutex lock errors.\n"
+           "# TYPE vlimit_lock_failures_total counter\n", r);
+  for (t = 0; t < nconf; t++) {
+    ap_rprintf(r, "vlimit_lock_failures_total{conf_id=\"%d\"} %u\n", confs[t].cfg->conf_id,
+               confs[t].stat.lock_failures);
+  }
+
+  ap_rputs("# HELP vlimit_waits_total Requests over a limit that waited by VlimitWait.\n"
+           "# TYPE vlimit_waits_total counter\n", r);
+  for (t = 0; t < nconf; t++) {
+    ap_rprintf(r, "vlimit_waits_total{conf_id=\"%d\",result=\"admitted\"} %u\n", confs[t].cfg->conf_id,
+               confs[t].stat.waited);
+    ap_rprintf(r, "vlimit_waits_total{conf_id=\"%d\",result=\"timeout\"} %u\n", confs[t].cfg->conf_id,
+               confs[t].stat.wait_timeouts);
+  }
+
+  status_print_prom_histogram(r, confs, nconf, "vlimit_lock_wait_microseconds", "Time spent waiting on vlimit_mutex.",
+                              0);
+  status_print_prom_histogram(r, confs, nconf, "vlimit_probe_length", "Slots looked at by a key lookup.", 1);
+
+  ap_rputs("# HELP vlimit_top_connections Largest counters of the table.\n"
+           "# TYPE vlimit_top_connections gauge\n", r);
+  for (t = 0; t < nconf; t++) {
+    for (v = 0; v < 2; v++) {
+      table = v ? &confs[t].file : &confs[t].ip;
+      for (i = 0; i < table->top_n; i++) {
+        ap_rprintf(r, "vlimit_top_connections{conf_id=\"%d\",table=\"%s\",key=\"%s\"} %u\n", confs[t].cfg->conf_id,
+                   v ? "file" : "ip", status_escape(r->pool, table->top[i].key), table->top[i].counter);
+      }
+    }
   }
-  if (cfg->file_limit > 0 && file_count > cfg->file_limit) {
-    vlimit_debug_log_buf = apr_psprintf(r->pool, "Rejected, too many connections to the file(%s) by "
-                                                 "VlimitFile[limit=(%d) docroot=(%s)].",
-                                        access_host, cfg->file_limit, cfg->full_path);
-    VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", vlimit_debug_log_buf, r->pool);
+}
+
+static int vlimit_status_handler(request_rec *r)
+{
+
+  vlimit_status_conf *confs;
+  vlimit_config *cfg;
+  char *args;
+  char *arg;
+  char *last;
+  int top_max = VLIMIT_STATUS_TOP;
+  int json = 0;
+  int nconf = 0;
+  int t;
 
-    if (counter_stat != -2) {
-      vlimit_logging("RESULT: 503 INC", r, cfg, limit_stat);
+  if (r->handler == NULL || strcmp(r->handler, VLIMIT_STATUS_HANDLER) != 0) {
+    return DECLINED;
+  }
+
+  r->allowed |= (AP_METHOD_BIT << M_GET);
+  if (r->method_number != M_GET) {
+    return HTTP_METHOD_NOT_ALLOWED;
+  }
+
+  // ?format=json&top=N, Prometheus text by default; whole keys only, so stop= or xformat= do not count
+  if (r->args != NULL) {
+    args = apr_pstrdup(r->pool, r->args);
+    for (arg = apr_strtok(args, "&", &last); arg != NULL; arg = apr_strtok(NULL, "&", &last)) {
+      if (strcmp(arg, "format=json") == 0) {
+        json = 1;
+      } else if (strncmp(arg, "top=", 4) == 0) {
+        top_max = atoi(arg + 4);
+        if (top_max < 1 || top_max > VLIMIT_STATUS_MAX_TOP) {
+          top_max = VLIMIT_STATUS_TOP;
+        }
+      }
     }
+  }
 
-    return HTTP_SERVICE_UNAVAILABLE;
-    // return HTTP_NOT_FOUND;
+  ap_set_content_type(r, json ? "application/json" : "text/plain; version=0.0.4");
+  apr_table_setn(r->headers_out, "Cache-Control", "no-cache");
+  if (r->header_only) {
+    return OK;
   }
 
-  // all check passed, return response normally
-  VLIMIT_DEBUG_SYSLOG("vlimit_check_limit: ", "OK: Passed all checks", r->pool);
+  // take every copy before formatting, so the report shows one moment
+  confs = (vlimit_status_conf *)apr_pcalloc(r->pool, sizeof(vlimit_status_conf) *
+                                                         (vlimit_conf_list != NULL ? vlimit_conf_list->nelts : 1));
+  for (t = 0; vlimit_conf_list != NULL && t < vlimit_conf_list->nelts; t++) {
+    cfg = APR_ARRAY_IDX(vlimit_conf_list, t, vlimit_config *);
+    if (cfg->limit_stat == NULL) {
+      continue;
+    }
+    confs[nconf].cfg = cfg;
+    confs[nconf].stat = *cfg->limit_stat->stat_shm;
+    vlimit_stat_sum(&confs[nconf].stat, &confs[nconf].hot);
+    if (cfg->limit_stat->ip_stat_shm != NULL) {
+      status_snapshot_ip(cfg->limit_stat, &confs[nconf].ip, top_max, r->pool);
+    }
+    if (cfg->limit_stat->file_stat_shm != NULL) {
+      status_snapshot_file(cfg->limit_stat, &confs[nconf].file, top_max, r->pool);
+    }
+    nconf++;
+  }
 
-  if (counter_stat != -2) {
-    vlimit_logging("RESULT:  OK INC", r, cfg, limit_stat);
+  if (json) {
+    status_print_json(r, confs, nconf);
+  } else {
+    status_print_prom(r, confs, nconf);
   }
 
   return OK;
 }
 
-/* ------------------------------------------------- */
-/* --- Analyze from the Path to RealPath Routine --- */
-/* ------------------------------------------------- */
-static char *realpath_for_vlimit(const char *path, char *resolved_path, int maxreslth, apr_pool_t *p)
+/* counters of every config on the mod_status page, the slot tables are left to vlimit-status */
+static int vlimit_mod_status_hook(request_rec *r, int flags)
 {
 
-  int readlinks = 0;
-  int n;
-
-  char *npath;
-  char link_path[PATH_MAX + 1];
-  char *buf;
+  vlimit_config *cfg;
+  conf_stat stat;
+  conf_stat_shard hot;
+  apr_uint32_t waits;
+  apr_uint32_t probes;
+  int t;
+  int i;
 
-  buf = apr_pcalloc(p, sizeof(char *));
-  npath = resolved_path;
+  if (vlimit_conf_list == NULL) {
+    return OK;
+  }
 
-  if (*path != '/') {
-    if (!getcwd(npath, maxreslth - 2)) {
-      return NULL;
+  if (!(flags & AP_STATUS_SHORT)) {
+    ap_rputs("<hr />\n<h2>mod_vlimit</h2>\n<table border=\"0\"><tr><th>conf_id</th><th>accepted</th><th>ip</th>"
+             "<th>file</th><th>rate</th><th>full</th><th>lock failures</th><th>lock waits</th><th>avg wait us</th>"
+             "<th>avg probe</th></tr>\n", r);
+  }
+  for (t = 0; t < vlimit_conf_list->nelts; t++) {
+    cfg = APR_ARRAY_IDX(vlimit_conf_list, t, vlimit_config *);
+    if (cfg->limit_stat == NULL) {
+      continue;
     }
-    npath += strlen(npath);
-    if (npath[-1] != '/') {
-      *npath++ = '/';
+    stat = *cfg->limit_stat->stat_shm;
+    vlimit_stat_sum(&stat, &hot);
+    waits = 0;
+    probes = 0;
+    for (i = 0; i < VLIMIT_LOCK_WAIT_BUCKETS; i++) {
+      waits += hot.lock_wait[i];
+    }
+    for (i = 0; i < VLIMIT_PROBE_BUCKETS; i++) {
+      probes += hot.probe[i];
+    }
+
+    if (flags & AP_STATUS_SHORT) {
+      ap_rprintf(r, "Vlimit%dAccepted: %u\nVlimit%dIPRejects: %u\nVlimit%dFileRejects: %u\n", cfg->conf_id,
+                 hot.accepted, cfg->conf_id, stat.ip_rejects, cfg->conf_id, stat.file_rejects);
+      ap_rprintf(r, "Vlimit%dRateRejects: %u\nVlimit%dFullRejects: %u\nVlimit%dEvictions: %u\n", cfg->conf_id,
+                 stat.rate_rejects, cfg->conf_id, stat.full_rejects, cfg->conf_id, stat.evictions);
+      ap_rprintf(r, "Vlimit%dLockFailures: %u\nVlimit%dWaitAdmitted: %u\nVlimit%dWaitTimeouts: %u\n", cfg->conf_id,
+                 stat.lock_failures, cfg->conf_id, stat.waited, cfg->conf_id, stat.wait_timeouts);
+      ap_rprintf(r, "Vlimit%dLockWaits: %u\nVlimit%dLockWaitUs: %u\nVlimit%dProbes: %u\nVlimit%dProbeSlots: %u\n",
+                 cfg->conf_id, waits, cfg->conf_id, hot.lock_wait_sum, cfg->conf_id, probes, cfg->conf_id,
+                 hot.probe_sum);
+    } else {
+      ap_rprintf(r, "<tr><td>%d</td><td>%u</td><td>%u</td><td>%u</td><td>%u</td><td>%u</td><td>%u</td><td>%u</td>"
+                    "<td>%.1f</td><td>%.2f</td></tr>\n", cfg->conf_id, hot.accepted, stat.ip_rejects,
+                 stat.file_rejects, stat.rate_rejects, stat.full_rejects, stat.lock_failures, waits,
+                 waits ? (double)hot.lock_wait_sum / waits : 0.0, probes ? (double)hot.probe_sum / probes : 0.0);
     }
+  }
+  if (!(flags & AP_STATUS_SHORT)) {
+    ap_rputs("</table>\n", r);
+  }
+
+  return OK;
+}
+
+/* -------------------------------------- */
+/* --- Transaction Log Buffer Routine --- */
+/* -------------------------------------- */
+/* per child, lines are collected in memory and written to vlimit_log_fp in batches; a thread of the child
+ * writes them out VLIMIT_LOG_FLUSH_INTERVAL after the last batch, the next line does where APR has none */
+static apr_size_t vlimit_log_buffer_size = 0;
+static char *vlimit_log_buffer = NULL;
+static apr_size_t vlimit_log_buffer_len = 0;
+static apr_time_t vlimit_log_flushed = 0;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *vlimit_log_mutex = NULL;
+static apr_thread_cond_t *vlimit_log_cond = NULL;
+static apr_thread_t *vlimit_log_thread = NULL;
+static int vlimit_log_stop = 0;
+#endif
+
+/* caller holds vlimit_log_mutex */
+static void vlimit_log_buffer_flush(apr_time_t now)
+{
+  apr_size_t written;
+
+  if (vlimit_log_buffer_len > 0 && vlimit_log_fp != NULL) {
+    apr_file_write_full(vlimit_log_fp, vlimit_log_buffer, vlimit_log_buffer_len, &written);
+  }
+  vlimit_log_buffer_len = 0;
+  vlimit_log_flushed = now;
+}
+
+static void vlimit_log_buffer_write(const char *line, apr_size_t len, apr_time_t now)
+{
+  apr_size_t written;
+
+#if APR_HAS_THREADS
+  if (vlimit_log_mutex != NULL && apr_thread_mutex_lock(vlimit_log_mutex) != APR_SUCCESS) {
+    return;
+  }
+#endif
+
+  if (vlimit_log_buffer_len + len > vlimit_log_buffer_size) {
+    vlimit_log_buffer_flush(now);
+  }
+  if (len > vlimit_log_buffer_size) {
+    apr_file_write_full(vlimit_log_fp, line, len, &written);
   } else {
-    *npath++ = '/';
-    path++;
+    memcpy(vlimit_log_buffer + vlimit_log_buffer_len, line, len);
+    vlimit_log_buffer_len += len;
+  }
+  if (now - vlimit_log_flushed >= VLIMIT_LOG_FLUSH_INTERVAL) {
+    vlimit_log_buffer_flush(now);
   }
 
-  while (*path != '\0') {
+#if APR_HAS_THREADS
+  if (vlimit_log_mutex != NULL) {
+    apr_thread_mutex_unlock(vlimit_log_mutex);
+  }
+#endif
+}
 
-    if (*path == '/') {
-      path++;
-      continue;
-    }
+#if APR_HAS_THREADS
+/* per child thread, writes out the lines of a child that is idle or between batches */
+static void *APR_THREAD_FUNC vlimit_log_flush_thread(apr_thread_t *thread, void *data)
+{
+  // httpd stops a child by these, leave them to the threads serving requests
+  static const int stop_signals[] = {SIGHUP, SIGTERM, SIGINT, SIGUSR1, SIGWINCH};
+  apr_interval_time_t wait;
+  apr_time_t now;
+  int i;
 
-    if (*path == '.' && (path[1] == '\0' || path[1] == '/')) {
-      path++;
+  for (i = 0; i < (int)(sizeof(stop_signals) / sizeof(stop_signals[0])); i++) {
+    apr_signal_block(stop_signals[i]);
+  }
+
+  apr_thread_mutex_lock(vlimit_log_mutex);
+  while (!vlimit_log_stop) {
+    now = apr_time_now();
+    wait = vlimit_log_flushed + VLIMIT_LOG_FLUSH_INTERVAL - now;
+    if (wait <= 0) {
+      vlimit_log_buffer_flush(now);
       continue;
     }
+    // signaled by vlimit_log_flush_stop only, a write that flushes moves vlimit_log_flushed
+    apr_thread_cond_timedwait(vlimit_log_cond, vlimit_log_mutex, wait);
+  }
+  apr_thread_mutex_unlock(vlimit_log_mutex);
 
-    if (*path == '.' && path[1] == '.' && (path[2] == '\0' || path[2] == '/')) {
-      path += 2;
-      while (npath > resolved_path + 1 && (--npath)[-1] != '/')
-        ;
-      continue;
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+
+/* pre-cleanup of the child pool, the thread is gone before vlimit_log_buffer_cleanup writes the rest */
+static apr_status_t vlimit_log_flush_stop(void *data)
+{
+  apr_status_t status;
+
+  apr_thread_mutex_lock(vlimit_log_mutex);
+  vlimit_log_stop = 1;
+  apr_thread_cond_signal(vlimit_log_cond);
+  apr_thread_mutex_unlock(vlimit_log_mutex);
+
+  apr_thread_join(&status, vlimit_log_thread);
+  vlimit_log_thread = NULL;
+
+  return APR_SUCCESS;
+}
+#endif
+
+/* write out what is left when the child exits */
+static apr_status_t vlimit_log_buffer_cleanup(void *data)
+{
+  vlimit_log_buffer_flush(apr_time_now());
+  vlimit_log_buffer = NULL;
+  vlimit_log_buffer_size = 0;
+#if APR_HAS_THREADS
+  vlimit_log_mutex = NULL;
+  vlimit_log_cond = NULL;
+#endif
+
+  return APR_SUCCESS;
+}
+
+/* ------------------------------------------- */
+/* --- Request Transaction Logging Routine --- */
+/* ------------------------------------------- */
+/* ip_count and file_count are the values the caller got from its inc/dec, no slot lookup here */
+static int vlimit_logging(const char *msg, request_rec *r, vlimit_config *cfg, int ip_count, int file_count)
+{
+  char log_time[APR_CTIME_LEN];
+  char *vlimit_log_buf;
+  apr_time_t now;
+
+  if (vlimit_log_fp != NULL && (vlimit_flag_state() & VLIMIT_FLAG_LOG)) {
+    now = apr_time_now();
+    ap_recent_ctime(log_time, now);
+
+    vlimit_log_buf = (char *)apr_psprintf(r->pool, "[%s] pid=[%d] name=[%s] client=[%s] %s ip_count: %d/%d "
+                                                   "file_count: %d/%d file=[%s] \n",
+                                          log_time, getpid(), apr_table_get(r->headers_in, "HOST"),
+                                          r->connection->remote_ip, msg, ip_count, vlimit_ip_limit(cfg), file_count,
+                                          cfg->file_limit, r->filename);
+
+    if (vlimit_log_buffer != NULL) {
+      vlimit_log_buffer_write(vlimit_log_buf, strlen(vlimit_log_buf), now);
+    } else {
+      apr_file_puts(vlimit_log_buf, vlimit_log_fp);
+      apr_file_flush(vlimit_log_fp);
     }
 
-    while (*path != '\0' && *path != '/') {
-      if (npath - resolved_path > maxreslth - 2) {
-        errno = ENAMETOOLONG;
-        return NULL;
+    return 0;
+  }
+
+  return -1;
+}
+
+/* record the counts cfg is about to take for r, newest first in note->counts */
+static vlimit_count *vlimit_add_count(request_rec *r, vlimit_request_note *note, vlimit_config *cfg)
+{
+  vlimit_count *count = (vlimit_count *)apr_palloc(r->pool, sizeof(*count));
+
+  count->cfg = cfg;
+  count->file_slot = -1;
+  count->ip_slot = -1;
+  count->file_gen = 0;
+  count->ip_gen = 0;
+  count->lease = -1;
+  count->next = note->counts;
+  note->counts = count;
+
+  return count;
+}
+
+static vlimit_request_note *get_request_note(request_rec *r)
+{
+  vlimit_request_note *note = (vlimit_request_note *)ap_get_module_config(r->request_config, &vlimit_module);
+
+  if (note == NULL) {
+    note = (vlimit_request_note *)apr_pcalloc(r->pool, sizeof(*note));
+    note->host_match = -1;
+    note->exempt = -1;
+    note->srv_ip_slot = -1;
+    note->srv_lease = -1;
+    ap_set_module_config(r->request_config, &vlimit_module, note);
+  }
+
+  return note;
+}
+
+/* VlimitIPScope connection, the note of the connection the request came on, of its master for HTTP/2 */
+static vlimit_conn_note *get_conn_note(conn_rec *c)
+{
+#ifdef VLIMIT_HAVE_CONN_MASTER
+  while (c->master != NULL) {
+    c = c->master;
+  }
+#endif
+
+  return (vlimit_conn_note *)ap_get_module_config(c->conn_config, &vlimit_module);
+}
+
+/* Host header without the port (or the brackets of an IPv6 literal), lowercase copy */
+static const char *get_access_host(request_rec *r)
+{
+  const char *header_name;
+  const char *end;
+  char *access_host;
+
+  header_name = apr_table_get(r->headers_in, "HOST");
+  if (header_name == NULL) {
+    return "NoHostHeader";
+  }
+
+  if (header_name[0] == '[' && (end = strchr(header_name, ']')) != NULL) {
+    access_host = apr_pstrmemdup(r->pool, header_name + 1, end - header_name - 1);
+  } else if ((end = strchr(header_name, ':')) != NULL) {
+    access_host = apr_pstrmemdup(r->pool, header_name, end - header_name);
+  } else {
+    access_host = apr_pstrdup(r->pool, header_name);
+  }
+  ap_str_tolower(access_host);
+
+  return access_host;
+}
+
+/* returns 1 when the Host header is not a ServerName/ServerAlias of r->server, computed once per request */
+static int check_virtualhost_name(request_rec *r)
+{
+
+  int i;
+  const char *alias_name;
+  vlimit_request_note *note = get_request_note(r);
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(r->server->module_config, &vlimit_module);
+
+  if (note->host_match >= 0) {
+    return !note->host_match;
+  }
+
+  note->access_host = get_access_host(r);
+  note->host_match = 0;
+
+  if (scfg->host_names != NULL && apr_hash_get(scfg->host_names, note->access_host, APR_HASH_KEY_STRING) != NULL) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "check_virtualhost_name: ", "Match: access_name=(%s) ServerName/ServerAlias",
+                        note->access_host);
+    note->host_match = 1;
+    return 0;
+  }
+
+  if (scfg->wild_names != NULL) {
+    for (i = 0; i < scfg->wild_names->nelts; i++) {
+      alias_name = ((char **)scfg->wild_names->elts)[i];
+      if (ap_strcasecmp_match(note->access_host, alias_name) == 0) {
+        VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "check_virtualhost_name: ", "Match: access_name=(%s) ServerAlias=(%s)",
+                            note->access_host, alias_name);
+        note->host_match = 1;
+        return 0;
       }
-      *npath++ = *path++;
     }
+  }
 
-    if (readlinks++ > MAXSYMLINKS) {
-      errno = ELOOP;
-      return NULL;
-    }
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "check_virtualhost_name: ", "Not Match: access_name=(%s)", note->access_host);
 
-    /* symlink analyzed */
-    *npath = '\0';
-    n = readlink(resolved_path, link_path, PATH_MAX);
-    if (n < 0) {
-      /* EINVAL means the file exists but isn't a symlink. */
-      if (errno != EINVAL) {
-        return NULL;
-      }
-    } else {
-      int m;
-      char *newbuf;
+  return 1;
+}
 
-      link_path[n] = '\0';
-      if (*link_path == '/') {
-        npath = resolved_path;
-      } else {
-        while (*(--npath) != '/')
-          ;
-      }
+/* client address of the connection in VlimitExempt of its server, decided once per request */
+static int vlimit_exempt_client(request_rec *r)
+{
 
-      m = strlen(path);
-      newbuf = apr_pcalloc(p, m + n + 1);
-      memcpy(newbuf, link_path, n);
-      memcpy(newbuf + n, path, m + 1);
-      path = buf = newbuf;
-    }
-    *npath++ = '/';
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(r->server->module_config, &vlimit_module);
+  vlimit_request_note *note;
+  const unsigned char *addr;
+#ifdef __APACHE24__
+  apr_sockaddr_t *sa = r->connection->client_addr;
+#else
+  apr_sockaddr_t *sa = r->connection->remote_addr;
+#endif
+
+  if (scfg->exempt == NULL) {
+    return 0;
+  }
+  note = get_request_note(r);
+  if (note->exempt >= 0) {
+    return note->exempt;
   }
 
-  if (npath != resolved_path + 1 && npath[-1] == '/') {
-    npath--;
+#if APR_HAVE_IPV6
+  if (sa->family == APR_INET6) {
+    addr = (const unsigned char *)&sa->sa.sin6.sin6_addr;
+    // v4-mapped addresses of a dual-stack listener are looked up as IPv4
+    if (VLIMIT_IP_KEY_IS_V4((const ip_key *)addr)) {
+      note->exempt = scfg->exempt->v4 != NULL && vlimit_exempt_lookup(scfg->exempt->v4, addr + 12, 32);
+    } else {
+      note->exempt = scfg->exempt->v6 != NULL && vlimit_exempt_lookup(scfg->exempt->v6, addr, 128);
+    }
+    return note->exempt;
   }
+#endif
 
-  *npath = '\0';
+  addr = (const unsigned char *)&sa->sa.sin.sin_addr;
+  note->exempt = scfg->exempt->v4 != NULL && vlimit_exempt_lookup(scfg->exempt->v4, addr, 32);
 
-  return resolved_path;
+  return note->exempt;
 }
 
-/* ----------------------------------------- */
-/* --- Access Checker for Per Dir Config --- */
-/* ----------------------------------------- */
-static int vlimit_handler(request_rec *r)
+/* count to check the limit with after a VlimitWait, the one before it when there was no room to wait */
+static int vlimit_wait_result(SHM_DATA *limit_stat, int waited, int count)
 {
-  /* get configuration information */
-  vlimit_config *cfg = (vlimit_config *)ap_get_module_config(r->per_dir_config, &vlimit_module);
+  if (waited >= 0) {
+    apr_atomic_inc32(&limit_stat->stat_shm->waited);
+    return waited;
+  }
+  if (waited == -2) {
+    apr_atomic_inc32(&limit_stat->stat_shm->wait_timeouts);
+  }
 
-  int result;
-  char *real_path_dir = (char *)apr_pcalloc(r->pool, sizeof(char *) * PATH_MAX + 1);
+  return count;
+}
+
+/* ------------------------------------------------- */
+/* --- Check Connections from Clinets to Files  --- */
+/* ------------------------------------------------- */
+/* Generic function to check a request against a config, flags are the VLIMIT_DECIDE_* to apply. */
+static int vlimit_check_limit(request_rec *r, vlimit_config *cfg, int flags)
+{
 
-  vlimit_debug_log_buf = apr_psprintf(r->pool, "cfg->ip_limit=(%d) cfg->file_limit=(%d) cfg->full_path=(%s)",
-                                      cfg->ip_limit, cfg->file_limit, cfg->full_path);
-  VLIMIT_DEBUG_SYSLOG("vlimit_handler: ", vlimit_debug_log_buf, r->pool);
+  const char *access_host;
+  int host_mismatch;
+  vlimit_request_note *note;
+  vlimit_count *count;
+  apr_uint32_t wait = 0;
+  apr_uint64_t file_key = 0;
+  apr_uint32_t ip_hash = 0;
+  ip_key ip;
 
-  /* full_path check */
-  if (cfg->full_path != NULL) {
-    if (access(r->filename, F_OK) != 0) {
-      real_path_dir = apr_pstrdup(r->pool, r->filename);
-    } else if (realpath_for_vlimit(r->filename, real_path_dir, PATH_MAX, r->pool) == NULL) {
-      vlimit_debug_log_buf = apr_psprintf(r->pool, "realpath_for_vlimit was failed. path=(%s)", r->filename);
-      VLIMIT_DEBUG_SYSLOG("vlimit_handler: ", vlimit_debug_log_buf, r->pool);
-      return DECLINED;
-    }
+  int ip_count = 0;
+  int file_count = 0;
+  int ip_limit = vlimit_ip_limit(cfg);
+
+  if (!ap_is_initial_req(r)) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ", "SKIPPED: Initial Reqeusts.");
+    return DECLINED;
+  }
+
+  if (!(flags & (VLIMIT_DECIDE_IP | VLIMIT_DECIDE_FILE))) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ", "SKIPPED: no VlimitIP/VlimitFile limit or rate");
+    return DECLINED;
+  }
+
+  if (vlimit_exempt_client(r)) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ", "SKIPPED: %s is in VlimitExempt.",
+                        r->connection->remote_ip);
+    return DECLINED;
+  }
+
+  host_mismatch = check_virtualhost_name(r);
+  note = get_request_note(r);
+  access_host = note->access_host;
+
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_check_limit: ", "client info: address=(%s) access_host=(%s)",
+                      r->connection->remote_ip, access_host);
+
+  SHM_DATA *limit_stat;
+  limit_stat = cfg->decision.limit_stat;
+
+  if (limit_stat == NULL) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ", "SKIPPED: slot tables not allocated.");
+    return DECLINED;
+  }
+
+  if (host_mismatch) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ", "access_host != server_hostname. return OK.");
+    return OK;
+  }
+
+  // vlimit_response_end drops exactly the counts recorded here
+  count = vlimit_add_count(r, note, cfg);
+
+  // every name of full_path (symlinks, hard links) counts as the one file
+  if (flags & VLIMIT_DECIDE_FILE) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_check_limit: ", "type File: file_count++");
+    file_key = (flags & VLIMIT_DECIDE_PATH) ? cfg->decision.path_key : get_file_key(r);
+    file_count =
+        vlimit_atomic ? inc_file_counter_atomic(limit_stat, file_key, &count->file_slot, &count->file_gen) : -2;
+  }
+  if (flags & VLIMIT_DECIDE_IP) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_check_limit: ", "type IP: ip_count++");
+    ip_hash = get_ip_key(limit_stat, r, &ip);
+    ip_count = vlimit_atomic ? inc_ip_counter_atomic(limit_stat, &ip, ip_hash, &count->ip_slot, &count->ip_gen) : -2;
+  }
+
+  // slots not claimed yet (or VlimitAtomic Off) are updated under the mutex of their stripe
+  if (file_count == -2) {
+    file_count = inc_file_counter(limit_stat, file_key, (flags & VLIMIT_DECIDE_PATH) ? cfg->full_path : r->filename,
+                                  &count->file_slot, &count->file_gen);
+  }
+  if (ip_count == -2) {
+    ip_count = inc_ip_counter(limit_stat, &ip, ip_hash, &count->ip_slot, &count->ip_gen);
+  }
+  if (count->file_slot >= 0 || count->ip_slot >= 0) {
+    count->lease = claim_lease(r, cfg->conf_id, count->file_slot, count->file_gen, count->ip_slot, count->ip_gen);
+  }
+
+  if (file_count == -3 || ip_count == -3) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ", "vlimit_mutex lock failed. return OK.");
+    return OK;
+  }
+
+  if (file_count == -1) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ", "file counter slot full. maxclients?");
+    apr_atomic_inc32(&limit_stat->stat_shm->full_rejects);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+  if (ip_count == -1) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ", "ip counter slot full. maxclients?");
+    apr_atomic_inc32(&limit_stat->stat_shm->full_rejects);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  // counts of the other nodes as of the last VlimitBackend sync, always 0 with shm
+  if (count->ip_slot >= 0) {
+    ip_count += (int)apr_atomic_read32(&limit_stat->ip_stat_shm[count->ip_slot].remote);
+  }
+  if (count->file_slot >= 0) {
+    file_count += (int)apr_atomic_read32(&limit_stat->file_stat_shm[count->file_slot].remote);
+  }
+
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ",
+                      "conf_id: %d name: %s  uri: %s  ip_count: %d/%d file_count: %d/%d", cfg->conf_id,
+                      r->server->server_hostname, r->filename, ip_count, ip_limit, file_count, cfg->file_limit);
+
+  // VlimitWait keeps the counts taken above while waiting, vlimit_response_end drops them as usual
+  if (vlimit_wait_ms > 0 && ip_limit > 0 && ip_count > ip_limit) {
+    ip_count = vlimit_wait_result(limit_stat, wait_ip_counter(limit_stat, count->ip_slot, count->ip_gen, ip_limit),
+                                  ip_count);
+  }
+  if (vlimit_wait_ms > 0 && cfg->file_limit > 0 && file_count > cfg->file_limit &&
+      !(ip_limit > 0 && ip_count > ip_limit)) {
+    file_count = vlimit_wait_result(
+        limit_stat, wait_file_counter(limit_stat, count->file_slot, count->file_gen, cfg->file_limit), file_count);
+  }
+
+  if (ip_limit > 0 && ip_count > ip_limit) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ",
+                        "Rejected, too many connections from this host(%s) to the file(%s) by "
+                        "VlimitIP[ip_limit=(%d) docroot=(%s)].", r->connection->remote_ip, access_host, ip_limit,
+                        cfg->full_path);
+    apr_atomic_inc32(&limit_stat->stat_shm->ip_rejects);
+
+    vlimit_logging("RESULT: 503 INC", r, cfg, ip_count, file_count);
+
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+  if (cfg->file_limit > 0 && file_count > cfg->file_limit) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ", "Rejected, too many connections to the file(%s) by "
+                        "VlimitFile[limit=(%d) docroot=(%s)].", access_host, cfg->file_limit, cfg->full_path);
+    apr_atomic_inc32(&limit_stat->stat_shm->file_rejects);
+
+    vlimit_logging("RESULT: 503 INC", r, cfg, ip_count, file_count);
+
+    return HTTP_SERVICE_UNAVAILABLE;
+    // return HTTP_NOT_FOUND;
+  }
+
+  // the counts taken above pin both slots, so their tat can be updated without the mutex
+  if (count->ip_slot >= 0 && limit_stat->ip_rate_emission > 0) {
+    wait = vlimit_rate_check(&limit_stat->ip_stat_shm[count->ip_slot].tat, limit_stat->ip_rate_emission,
+                             limit_stat->ip_rate_interval);
+  }
+  if (wait == 0 && count->file_slot >= 0 && limit_stat->file_rate_emission > 0) {
+    wait = vlimit_rate_check(&limit_stat->file_stat_shm[count->file_slot].tat, limit_stat->file_rate_emission,
+                             limit_stat->file_rate_interval);
+  }
+  if (wait > 0) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ",
+                        "Rejected, too many requests from this host(%s) to the file(%s) by "
+                        "VlimitIPRate/VlimitFileRate, retry in %u ms.", r->connection->remote_ip, access_host, wait);
+    apr_atomic_inc32(&limit_stat->stat_shm->rate_rejects);
+    apr_table_setn(r->err_headers_out, "Retry-After", apr_psprintf(r->pool, "%u", (wait + 999) / 1000));
+
+    vlimit_logging("RESULT: 503 RATE", r, cfg, ip_count, file_count);
+
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  // all check passed, return response normally
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_limit: ", "OK: Passed all checks");
+  apr_atomic_inc32(&VLIMIT_STAT_SHARD(limit_stat, count->file_slot >= 0 ? count->file_slot : count->ip_slot)->accepted);
+
+  vlimit_logging("RESULT:  OK INC", r, cfg, ip_count, file_count);
+
+  return OK;
+}
+
+/* VlimitKey: count the request under the value of the key expression in the file table of key_cfg, like
+ * a file under its name. An empty value or an expression error leaves the request uncounted; returns
+ * result unless the key rejects the request */
+static int vlimit_check_key(request_rec *r, vlimit_config *key_cfg, int result)
+{
+#ifdef __APACHE24__
+
+  SHM_DATA *limit_stat = key_cfg->decision.limit_stat;
+  vlimit_request_note *note;
+  vlimit_count *count;
+  const char *value;
+  const char *err = NULL;
+  apr_uint64_t key;
+  int key_count = -2;
+
+  if (limit_stat == NULL || !ap_is_initial_req(r) || vlimit_exempt_client(r) || check_virtualhost_name(r)) {
+    return result;
+  }
+
+  value = ap_expr_str_exec(r, key_cfg->key_expr, &err);
+  if (err != NULL || value == NULL || value[0] == '\0') {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_key: ", "SKIPPED: VlimitKey %s has no value%s%s.",
+                        key_cfg->key_name, err ? ": " : "", err ? err : "");
+    return result;
+  }
+
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_check_key: ", "VlimitKey %s=(%s): key_count++", key_cfg->key_name,
+                      value);
+  note = get_request_note(r);
+  // vlimit_response_end drops this count whether the request is rejected here or later
+  count = vlimit_add_count(r, note, key_cfg);
+  key = vlimit_hash_string64(value);
+  if (vlimit_atomic) {
+    key_count = inc_file_counter_atomic(limit_stat, key, &count->file_slot, &count->file_gen);
+  }
+  if (key_count == -2) {
+    key_count = inc_file_counter(limit_stat, key, value, &count->file_slot, &count->file_gen);
+  }
+  if (key_count == -3) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_key: ", "vlimit_mutex lock failed.");
+    return result;
+  }
+  if (key_count == -1) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_key: ", "key counter slot full. maxclients?");
+    apr_atomic_inc32(&limit_stat->stat_shm->full_rejects);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  count->lease = claim_lease(r, key_cfg->conf_id, count->file_slot, count->file_gen, -1, 0);
+  key_count += (int)apr_atomic_read32(&limit_stat->file_stat_shm[count->file_slot].remote);
+
+  if (vlimit_wait_ms > 0 && key_count > key_cfg->file_limit) {
+    key_count = vlimit_wait_result(
+        limit_stat, wait_file_counter(limit_stat, count->file_slot, count->file_gen, key_cfg->file_limit), key_count);
+  }
+
+  if (key_count > key_cfg->file_limit) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_key: ",
+                        "Rejected, too many connections with VlimitKey %s=(%s) [limit=(%d)].", key_cfg->key_name,
+                        value, key_cfg->file_limit);
+    apr_atomic_inc32(&limit_stat->stat_shm->file_rejects);
+    vlimit_logging("RESULT: 503 KEY", r, key_cfg, 0, key_count);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_check_key: ", "OK: conf_id: %d key_count: %d/%d", key_cfg->conf_id,
+                      key_count, key_cfg->file_limit);
+  apr_atomic_inc32(&VLIMIT_STAT_SHARD(limit_stat, count->file_slot)->accepted);
+  vlimit_logging("RESULT:  OK KEY", r, key_cfg, 0, key_count);
+
+  return OK;
+#else
+  return result;
+#endif
+}
+
+/* ------------------------------------------------- */
+/* --- Analyze from the Path to RealPath Routine --- */
+/* ------------------------------------------------- */
+static char *realpath_for_vlimit(const char *path, char *resolved_path, int maxreslth, apr_pool_t *p)
+{
+
+  int readlinks = 0;
+  int n;
+
+  char *npath;
+  char link_path[PATH_MAX + 1];
+  char *buf;
+
+  buf = apr_pcalloc(p, sizeof(char *));
+  npath = resolved_path;
+
+  if (*path != '/') {
+    if (!getcwd(npath, maxreslth - 2)) {
+      return NULL;
+    }
+    npath += strlen(npath);
+    if (npath[-1] != '/') {
+      *npath++ = '/';
+    }
+  } else {
+    *npath++ = '/';
+    path++;
+  }
+
+  while (*path != '\0') {
+
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+
+    if (*path == '.' && (path[1] == '\0' || path[1] == '/')) {
+      path++;
+      continue;
+    }
+
+    if (*path == '.' && path[1] == '.' && (path[2] == '\0' || path[2] == '/')) {
+      path += 2;
+      while (npath > resolved_path + 1 && (--npath)[-1] != '/')
+        ;
+      continue;
+    }
+
+    while (*path != '\0' && *path != '/') {
+      if (npath - resolved_path > maxreslth - 2) {
+        errno = ENAMETOOLONG;
+        return NULL;
+      }
+      *npath++ = *path++;
+    }
+
+    if (readlinks++ > MAXSYMLINKS) {
+      errno = ELOOP;
+      return NULL;
+    }
+
+    /* symlink analyzed */
+    *npath = '\0';
+    n = readlink(resolved_path, link_path, PATH_MAX);
+    if (n < 0) {
+      /* EINVAL means the file exists but isn't a symlink. */
+      if (errno != EINVAL) {
+        return NULL;
+      }
+    } else {
+      int m;
+      char *newbuf;
+
+      link_path[n] = '\0';
+      if (*link_path == '/') {
+        npath = resolved_path;
+      } else {
+        while (*(--npath) != '/')
+          ;
+      }
+
+      m = strlen(path);
+      newbuf = apr_pcalloc(p, m + n + 1);
+      memcpy(newbuf, link_path, n);
+      memcpy(newbuf + n, path, m + 1);
+      path = buf = newbuf;
+    }
+    *npath++ = '/';
+  }
+
+  if (npath != resolved_path + 1 && npath[-1] == '/') {
+    npath--;
+  }
+
+  *npath = '\0';
+
+  return resolved_path;
+}
+
+/* ---------------------------------- */
+/* --- Full Path Matching Routine --- */
+/* ---------------------------------- */
+/* Remember device/inode of the VlimitIP/VlimitFile full_path argument */
+static void set_full_path(cmd_parms *parms, vlimit_config *cfg, const char *path)
+{
+  apr_finfo_t finfo;
+
+  cfg->full_path = apr_pstrdup(parms->pool, path);
+  cfg->full_path_ident = 0;
+
+  if (path != NULL && apr_stat(&finfo, path, APR_FINFO_IDENT, parms->temp_pool) == APR_SUCCESS) {
+    cfg->full_path_dev = finfo.device;
+    cfg->full_path_inode = finfo.inode;
+    cfg->full_path_ident = 1;
+  }
+}
+
+/* 1 when r->filename is full_path, 0 when not, -1 when it can not be resolved */
+static int match_full_path(request_rec *r, vlimit_config *cfg)
+{
+  char *real_path_dir;
+  apr_finfo_t finfo;
+
+  // r->finfo was stat'ed by the core while mapping the request, following symlinks
+  if (r->finfo.filetype == APR_NOFILE) {
+    real_path_dir = r->filename;
+  } else if ((r->finfo.valid & APR_FINFO_IDENT) == APR_FINFO_IDENT) {
+    if (cfg->full_path_ident && r->finfo.device == cfg->full_path_dev && r->finfo.inode == cfg->full_path_inode) {
+      return 1;
+    }
+    // full_path may have been replaced by a rename since startup (or created after it), one stat of it
+    // tells whether it is this file now
+    if (apr_stat(&finfo, cfg->full_path, APR_FINFO_IDENT, r->pool) != APR_SUCCESS) {
+      return 0;
+    }
+    return (r->finfo.device == finfo.device && r->finfo.inode == finfo.inode) ? 1 : 0;
+  } else {
+    real_path_dir = (char *)apr_pcalloc(r->pool, PATH_MAX + 1);
+    if (realpath_for_vlimit(r->filename, real_path_dir, PATH_MAX, r->pool) == NULL) {
+      return -1;
+    }
+  }
+
+  return (strcmp(cfg->full_path, real_path_dir) == 0) ? 1 : 0;
+}
+
+/* whether the VlimitIP/VlimitFile of cfg apply to r, that is cfg has no RealPath or r->filename is it */
+static int vlimit_check_path(request_rec *r, vlimit_config *cfg, int flags)
+{
+  int result;
+
+  /* full_path check */
+  if (flags & VLIMIT_DECIDE_PATH) {
+    result = match_full_path(r, cfg);
+
+    if (result < 0) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_handler: ", "realpath_for_vlimit was failed. path=(%s)",
+                          r->filename);
+      return 0;
+    }
+
+    if (result == 0) {
+
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_handler: ",
+                          "full_path not match cfg->full_path=(%s) <=> filename=(%s)", cfg->full_path, r->filename);
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_handler: ", "full_path not match end...");
+
+      return 0;
+    }
+
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_handler: ", "full_path match cfg->full_path=(%s) <=> filename=(%s)",
+                        cfg->full_path, r->filename);
+  } else {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_handler: ", "full_path not found. cfg->full_path=((null))");
+  }
+
+  return 1;
+}
+
+/* check r against the limits of one config: VlimitIP/VlimitFile where its RealPath matches, and VlimitKey */
+static int vlimit_check_config(request_rec *r, vlimit_config *cfg, int flags)
+{
+  int result = DECLINED;
+
+  if (!(flags & (VLIMIT_DECIDE_IP | VLIMIT_DECIDE_FILE | VLIMIT_DECIDE_KEY))) {
+    return DECLINED;
+  }
+
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_handler: ",
+                      "cfg->ip_limit=(%d) cfg->file_limit=(%d) cfg->full_path=(%s)", cfg->ip_limit, cfg->file_limit,
+                      cfg->full_path);
+
+  if ((flags & (VLIMIT_DECIDE_IP | VLIMIT_DECIDE_FILE)) && vlimit_check_path(r, cfg, flags)) {
+    result = vlimit_check_limit(r, cfg, flags);
+  }
+  // the RealPath is an argument of VlimitIP/VlimitFile only, the key of this level counts every request
+  // left through so far; one rejected above is not counted under its value
+  if ((flags & VLIMIT_DECIDE_KEY) && (result == OK || result == DECLINED)) {
+    result = vlimit_check_key(r, cfg->key_cfg, result);
+  }
+
+  return result;
+}
+
+/* ----------------------------------------- */
+/* --- Access Checker for Per Dir Config --- */
+/* ----------------------------------------- */
+static int vlimit_handler(request_rec *r)
+{
+  /* get configuration information */
+  vlimit_config *cfg = (vlimit_config *)ap_get_module_config(r->per_dir_config, &vlimit_module);
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(r->server->module_config, &vlimit_module);
+  vlimit_config *reg;
+
+  int flags;
+  int result;
+  int status = DECLINED;
+
+  // innermost section first, then each enclosing one, then the server config as the root of the chain;
+  // the first to reject decides, the counts taken before it stay on the note for vlimit_response_end
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_handler: ", "Entering normal handler");
+  for (; cfg != NULL; cfg = (cfg == scfg) ? NULL : (cfg->parent != NULL ? cfg->parent : scfg)) {
+    // no section of the request sets a limit, or the server context sets none
+    if (cfg->conf_id < 0) {
+      continue;
+    }
+    // merged copies share the conf_id, the registered config carries the decision record
+    reg = APR_ARRAY_IDX(vlimit_conf_list, cfg->conf_id, vlimit_config *);
+    flags = reg->decision.flags;
+    // vlimit_quick_handler already counted the request in the server ip table
+    if (flags & VLIMIT_DECIDE_QUICK) {
+      flags &= ~VLIMIT_DECIDE_IP;
+    }
+    result = vlimit_check_config(r, reg, flags);
+    if (result != OK && result != DECLINED) {
+      status = result;
+      break;
+    }
+    if (result == OK) {
+      status = OK;
+    }
+  }
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_handler: ", "Exiting normal handler");
+
+  return status;
+}
+
+/* -------------------------------------------- */
+/* --- Access Checker for Per Server Config --- */
+/* -------------------------------------------- */
+/* count the request in the ip table of scfg, vlimit_response_end drops it whether the request is rejected
+ * here or later; returns the count of its IP address like inc_ip_counter */
+static int vlimit_count_request(request_rec *r, vlimit_config *scfg, vlimit_request_note *note, int ip_limit)
+{
+
+  SHM_DATA *limit_stat = scfg->decision.limit_stat;
+  apr_uint32_t ip_hash;
+  ip_key ip;
+  int ip_count = -2;
+
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_count_request: ", "type IP: ip_count++");
+  ip_hash = get_ip_key(limit_stat, r, &ip);
+  if (vlimit_atomic) {
+    ip_count = inc_ip_counter_atomic(limit_stat, &ip, ip_hash, &note->srv_ip_slot, &note->srv_ip_gen);
+  }
+  if (ip_count == -2) {
+    ip_count = inc_ip_counter(limit_stat, &ip, ip_hash, &note->srv_ip_slot, &note->srv_ip_gen);
+  }
+  if (ip_count < 0) {
+    return ip_count;
+  }
+
+  note->srv_cfg = scfg;
+  note->srv_lease = claim_lease(r, scfg->conf_id, -1, 0, note->srv_ip_slot, note->srv_ip_gen);
+  ip_count += (int)apr_atomic_read32(&limit_stat->ip_stat_shm[note->srv_ip_slot].remote);
+
+  if (vlimit_wait_ms > 0 && ip_limit > 0 && ip_count > ip_limit) {
+    ip_count = vlimit_wait_result(
+        limit_stat, wait_ip_counter(limit_stat, note->srv_ip_slot, note->srv_ip_gen, ip_limit), ip_count);
+  }
+
+  return ip_count;
+}
+
+/* VlimitIPScope connection, called by the one request that moved cnote to COUNTING: count the connection in
+ * the ip table of scfg until vlimit_conn_cleanup. A connection over the limit is not kept counted, so that
+ * the next request on it tries again; ip_slot is -1 then */
+static int vlimit_count_connection(request_rec *r, vlimit_config *scfg, vlimit_conn_note *cnote, int ip_limit)
+{
+
+  SHM_DATA *limit_stat = scfg->decision.limit_stat;
+  apr_uint32_t ip_hash;
+  ip_key ip;
+  int ip_count = -2;
+
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_count_connection: ", "type IP: ip_count++");
+  cnote->ip_slot = -1;
+  ip_hash = get_ip_key(limit_stat, r, &ip);
+  if (vlimit_atomic) {
+    ip_count = inc_ip_counter_atomic(limit_stat, &ip, ip_hash, &cnote->ip_slot, &cnote->ip_gen);
+  }
+  if (ip_count == -2) {
+    ip_count = inc_ip_counter(limit_stat, &ip, ip_hash, &cnote->ip_slot, &cnote->ip_gen);
+  }
+  if (ip_count < 0) {
+    cnote->ip_slot = -1;
+    apr_atomic_set32(&cnote->state, VLIMIT_CONN_FREE);
+    return ip_count;
+  }
+
+  cnote->lease = claim_lease(r, scfg->conf_id, -1, 0, cnote->ip_slot, cnote->ip_gen);
+  ip_count += (int)apr_atomic_read32(&limit_stat->ip_stat_shm[cnote->ip_slot].remote);
+
+  if (vlimit_wait_ms > 0 && ip_limit > 0 && ip_count > ip_limit) {
+    ip_count = vlimit_wait_result(limit_stat, wait_ip_counter(limit_stat, cnote->ip_slot, cnote->ip_gen, ip_limit),
+                                  ip_count);
+  }
+
+  if (ip_limit > 0 && ip_count > ip_limit) {
+    if (cnote->lease >= 0) {
+      release_lease(cnote->lease);
+      cnote->lease = -1;
+    }
+    dec_ip_counter(limit_stat, cnote->ip_slot, cnote->ip_gen);
+    cnote->ip_slot = -1;
+    apr_atomic_set32(&cnote->state, VLIMIT_CONN_FREE);
+    return ip_count;
+  }
+
+  cnote->srv_cfg = scfg;
+  apr_atomic_set32(&cnote->state, VLIMIT_CONN_COUNTED);
+
+  return ip_count;
+}
+
+/* For server configration */
+/* VlimitIP set outside of any section, checked before URI translation so that a rejected request skips
+ * map_to_storage, the directory walk, .htaccess and auth. There is no filename yet, so a server VlimitIP
+ * with a RealPath, VlimitFile and all section limits stay in fixups */
+static int vlimit_quick_handler(request_rec *r, int lookup)
+{
+
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(r->server->module_config, &vlimit_module);
+  SHM_DATA *limit_stat = scfg->decision.limit_stat;
+  vlimit_request_note *note;
+  vlimit_conn_note *cnote = NULL;
+  apr_uint32_t wait = 0;
+  int ip_count;
+  int ip_limit;
+  int slot;
+
+  if (lookup || !ap_is_initial_req(r) || !(scfg->decision.flags & VLIMIT_DECIDE_QUICK) || limit_stat == NULL) {
+    return DECLINED;
+  }
+
+  if (vlimit_exempt_client(r)) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_quick_handler: ", "SKIPPED: %s is in VlimitExempt.",
+                        r->connection->remote_ip);
+    return DECLINED;
+  }
+
+  if (check_virtualhost_name(r)) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_quick_handler: ", "access_host != server_hostname. DECLINED.");
+    return DECLINED;
+  }
+  note = get_request_note(r);
+  ip_limit = vlimit_ip_limit(scfg);
+  if (vlimit_ip_scope_conn) {
+    cnote = get_conn_note(r->connection);
+  }
+
+  // VlimitIPScope connection: once the connection is counted, its requests only count against each other
+  if (cnote != NULL && apr_atomic_read32(&cnote->state) == VLIMIT_CONN_COUNTED && cnote->srv_cfg == scfg) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_quick_handler: ", "connection counted: active++");
+    note->conn = cnote;
+    ip_count = (int)apr_atomic_inc32(&cnote->active) + 1;
+    slot = cnote->ip_slot;
+  } else if (cnote != NULL && apr_atomic_read32(&cnote->state) == VLIMIT_CONN_FREE &&
+             apr_atomic_cas32(&cnote->state, VLIMIT_CONN_COUNTING, VLIMIT_CONN_FREE) == VLIMIT_CONN_FREE) {
+    ip_count = vlimit_count_connection(r, scfg, cnote, ip_limit);
+    slot = -1;
+    if (ip_count >= 0 && !(ip_limit > 0 && ip_count > ip_limit)) {
+      note->conn = cnote;
+      apr_atomic_inc32(&cnote->active);
+      slot = cnote->ip_slot;
+    }
+  } else {
+    ip_count = vlimit_count_request(r, scfg, note, ip_limit);
+    slot = note->srv_ip_slot;
+  }
+
+  if (ip_count == -3) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_quick_handler: ", "vlimit_mutex lock failed. DECLINED.");
+    return DECLINED;
+  }
+  if (ip_count == -1) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_quick_handler: ", "ip counter slot full. maxclients?");
+    apr_atomic_inc32(&limit_stat->stat_shm->full_rejects);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  if (ip_limit > 0 && ip_count > ip_limit) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_quick_handler: ",
+                        "Rejected, too many connections from this host(%s) by VlimitIP[ip_limit=(%d)].",
+                        r->connection->remote_ip, ip_limit);
+    apr_atomic_inc32(&limit_stat->stat_shm->ip_rejects);
+    vlimit_logging("RESULT: 503 INC", r, scfg, ip_count, 0);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  if (slot >= 0 && limit_stat->ip_rate_emission > 0) {
+    wait = vlimit_rate_check(&limit_stat->ip_stat_shm[slot].tat, limit_stat->ip_rate_emission,
+                             limit_stat->ip_rate_interval);
+  }
+  if (wait > 0) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_quick_handler: ",
+                        "Rejected, too many requests from this host(%s) by VlimitIPRate, retry in %u ms.",
+                        r->connection->remote_ip, wait);
+    apr_atomic_inc32(&limit_stat->stat_shm->rate_rejects);
+    apr_table_setn(r->err_headers_out, "Retry-After", apr_psprintf(r->pool, "%u", (wait + 999) / 1000));
+    vlimit_logging("RESULT: 503 RATE", r, scfg, ip_count, 0);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  // passed, the request goes on through the normal phases
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_quick_handler: ", "OK: conf_id: %d ip_count: %d/%d", scfg->conf_id,
+                      ip_count, ip_limit);
+  apr_atomic_inc32(&VLIMIT_STAT_SHARD(limit_stat, slot)->accepted);
+  vlimit_logging("RESULT:  OK INC", r, scfg, ip_count, 0);
+
+  return DECLINED;
+}
+
+/* ------------------------------- */
+/* --- Register Config Routine --- */
+/* ------------------------------- */
+/* Only configs with a limit get slot tables on shared memory */
+static void register_limit_config(cmd_parms *parms, vlimit_config *cfg, vlimit_config *scfg)
+{
+  if (cfg->conf_id >= 0) {
+    return;
+  }
+
+  if (vlimit_conf_list == NULL) {
+    vlimit_conf_list = apr_array_make(parms->pool, 16, sizeof(vlimit_config *));
+  }
+
+  cfg->conf_id = conf_counter++;
+  cfg->srv_cfg = scfg;
+  cfg->server = parms->server;
+  cfg->section = parms->path;
+  APR_ARRAY_PUSH(vlimit_conf_list, vlimit_config *) = cfg;
+}
+
+/* ------------------------------------ */
+/* --- Command_rec for VlimitIP--- */
+/* ------------------------------------ */
+/* Parse the VlimitIP directive, <number> [path] or auto <min> <max> [path] */
+static const char *set_vlimitip(cmd_parms *parms, void *mconfig, int argc, char *const argv[])
+{
+  vlimit_config *cfg = (vlimit_config *)mconfig;
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(parms->server->module_config, &vlimit_module);
+
+  signed long int limit;
+  signed long int limit_min = -1;
+  const char *path;
+
+  if (argc >= 1 && strcasecmp(argv[0], "auto") == 0) {
+    if (argc != 3 && argc != 4) {
+      return "VlimitIP auto needs min and max";
+    }
+    limit_min = strtol(argv[1], (char **)NULL, 10);
+    limit = strtol(argv[2], (char **)NULL, 10);
+    path = argc == 4 ? argv[3] : NULL;
+  } else {
+    if (argc != 1 && argc != 2) {
+      return "VlimitIP takes a number and an optional path";
+    }
+    limit = strtol(argv[0], (char **)NULL, 10);
+    path = argc == 2 ? argv[1] : NULL;
+  }
+
+  /* No reasonable person would want more than 2^16. Better would be
+     to use LONG_MAX but that causes portability problems on win32 */
+  if ((limit > 65535) || (limit < 0)) {
+    return "Integer overflow or invalid number";
+  }
+  if (strcasecmp(argv[0], "auto") == 0) {
+    if (limit_min < 1 || limit_min > limit) {
+      return "VlimitIP auto min must be 1 to max";
+    }
+    vlimit_auto_used = 1;
+  }
+
+  if (parms->path != NULL) {
+    /* Per-directory context */
+    cfg->type = SET_VLIMITIP;
+    cfg->ip_limit = limit;
+    cfg->ip_limit_min = limit_min;
+    set_full_path(parms, cfg, path);
+    register_limit_config(parms, cfg, scfg);
+  } else {
+    /* Per-server context */
+    scfg->type = SET_VLIMITIP;
+    scfg->ip_limit = limit;
+    scfg->ip_limit_min = limit_min;
+    set_full_path(parms, scfg, path);
+    register_limit_config(parms, scfg, scfg);
+  }
+
+  return NULL;
+}
+
+/* --------------------------------------- */
+/* --- Command_rec for VlimitFile--- */
+/* --------------------------------------- */
+/* Parse the VlimitFile directive */
+static const char *set_vlimitfile(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg_opt1)
+{
+  vlimit_config *cfg = (vlimit_config *)mconfig;
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(parms->server->module_config, &vlimit_module);
+
+  signed long int limit = strtol(arg1, (char **)NULL, 10);
+
+  /* No reasonable person would want more than 2^16. Better would be
+     to use LONG_MAX but that causes portability problems on win32 */
+  if ((limit > 65535) || (limit < 0)) {
+    return "Integer overflow or invalid number";
+  }
+
+  if (parms->path != NULL) {
+    /* Per-directory context */
+    cfg->type = SET_VLIMITFILE;
+    cfg->file_limit = limit;
+    set_full_path(parms, cfg, arg_opt1);
+    register_limit_config(parms, cfg, scfg);
+  } else {
+    /* Per-server context */
+    scfg->type = SET_VLIMITFILE;
+    scfg->file_limit = limit;
+    set_full_path(parms, scfg, arg_opt1);
+    register_limit_config(parms, scfg, scfg);
+  }
+
+  return NULL;
+}
+
+/* ------------------------------------------------------- */
+/* --- Command_rec for VlimitIPRate and VlimitFileRate--- */
+/* ------------------------------------------------------- */
+/* <requests>/<interval>[s|m|h], the interval in seconds by default */
+static const char *parse_rate(const char *arg, int *rate, int *interval)
+{
+  char *end;
+  long n = strtol(arg, &end, 10);
+  long sec;
+
+  if (end == arg || *end != '/' || n < 1 || n > 65535) {
+    return "rate must be <requests>/<interval>[s|m|h] with 1-65535 requests";
+  }
+
+  arg = end + 1;
+  sec = strtol(arg, &end, 10);
+  if (end == arg || sec < 1) {
+    return "rate must be <requests>/<interval>[s|m|h] with 1-65535 requests";
+  }
+  if (*end == 'm') {
+    sec *= 60;
+    end++;
+  } else if (*end == 'h') {
+    sec *= 3600;
+    end++;
+  } else if (*end == 's') {
+    end++;
+  }
+  if (*end != '\0' || sec > VLIMIT_MAX_RATE_INTERVAL) {
+    return "rate interval must be 1s to 24h";
+  }
+  // tat has a 1 ms resolution
+  if (n > sec * 1000) {
+    return "rate must be 1000 requests per second or less";
+  }
+
+  *rate = (int)n;
+  *interval = (int)(sec * 1000);
+
+  return NULL;
+}
+
+/* Parse the VlimitIPRate directive */
+static const char *set_vlimitiprate(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  vlimit_config *cfg = (vlimit_config *)mconfig;
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(parms->server->module_config, &vlimit_module);
+  const char *err;
+
+  if (parms->path == NULL) {
+    /* Per-server context */
+    cfg = scfg;
+  }
+
+  err = parse_rate(arg1, &cfg->ip_rate, &cfg->ip_rate_interval);
+
+  if (err != NULL) {
+    return apr_pstrcat(parms->pool, "VlimitIPRate: ", err, NULL);
+  }
+
+  register_limit_config(parms, cfg, scfg);
+
+  return NULL;
+}
+
+/* Parse the VlimitFileRate directive */
+static const char *set_vlimitfilerate(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  vlimit_config *cfg = (vlimit_config *)mconfig;
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(parms->server->module_config, &vlimit_module);
+  const char *err;
+
+  if (parms->path == NULL) {
+    /* Per-server context */
+    cfg = scfg;
+  }
+
+  err = parse_rate(arg1, &cfg->file_rate, &cfg->file_rate_interval);
+
+  if (err != NULL) {
+    return apr_pstrcat(parms->pool, "VlimitFileRate: ", err, NULL);
+  }
+
+  register_limit_config(parms, cfg, scfg);
+
+  return NULL;
+}
+
+/* --------------------------------- */
+/* --- Command_rec for VlimitKey --- */
+/* --------------------------------- */
+/* Parse the VlimitKey directive, <name> <expression> <number>; the key gets a config and a slot table of its
+ * own, registered like any other so that the lease sweep, the backends and vlimit-status see it */
+static const char *set_vlimitkey(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg2,
+                                 const char *arg3)
+{
+#ifdef __APACHE24__
+  vlimit_config *cfg = (vlimit_config *)mconfig;
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(parms->server->module_config, &vlimit_module);
+  vlimit_config *key_cfg;
+  const char *err = NULL;
+
+  signed long int limit = strtol(arg3, (char **)NULL, 10);
+
+  if ((limit > 65535) || (limit < 1)) {
+    return "VlimitKey limit must be between 1 and 65535";
+  }
+  if (parms->path == NULL) {
+    cfg = scfg;
+  }
+  if (cfg->key_cfg != NULL) {
+    return "VlimitKey is already set in this context";
+  }
+
+  key_cfg = create_share_config(parms->pool);
+  key_cfg->key_name = apr_pstrdup(parms->pool, arg1);
+  key_cfg->key_expr = ap_expr_parse_cmd(parms, arg2, AP_EXPR_FLAG_STRING_RESULT, &err, NULL);
+  if (err != NULL) {
+    return apr_pstrcat(parms->temp_pool, "Cannot parse VlimitKey expression '", arg2, "': ", err, NULL);
+  }
+  key_cfg->type = SET_VLIMITFILE;
+  key_cfg->file_limit = limit;
+  key_cfg->max_slots = cfg->max_slots;
+
+  cfg->key_cfg = key_cfg;
+  vlimit_key_used = 1;
+  register_limit_config(parms, cfg, scfg);
+  register_limit_config(parms, key_cfg, scfg);
+
+  return NULL;
+#else
+  return "VlimitKey needs httpd 2.4";
+#endif
+}
+
+/* ------------------------------------------ */
+/* --- Command_rec for VlimitMaxSlots--- */
+/* ------------------------------------------ */
+/* a section only sizes its own tables, remember it so vlimit_init can refuse one that has none */
+static void note_sizing_config(cmd_parms *parms, vlimit_config *cfg, const char *directive)
+{
+  if (cfg->sizing != NULL) {
+    return;
+  }
+
+  if (vlimit_sizing_list == NULL) {
+    vlimit_sizing_list = apr_array_make(parms->pool, 4, sizeof(vlimit_config *));
+  }
+
+  cfg->sizing = apr_psprintf(parms->pool, "%s in %s", directive, parms->path);
+  APR_ARRAY_PUSH(vlimit_sizing_list, vlimit_config *) = cfg;
+}
+
+/* Parse the VlimitMaxSlots directive */
+static const char *set_vlimitmaxslots(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  vlimit_config *cfg = (vlimit_config *)mconfig;
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(parms->server->module_config, &vlimit_module);
+
+  signed long int slots = strtol(arg1, (char **)NULL, 10);
+
+  if ((slots > VLIMIT_MAX_SLOTS_LIMIT) || (slots < 1)) {
+    return "VlimitMaxSlots must be between 1 and 1048576";
+  }
+
+  if (parms->path != NULL) {
+    /* Per-directory context */
+    cfg->max_slots = slots;
+    note_sizing_config(parms, cfg, "VlimitMaxSlots");
+  } else {
+    /* Per-server context */
+    cfg = scfg;
+    scfg->max_slots = slots;
+  }
+  // the VlimitKey table of the section is sized like its other tables
+  if (cfg->key_cfg != NULL) {
+    cfg->key_cfg->max_slots = slots;
+  }
+
+  return NULL;
+}
+
+/* ------------------------------------- */
+/* --- Command_rec for VlimitAtomic--- */
+/* ------------------------------------- */
+/* Parse the VlimitAtomic directive */
+static const char *set_vlimitatomic(cmd_parms *parms, void *mconfig, int flag)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+
+  if (err != NULL) {
+    return err;
+  }
+
+  vlimit_atomic = flag;
+
+  return NULL;
+}
+
+/* ------------------------------------------- */
+/* --- Command_rec for VlimitIPPrefix--- */
+/* ------------------------------------------- */
+static int parse_ip_prefix(const char *arg, int max)
+{
+  char *end;
+  long bits;
+
+  if (*arg == '/') {
+    arg++;
+  }
+  bits = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || bits < 1 || bits > max) {
+    return -1;
+  }
+
+  return (int)bits;
+}
+
+/* Parse the VlimitIPPrefix directive */
+static const char *set_vlimitipprefix(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg_opt1)
+{
+  vlimit_config *cfg = (vlimit_config *)mconfig;
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(parms->server->module_config, &vlimit_module);
+
+  int prefix4 = parse_ip_prefix(arg1, 32);
+  int prefix6 = (arg_opt1 != NULL) ? parse_ip_prefix(arg_opt1, 128) : 128;
+
+  if (prefix4 < 0 || prefix6 < 0) {
+    return "VlimitIPPrefix must be an IPv4 prefix 1-32 and an optional IPv6 prefix 1-128";
+  }
+
+  if (parms->path != NULL) {
+    /* Per-directory context */
+    cfg->ip_prefix4 = prefix4;
+    cfg->ip_prefix6 = prefix6;
+    note_sizing_config(parms, cfg, "VlimitIPPrefix");
+  } else {
+    /* Per-server context */
+    scfg->ip_prefix4 = prefix4;
+    scfg->ip_prefix6 = prefix6;
+  }
+
+  return NULL;
+}
+
+/* ------------------------------------- */
+/* --- Command_rec for VlimitExempt--- */
+/* ------------------------------------- */
+/* Parse the VlimitExempt directive, one address or CIDR per argument */
+static const char *set_vlimitexempt(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(parms->server->module_config, &vlimit_module);
+
+  if (scfg->exempt == NULL) {
+    scfg->exempt = (vlimit_exempt *)apr_pcalloc(parms->pool, sizeof(vlimit_exempt));
+  }
+
+  return vlimit_exempt_add(parms->pool, scfg->exempt, arg1);
+}
+
+/* ------------------------------------ */
+/* --- Command_rec for VlimitRetain --- */
+/* ------------------------------------ */
+/* Parse the VlimitRetain directive */
+static const char *set_vlimitretain(cmd_parms *parms, void *mconfig, int flag)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+
+  if (err != NULL) {
+    return err;
+  }
+
+  vlimit_retain = flag;
+
+  return NULL;
+}
+
+/* ------------------------------------- */
+/* --- Command_rec for VlimitShmFile --- */
+/* ------------------------------------- */
+/* Parse the VlimitShmFile directive, relative to ServerRoot */
+static const char *set_vlimitshmfile(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+
+  if (err != NULL) {
+    return err;
+  }
+
+  vlimit_shm_file = ap_server_root_relative(parms->pool, arg1);
+  if (vlimit_shm_file == NULL) {
+    return "VlimitShmFile is not a valid path";
+  }
+
+  return NULL;
+}
+
+/* ------------------------------------- */
+/* --- Command_rec for VlimitIPScope --- */
+/* ------------------------------------- */
+/* Parse the VlimitIPScope directive, request or connection */
+static const char *set_vlimitipscope(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+
+  if (err != NULL) {
+    return err;
+  }
+
+  if (strcasecmp(arg1, "request") == 0) {
+    vlimit_ip_scope_conn = 0;
+  } else if (strcasecmp(arg1, "connection") == 0) {
+    vlimit_ip_scope_conn = 1;
+  } else {
+    return "VlimitIPScope must be request or connection";
+  }
+
+  return NULL;
+}
+
+/* -------------------------------------- */
+/* --- Command_rec for VlimitOverflow --- */
+/* -------------------------------------- */
+/* Parse the VlimitOverflow directive, reject or evict */
+static const char *set_vlimitoverflow(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+
+  if (err != NULL) {
+    return err;
+  }
+
+  if (strcasecmp(arg1, "reject") == 0) {
+    vlimit_overflow_evict = 0;
+  } else if (strcasecmp(arg1, "evict") == 0) {
+    vlimit_overflow_evict = 1;
+  } else {
+    return "VlimitOverflow must be reject or evict";
+  }
+
+  return NULL;
+}
+
+/* ------------------------------------- */
+/* --- Command_rec for VlimitBackend --- */
+/* ------------------------------------- */
+/* Parse the VlimitBackend directive, shm or memcache [host[:port][,host[:port]...]] */
+static const char *set_vlimitbackend(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg_opt1)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  const vlimit_backend *backend;
+
+  if (err != NULL) {
+    return err;
+  }
+
+  for (backend = vlimit_backends; backend->name != NULL; backend++) {
+    if (strcasecmp(arg1, backend->name) == 0) {
+      break;
+    }
+  }
+  if (backend->name == NULL) {
+    return "VlimitBackend must be shm or memcache";
+  }
+
+  if (backend->configure != NULL && (err = backend->configure(parms, arg_opt1)) != NULL) {
+    return err;
+  }
+  vlimit_backend_used = backend;
+
+  return NULL;
+}
+
+/* ------------------------------------------ */
+/* --- Command_rec for VlimitSyncInterval --- */
+/* ------------------------------------------ */
+/* Parse the VlimitSyncInterval directive, seconds */
+static const char *set_vlimitsyncinterval(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  int interval;
+
+  if (err != NULL) {
+    return err;
+  }
+
+  interval = atoi(arg1);
+  if (interval < 1 || interval > VLIMIT_MAX_SYNC_INTERVAL) {
+    return "VlimitSyncInterval must be 1 to 3600 seconds";
+  }
+  vlimit_sync_interval = interval;
+
+  return NULL;
+}
+
+/* ------------------------------------------ */
+/* --- Command_rec for VlimitMutexStripes --- */
+/* ------------------------------------------ */
+/* Parse the VlimitMutexStripes directive */
+static const char *set_vlimitmutexstripes(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  signed long int stripes = strtol(arg1, (char **)NULL, 10);
+
+  if (err != NULL) {
+    return err;
+  }
+
+  if ((stripes > VLIMIT_MAX_MUTEX_STRIPES) || (stripes < 1)) {
+    return "VlimitMutexStripes must be between 1 and 1024";
+  }
+
+  vlimit_mutex_stripes = vlimit_slot_size(stripes);
+
+  return NULL;
+}
+
+/* -------------------------------------- */
+/* --- Command_rec for VlimitAutoLoad --- */
+/* -------------------------------------- */
+/* 1 minute load average counted as full load by VlimitIP auto, next to the busy workers */
+static const char *set_vlimitautoload(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  double load = strtod(arg1, (char **)NULL);
+
+  if (err != NULL) {
+    return err;
+  }
+
+  if (load <= 0 || load > 10000) {
+    return "VlimitAutoLoad must be a load average above 0";
+  }
+  vlimit_auto_load = load;
+
+  return NULL;
+}
+
+/* ---------------------------------- */
+/* --- Command_rec for VlimitWait --- */
+/* ---------------------------------- */
+/* Parse the VlimitWait directive */
+static const char *set_vlimitwait(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg2)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  int ms = atoi(arg1);
+  int waiters = atoi(arg2);
+
+  if (err != NULL) {
+    return err;
+  }
+
+#ifndef VLIMIT_HAVE_WAIT
+  return "VlimitWait needs the futexes of Linux";
+#endif
+  if (ms < 1 || ms > VLIMIT_MAX_WAIT_MS) {
+    return "VlimitWait must be 1 to 60000 ms";
+  }
+  if (waiters < 1 || waiters > VLIMIT_MAX_WAITERS) {
+    return "VlimitWait max-waiters must be 1 to 1024";
+  }
+  vlimit_wait_ms = ms;
+  vlimit_wait_max = waiters;
+
+  return NULL;
+}
+
+/* ---------------------------------------- */
+/* --- Command_rec for VlimitLogBuffer--- */
+/* ---------------------------------------- */
+/* Parse the VlimitLogBuffer directive */
+static const char *set_vlimitlogbuffer(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+  signed long int size = strtol(arg1, (char **)NULL, 10);
+
+  if (err != NULL) {
+    return err;
+  }
+
+  if ((size > VLIMIT_MAX_LOG_BUFFER) || (size < 0)) {
+    return "VlimitLogBuffer must be between 0 and 1048576";
+  }
+
+  vlimit_log_buffer_size = size;
+
+  return NULL;
+}
+
+/* ----------------------------------------- */
+/* --- Command_rec for VlimitDebugLevel--- */
+/* ----------------------------------------- */
+/* Parse the VlimitDebugLevel directive */
+static const char *set_vlimitdebuglevel(cmd_parms *parms, void *mconfig, const char *arg1)
+{
+  const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+
+  if (err != NULL) {
+    return err;
+  }
+
+  if (strcasecmp(arg1, "none") == 0) {
+    vlimit_debug_level = VLIMIT_DEBUG_NONE;
+  } else if (strcasecmp(arg1, "info") == 0) {
+    vlimit_debug_level = VLIMIT_DEBUG_INFO;
+  } else if (strcasecmp(arg1, "trace") == 0) {
+    vlimit_debug_level = VLIMIT_DEBUG_TRACE;
+  } else {
+    return "VlimitDebugLevel must be none, info or trace";
+  }
+
+  return NULL;
+}
+
+/* ------------------------ */
+/* --- Command_rec Array--- */
+/* ------------------------ */
+static command_rec vlimit_cmds[] = {
+    AP_INIT_TAKE_ARGV("VlimitIP", set_vlimitip, NULL, ACCESS_CONF | RSRC_CONF,
+                   "maximum connections per IP address to DocumentRoot"),
+    AP_INIT_TAKE12("VlimitFile", set_vlimitfile, NULL, ACCESS_CONF | RSRC_CONF,
+                   "maximum connections per File to DocumentRoot"),
+    AP_INIT_TAKE3("VlimitKey", set_vlimitkey, NULL, ACCESS_CONF | RSRC_CONF,
+                  "name, string expression and maximum connections per value of the expression"),
+    AP_INIT_TAKE1("VlimitIPRate", set_vlimitiprate, NULL, ACCESS_CONF | RSRC_CONF,
+                  "maximum requests per IP address in an interval, <requests>/<interval>[s|m|h]"),
+    AP_INIT_TAKE1("VlimitFileRate", set_vlimitfilerate, NULL, ACCESS_CONF | RSRC_CONF,
+                  "maximum requests per File in an interval, <requests>/<interval>[s|m|h]"),
+    AP_INIT_TAKE1("VlimitMaxSlots", set_vlimitmaxslots, NULL, ACCESS_CONF | RSRC_CONF,
+                  "number of IP/File slots tracked per VlimitIP/VlimitFile config (default 512)"),
+    AP_INIT_TAKE12("VlimitIPPrefix", set_vlimitipprefix, NULL, ACCESS_CONF | RSRC_CONF,
+                   "prefix length of IPv4 and IPv6 addresses counted as one client by VlimitIP (default 32 128)"),
+    AP_INIT_ITERATE("VlimitExempt", set_vlimitexempt, NULL, RSRC_CONF,
+                    "IPv4/IPv6 addresses or CIDR prefixes never counted nor limited by mod_vlimit"),
+    AP_INIT_FLAG("VlimitAtomic", set_vlimitatomic, NULL, RSRC_CONF,
+                 "On to update counters of existing slots with atomics instead of vlimit_mutex (default Off)"),
+    AP_INIT_FLAG("VlimitRetain", set_vlimitretain, NULL, RSRC_CONF,
+                 "On to keep counters across graceful restarts while the slot layout is unchanged (default Off)"),
+    AP_INIT_TAKE1("VlimitShmFile", set_vlimitshmfile, NULL, RSRC_CONF,
+                  "file naming the shm block, for vlimitctl to attach (default anonymous)"),
+    AP_INIT_TAKE1("VlimitIPScope", set_vlimitipscope, NULL, RSRC_CONF,
+                  "request or connection, what a server VlimitIP counts per IP address (default request)"),
+    AP_INIT_TAKE1("VlimitOverflow", set_vlimitoverflow, NULL, RSRC_CONF,
+                  "reject or evict, what a full slot table does with a new IP/File (default reject)"),
+    AP_INIT_TAKE12("VlimitBackend", set_vlimitbackend, NULL, RSRC_CONF,
+                   "shm, or memcache host[:port][,host[:port]...] to add the counts of other nodes (default shm)"),
+    AP_INIT_TAKE1("VlimitSyncInterval", set_vlimitsyncinterval, NULL, RSRC_CONF,
+                  "seconds between two exchanges of counts with the VlimitBackend (default 1)"),
+    AP_INIT_TAKE1("VlimitMutexStripes", set_vlimitmutexstripes, NULL, RSRC_CONF,
+                  "number of global mutexes the slot tables are striped over (default 1)"),
+    AP_INIT_TAKE1("VlimitAutoLoad", set_vlimitautoload, NULL, RSRC_CONF,
+                  "1 minute load average VlimitIP auto takes for full load, next to busy workers (default none)"),
+    AP_INIT_TAKE2("VlimitWait", set_vlimitwait, NULL, RSRC_CONF,
+                  "ms and max-waiters, how long and how many requests per slot wait over a limit (default off)"),
+    AP_INIT_TAKE1("VlimitLogBuffer", set_vlimitlogbuffer, NULL, RSRC_CONF,
+                  "bytes of transaction log buffered per child before writing " VLIMIT_LOG_FILE " (default 0)"),
+    AP_INIT_TAKE1("VlimitDebugLevel", set_vlimitdebuglevel, NULL, RSRC_CONF,
+                  "none, info or trace, syslog detail while " VLIMIT_DEBUG_FLAG_FILE " exists (default trace)"),
+    {NULL},
+};
+
+/* ------------------------------------------ */
+/* --- Init Routine or ap_hook_pre_config --- */
+/* ------------------------------------------ */
+/* The config list and shm live in pconf, forget them when it is recycled */
+static int vlimit_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+#ifdef __APACHE24__
+  // "Mutex vlimit pthread|sysvsem|fcntl|flock|posixsem|default" picks the mechanism of the stripes
+  if (ap_mutex_register(pconf, VLIMIT_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0) != APR_SUCCESS) {
+    return DONE;
+  }
+#endif
+
+  vlimit_conf_list = NULL;
+  vlimit_sizing_list = NULL;
+  conf_counter = 0;
+  vlimit_atomic = 0;
+  vlimit_overflow_evict = 0;
+  vlimit_retain = 0;
+  vlimit_shm_file = NULL;
+  vlimit_ip_scope_conn = 0;
+  vlimit_key_used = 0;
+  vlimit_mutex_stripes = 1;
+  vlimit_wait_ms = 0;
+  vlimit_wait_max = 0;
+  vlimit_load_scale = NULL;
+  vlimit_auto_used = 0;
+  vlimit_auto_load = 0;
+  vlimit_log_buffer_size = 0;
+  vlimit_debug_level = VLIMIT_DEBUG_TRACE;
+  shm = NULL;
+  shm_base = NULL;
+  vlimit_lease_shm = NULL;
+  vlimit_lease_count = 0;
+  vlimit_backend_used = &vlimit_backends[0];
+  vlimit_sync_interval = VLIMIT_DEFAULT_SYNC_INTERVAL;
+  vlimit_sync_pool = NULL;
+  vlimit_synced_window = 0;
+  vlimit_sync_proc = NULL;
+  vlimit_memcache_servers = NULL;
+  vlimit_memcache = NULL;
+
+  return OK;
+}
+
+/* VlimitIPPrefix of the section, then of its vhost, then of the main server */
+static vlimit_config *vlimit_config_ip_prefix(vlimit_config *cfg, vlimit_config *main_cfg)
+{
+  if (cfg->ip_prefix4 > 0) {
+    return cfg;
+  }
+  if (cfg->srv_cfg != NULL && cfg->srv_cfg->ip_prefix4 > 0) {
+    return cfg->srv_cfg;
+  }
 
-    if (strcmp(cfg->full_path, real_path_dir) != 0) {
+  return main_cfg;
+}
 
-      vlimit_debug_log_buf = apr_psprintf(r->pool, "full_path not match cfg->full_path=(%s) <=> real_path_dir=(%s)",
-                                          cfg->full_path, real_path_dir);
-      VLIMIT_DEBUG_SYSLOG("vlimit_handler: ", vlimit_debug_log_buf, r->pool);
-      VLIMIT_DEBUG_SYSLOG("vlimit_handler: ", "full_path not match end...", r->pool);
+/* network byte order mask of the first bits of an ip_key */
+static void vlimit_ip_mask(ip_key *mask, int bits)
+{
+  int i;
 
-      return DECLINED;
+  for (i = 0; i < 4; i++, bits -= 32) {
+    if (bits >= 32) {
+      mask->word[i] = 0xffffffffU;
+    } else if (bits > 0) {
+      mask->word[i] = htonl(0xffffffffU << (32 - bits));
+    } else {
+      mask->word[i] = 0;
     }
-
-    vlimit_debug_log_buf = apr_psprintf(r->pool, "full_path match cfg->full_path=(%s) <=> real_path_dir=(%s)",
-                                        cfg->full_path, real_path_dir);
-    VLIMIT_DEBUG_SYSLOG("vlimit_handler: ", vlimit_debug_log_buf, r->pool);
-  } else {
-    //vlimit_debug_log_buf = apr_psprintf(r->pool, "full_path not found. cfg->full_path=(%s)", cfg->full_path);
-    vlimit_debug_log_buf = apr_psprintf(r->pool, "full_path not found. cfg->full_path=((null))");
-    VLIMIT_DEBUG_SYSLOG("vlimit_handler: ", vlimit_debug_log_buf, r->pool);
   }
+}
 
-  VLIMIT_DEBUG_SYSLOG("vlimit_handler: ", "Entering normal handler", r->pool);
-  result = vlimit_check_limit(r, cfg);
-  VLIMIT_DEBUG_SYSLOG("vlimit_handler: ", "Exiting normal handler", r->pool);
+/* VlimitMaxSlots of the section, then of its vhost, then of the main server */
+static int vlimit_config_max_slots(vlimit_config *cfg, vlimit_config *main_cfg)
+{
+  if (cfg->max_slots > 0) {
+    return vlimit_slot_size(cfg->max_slots);
+  }
+  if (cfg->srv_cfg != NULL && cfg->srv_cfg->max_slots > 0) {
+    return vlimit_slot_size(cfg->srv_cfg->max_slots);
+  }
+  if (main_cfg->max_slots > 0) {
+    return vlimit_slot_size(main_cfg->max_slots);
+  }
 
-  return result;
+  return VLIMIT_DEFAULT_MAX_SLOTS;
 }
 
-/* -------------------------------------------- */
-/* --- Access Checker for Per Server Config --- */
-/* -------------------------------------------- */
-/* For server configration */
-/*static int vlimit_quick_handler(request_rec *r, int lookup)
+/* each stripe owns one partition per table, small tables keep VLIMIT_MIN_PART_SLOTS per partition */
+static int vlimit_config_part_slots(int slots)
 {
-  vlimit_config *cfg = (vlimit_config *)ap_get_module_config(r->server->module_config, &vlimit_module);
+  int part_slots = slots / vlimit_mutex_stripes;
 
-  int result;
-  char *real_path_dir = (char *)apr_pcalloc(r->pool, sizeof(char *) * PATH_MAX + 1);
+  if (part_slots < VLIMIT_MIN_PART_SLOTS) {
+    part_slots = (slots < VLIMIT_MIN_PART_SLOTS) ? slots : VLIMIT_MIN_PART_SLOTS;
+  }
 
-  // * full_path check * /
-  if (cfg->full_path != NULL) {
+  return part_slots;
+}
 
-    if (access(r->filename, F_OK) != 0) {
-      real_path_dir = apr_pstrdup(r->pool, r->filename);
-    } else if (realpath_for_vlimit(r->filename, real_path_dir, PATH_MAX, r->pool) == NULL) {
-      vlimit_debug_log_buf = apr_psprintf(r->pool, "realpath_for_vlimit was failed. path=(%s)", r->filename);
-      VLIMIT_DEBUG_SYSLOG("vlimit_handler: ", vlimit_debug_log_buf, r->pool);
-      return DECLINED;
-    }
+/* spread the partitions of each config and table over the stripes */
+static int vlimit_stripe_base(int conf_id, int type)
+{
+  return (int)(((apr_uint32_t)conf_id * 2 + type) * 2654435761U >> 16);
+}
+
+static apr_size_t vlimit_config_shm_size(vlimit_config *cfg, int slots)
+{
+  apr_size_t size = VLIMIT_ALIGN_LINE(sizeof(conf_stat));
 
-    if (strcmp(cfg->full_path, real_path_dir) != 0) {
+  if (VLIMIT_FILE_TRACKED(cfg)) {
+    size += VLIMIT_ALIGN_LINE(sizeof(file_stat) * slots);
+    size += VLIMIT_ALIGN_LINE(sizeof(file_name) * slots);
+  }
+  if (VLIMIT_IP_TRACKED(cfg)) {
+    size += VLIMIT_ALIGN_LINE(sizeof(ip_stat) * slots);
+  }
 
-      vlimit_debug_log_buf = apr_psprintf(r->pool, "full_path not match cfg->full_path=(%s) <=> real_path_dir=(%s)",
-                                          cfg->full_path, real_path_dir);
-      VLIMIT_DEBUG_SYSLOG("vlimit_quick_handler: ", vlimit_debug_log_buf, r->pool);
-      VLIMIT_DEBUG_SYSLOG("vlimit_quick_handler: ", "mod_vlimit: vlimit_quick_handler: full_path not match end...",
-                          r->pool);
+  return size;
+}
 
-      return DECLINED;
-    }
+/* the decision record of a registered config, everything its requests need without looking at strings */
+static void vlimit_decide(vlimit_config *cfg, SHM_DATA *limit_stat)
+{
+  cfg->decision.flags = 0;
+  cfg->decision.limit_stat = limit_stat;
+  cfg->decision.path_key = 0;
 
-    vlimit_debug_log_buf = apr_psprintf(r->pool, "full_path match cfg->full_path=(%s) <=> real_path_dir=(%s)",
-                                        cfg->full_path, real_path_dir);
-    VLIMIT_DEBUG_SYSLOG("vlimit_quick_handler: ", vlimit_debug_log_buf, r->pool);
+  if (VLIMIT_IP_TRACKED(cfg)) {
+    cfg->decision.flags |= VLIMIT_DECIDE_IP;
+  }
+  if (VLIMIT_FILE_TRACKED(cfg)) {
+    cfg->decision.flags |= VLIMIT_DECIDE_FILE;
+  }
+  if (cfg->key_cfg != NULL) {
+    cfg->decision.flags |= VLIMIT_DECIDE_KEY;
+  }
+  if (cfg->full_path != NULL) {
+    cfg->decision.flags |= VLIMIT_DECIDE_PATH;
+    cfg->decision.path_key = vlimit_hash_string64(cfg->full_path);
+  }
+  // set outside of any section and known before URI translation
+  if (cfg->srv_cfg == cfg && VLIMIT_IP_TRACKED(cfg) && cfg->full_path == NULL) {
+    cfg->decision.flags |= VLIMIT_DECIDE_QUICK;
   }
+}
 
-  VLIMIT_DEBUG_SYSLOG("vlimit_quick_handler: ", "mod_vlimit: Entering quick handler", r->pool);
-  result = vlimit_check_limit(r, cfg);
-  VLIMIT_DEBUG_SYSLOG("vlimit_quick_handler: ", "mod_vlimit: Entering quick handler", r->pool);
+/* the shm_conf of a config, what vlimitctl reads instead of the httpd config */
+static void vlimit_describe(shm_conf *desc, vlimit_config *cfg, SHM_DATA *shm_data)
+{
 
-  return result;
-}*/
+  const char *path = cfg->full_path ? cfg->full_path : (cfg->key_name ? cfg->key_name : "");
+  apr_size_t len = strlen(path);
+
+  memset(desc, 0, sizeof(*desc));
+  desc->conf_id = cfg->conf_id;
+  desc->max_slots = shm_data->max_slots;
+  desc->part_slots = shm_data->part_slots;
+  desc->ip_limit = cfg->ip_limit;
+  desc->file_limit = cfg->file_limit;
+  desc->stat_offset = (char *)shm_data->stat_shm - (char *)shm_base;
+  if (shm_data->ip_stat_shm != NULL) {
+    desc->ip_offset = (char *)shm_data->ip_stat_shm - (char *)shm_base;
+  }
+  if (shm_data->file_stat_shm != NULL) {
+    desc->file_offset = (char *)shm_data->file_stat_shm - (char *)shm_base;
+    desc->name_offset = (char *)shm_data->file_name_shm - (char *)shm_base;
+  }
+  apr_cpystrn(desc->full_path, len >= VLIMIT_FILE_NAME_LEN ? path + len - (VLIMIT_FILE_NAME_LEN - 1) : path,
+              VLIMIT_FILE_NAME_LEN);
+}
 
-/* ------------------------------------ */
-/* --- Command_rec for VlimitIP--- */
-/* ------------------------------------ */
-/* Parse the VlimitIP directive */
-static const char *set_vlimitip(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg_opt1)
+/* everything the offsets of the shm block depend on, hashed; a kept block is reused only when it matches */
+static apr_uint64_t vlimit_shm_layout(apr_pool_t *p, vlimit_config *main_cfg, apr_size_t shm_size)
 {
-  vlimit_config *cfg = (vlimit_config *)mconfig;
-  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(parms->server->module_config, &vlimit_module);
 
-  signed long int limit = strtol(arg1, (char **)NULL, 10);
+  vlimit_config *cfg;
+  char *layout;
+  int t;
 
-  /* No reasonable person would want more than 2^16. Better would be
-     to use LONG_MAX but that causes portability problems on win32 */
-  if ((limit > 65535) || (limit < 0)) {
-    return "Integer overflow or invalid number";
+  layout = apr_psprintf(p, "v%d size=%lu leases=%d stripes=%d ip=%d file=%d lease=%d stat=%d shm=%s;",
+                        VLIMIT_SHM_VERSION, (unsigned long)shm_size, vlimit_lease_count, vlimit_mutex_stripes,
+                        (int)sizeof(ip_stat), (int)sizeof(file_stat), (int)sizeof(lease_stat), (int)sizeof(conf_stat),
+                        vlimit_shm_file ? vlimit_shm_file : "");
+  for (t = 0; vlimit_conf_list != NULL && t < vlimit_conf_list->nelts; t++) {
+    cfg = APR_ARRAY_IDX(vlimit_conf_list, t, vlimit_config *);
+    // a section moved to another vhost or path keeps neither the conf_id nor the counts of the old one
+    layout = apr_psprintf(p, "%s%d:%d:%d%d:%s:%s:%u:%s;", layout, cfg->conf_id, vlimit_config_max_slots(cfg, main_cfg),
+                          VLIMIT_IP_TRACKED(cfg), VLIMIT_FILE_TRACKED(cfg), cfg->full_path ? cfg->full_path : "",
+                          cfg->server && cfg->server->server_hostname ? cfg->server->server_hostname : "",
+                          cfg->server ? (unsigned)cfg->server->port : 0U, cfg->section ? cfg->section : "");
   }
 
-  if (parms->path != NULL) {
-    /* Per-directory context */
-    cfg->type = SET_VLIMITIP;
-    cfg->ip_limit = limit;
-    cfg->full_path = apr_pstrdup(parms->pool, arg_opt1);
-  } else {
-    /* Per-server context */
-    scfg->type = SET_VLIMITIP;
-    scfg->ip_limit = limit;
-    scfg->full_path = apr_pstrdup(parms->pool, arg_opt1);
+  return vlimit_hash_string64(layout);
+}
+
+/* VlimitRetain state, on the process pool so that it outlives pconf */
+static vlimit_retained *vlimit_retained_data(apr_pool_t *process_pool)
+{
+  vlimit_retained *retained = NULL;
+
+  apr_pool_userdata_get((void **)&retained, VLIMIT_RETAINED_KEY, process_pool);
+  if (retained == NULL) {
+    retained = (vlimit_retained *)apr_pcalloc(process_pool, sizeof(*retained));
+    apr_pool_userdata_set(retained, VLIMIT_RETAINED_KEY, apr_pool_cleanup_null, process_pool);
   }
 
-  return NULL;
+  return retained;
 }
 
-/* --------------------------------------- */
-/* --- Command_rec for VlimitFile--- */
-/* --------------------------------------- */
-/* Parse the VlimitFile directive */
-static const char *set_vlimitfile(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg_opt1)
+/* the layout changed, children of the old generation keep their mapping until they exit */
+static void vlimit_retained_destroy(vlimit_retained *retained)
 {
-  vlimit_config *cfg = (vlimit_config *)mconfig;
-  vlimit_config *scfg = (vlimit_config *)ap_get_module_config(parms->server->module_config, &vlimit_module);
-
-  signed long int limit = strtol(arg1, (char **)NULL, 10);
+  int t;
 
-  /* No reasonable person would want more than 2^16. Better would be
-     to use LONG_MAX but that causes portability problems on win32 */
-  if ((limit > 65535) || (limit < 0)) {
-    return "Integer overflow or invalid number";
+  if (retained->shm != NULL) {
+    apr_shm_destroy(retained->shm);
+    retained->shm = NULL;
   }
-
-  if (parms->path != NULL) {
-    /* Per-directory context */
-    cfg->type = SET_VLIMITFILE;
-    cfg->file_limit = limit;
-    cfg->full_path = apr_pstrdup(parms->pool, arg_opt1);
-  } else {
-    /* Per-server context */
-    scfg->type = SET_VLIMITFILE;
-    scfg->file_limit = limit;
-    scfg->full_path = apr_pstrdup(parms->pool, arg_opt1);
+  for (t = 0; retained->mutex != NULL && t < retained->stripes; t++) {
+    apr_global_mutex_destroy(retained->mutex[t]);
   }
+  retained->mutex = NULL;
+  retained->stripes = 0;
+}
 
-  return NULL;
+/* ServerName and ServerAlias sets of every server_rec, looked up by check_virtualhost_name */
+static void vlimit_init_host_names(apr_pool_t *p, server_rec *s)
+{
+  int i;
+  char *name;
+  vlimit_config *scfg;
+
+  for (; s != NULL; s = s->next) {
+    scfg = (vlimit_config *)ap_get_module_config(s->module_config, &vlimit_module);
+    scfg->host_names = apr_hash_make(p);
+    scfg->wild_names = NULL;
+
+    if (s->server_hostname != NULL) {
+      name = apr_pstrdup(p, s->server_hostname);
+      ap_str_tolower(name);
+      apr_hash_set(scfg->host_names, name, APR_HASH_KEY_STRING, name);
+    }
+    if (s->names != NULL) {
+      for (i = 0; i < s->names->nelts; i++) {
+        name = apr_pstrdup(p, ((char **)s->names->elts)[i]);
+        ap_str_tolower(name);
+        apr_hash_set(scfg->host_names, name, APR_HASH_KEY_STRING, name);
+      }
+    }
+    // httpd already moved ServerAlias containing * or ? to wild_names, matched case-insensitively
+    if (s->wild_names != NULL && s->wild_names->nelts > 0) {
+      scfg->wild_names = s->wild_names;
+    }
+  }
 }
 
-/* ------------------------ */
-/* --- Command_rec Array--- */
-/* ------------------------ */
-static command_rec vlimit_cmds[] = {
-    AP_INIT_TAKE12("VlimitIP", set_vlimitip, NULL, OR_LIMIT | RSRC_CONF,
-                   "maximum connections per IP address to DocumentRoot"),
-    AP_INIT_TAKE12("VlimitFile", set_vlimitfile, NULL, OR_LIMIT | RSRC_CONF,
-                   "maximum connections per File to DocumentRoot"),
-    {NULL},
-};
+/* VirtualHosts without a VlimitExempt of their own use the one of the main server */
+static void vlimit_init_exempt(server_rec *s)
+{
+  vlimit_config *main_cfg = (vlimit_config *)ap_get_module_config(s->module_config, &vlimit_module);
+  vlimit_config *scfg;
+
+  for (s = s->next; s != NULL; s = s->next) {
+    scfg = (vlimit_config *)ap_get_module_config(s->module_config, &vlimit_module);
+    if (scfg->exempt == NULL) {
+      scfg->exempt = main_cfg->exempt;
+    }
+  }
+}
 
 /* ------------------------------------------- */
 /* --- Init Routine or ap_hook_post_config --- */
@@ -954,173 +3295,566 @@ static command_rec vlimit_cmds[] = {
 /* Set up startup-time initialization */
 static int vlimit_init(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
 {
-  VLIMIT_DEBUG_SYSLOG("vlimit_init: ", MODULE_NAME " " MODULE_VERSION " started.", p);
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", MODULE_NAME " " MODULE_VERSION " started.");
 
-  if (apr_file_open(&vlimit_log_fp, VLIMIT_LOG_FILE, APR_WRITE | APR_APPEND | APR_CREATE, APR_OS_DEFAULT, p) !=
-      APR_SUCCESS) {
-    return OK;
-  }
+  vlimit_init_host_names(p, s);
+  vlimit_init_exempt(s);
 
   apr_status_t status;
   apr_size_t retsize;
-  apr_size_t shm_size;
+  apr_size_t shm_size = 0;
+  apr_size_t offset = 0;
   int t;
+  int slots;
 
+  vlimit_config *main_cfg = (vlimit_config *)ap_get_module_config(s->module_config, &vlimit_module);
+  vlimit_config *cfg;
+  vlimit_config *prefix_cfg;
   SHM_DATA *shm_data = NULL;
+  shm_header *header;
+  shm_conf *conf_shm;
+  apr_size_t conf_offset = 0;
+  vlimit_retained *retained = NULL;
+  apr_pool_t *seg_pool = p;
+  apr_uint64_t layout;
+  int reused = 0;
+
+  // without the module access log the limits still apply
+  if (apr_file_open(&vlimit_log_fp, VLIMIT_LOG_FILE, APR_WRITE | APR_APPEND | APR_CREATE, APR_OS_DEFAULT, p) !=
+      APR_SUCCESS) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "Error opening " VLIMIT_LOG_FILE ", module log disabled.");
+    vlimit_log_fp = NULL;
+  }
+
+  // tables are laid out per section at startup, a setting no table of its section uses cannot apply
+  for (t = 0; vlimit_sizing_list != NULL && t < vlimit_sizing_list->nelts; t++) {
+    cfg = APR_ARRAY_IDX(vlimit_sizing_list, t, vlimit_config *);
+    if (cfg->conf_id < 0) {
+      ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                   MODULE_NAME ": %s sets no VlimitIP / VlimitFile / VlimitKey, put it next to the limit it sizes",
+                   cfg->sizing);
+      return HTTP_INTERNAL_SERVER_ERROR;
+    }
+  }
 
-  shm_size = (apr_size_t)(sizeof(shm_data) + sizeof(shm_data->file_stat_shm) + sizeof(shm_data->ip_stat_shm)) *
-             (conf_counter + 1);
+  for (t = 0; vlimit_conf_list != NULL && t < vlimit_conf_list->nelts; t++) {
+    cfg = APR_ARRAY_IDX(vlimit_conf_list, t, vlimit_config *);
+    shm_size += vlimit_config_shm_size(cfg, vlimit_config_max_slots(cfg, main_cfg));
+  }
 
-  // Create global mutex
-  status = apr_global_mutex_create(&vlimit_mutex, NULL, APR_LOCK_DEFAULT, p);
-  if (status != APR_SUCCESS) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_init: ", "Error creating global mutex.", p);
-    return status;
+  if (shm_size > 0) {
+    vlimit_lease_count = vlimit_lease_table_size();
+    conf_offset = VLIMIT_ALIGN_LINE(sizeof(shm_header)) + VLIMIT_ALIGN_LINE(sizeof(lease_stat) * vlimit_lease_count);
+    offset = conf_offset + VLIMIT_ALIGN_LINE(sizeof(shm_conf) * vlimit_conf_list->nelts);
+    shm_size += offset;
   }
-#ifdef AP_NEED_SET_MUTEX_PERMS
-  status = unixd_set_global_mutex_perms(vlimit_mutex);
-  if (status != APR_SUCCESS) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_init: ", "Error xrent could not set permissions on global mutex.", p);
-    return status;
+  layout = vlimit_shm_layout(ptemp, main_cfg, shm_size);
+
+  // VlimitRetain: the block and mutexes live in the process pool, reused while the layout is unchanged
+  if (vlimit_retain) {
+    seg_pool = s->process->pool;
+    retained = vlimit_retained_data(seg_pool);
+    if (retained->shm != NULL && retained->stripes == vlimit_mutex_stripes &&
+        apr_shm_size_get(retained->shm) == shm_size + VLIMIT_SHM_SLACK &&
+        ((shm_header *)VLIMIT_SHM_BASE(retained->shm))->magic == VLIMIT_SHM_MAGIC &&
+        ((shm_header *)VLIMIT_SHM_BASE(retained->shm))->version == VLIMIT_SHM_VERSION &&
+        ((shm_header *)VLIMIT_SHM_BASE(retained->shm))->layout == layout) {
+      shm = retained->shm;
+      vlimit_mutex = retained->mutex;
+      reused = 1;
+    } else {
+      vlimit_retained_destroy(retained);
+    }
+  } else if (apr_pool_userdata_get((void **)&retained, VLIMIT_RETAINED_KEY, s->process->pool) == APR_SUCCESS &&
+             retained != NULL) {
+    // VlimitRetain was turned off, let go of what the previous generation kept
+    vlimit_retained_destroy(retained);
+    retained = NULL;
   }
-#endif
 
-  /* If there was a memory block already assigned.. destroy it */
-  if (shm) {
-    status = apr_shm_destroy(shm);
+  // Create global mutex, one per stripe
+  if (!reused) {
+    vlimit_mutex = (apr_global_mutex_t **)apr_pcalloc(seg_pool, sizeof(apr_global_mutex_t *) * vlimit_mutex_stripes);
+  }
+  for (t = 0; !reused && t < vlimit_mutex_stripes; t++) {
+#ifdef __APACHE24__
+    // mechanism and lock file directory from "Mutex vlimit ...", the stripe tells the lock files apart;
+    // ap_global_mutex_create sets the permissions itself
+    status = ap_global_mutex_create(&vlimit_mutex[t], NULL, VLIMIT_MUTEX_TYPE, apr_psprintf(ptemp, "%d", t), s,
+                                    seg_pool, 0);
     if (status != APR_SUCCESS) {
-      VLIMIT_DEBUG_SYSLOG("vlimit_init: ", "Couldn't destroy old memory block", p);
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "Error creating global mutex.");
+      return status;
+    }
+#else
+    status = apr_global_mutex_create(&vlimit_mutex[t], NULL, APR_LOCK_DEFAULT, seg_pool);
+    if (status != APR_SUCCESS) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "Error creating global mutex.");
+      return status;
+    }
+#endif
+#if defined(AP_NEED_SET_MUTEX_PERMS) && !defined(__APACHE24__)
+    status = unixd_set_global_mutex_perms(vlimit_mutex[t]);
+    if (status != APR_SUCCESS) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "Error xrent could not set permissions on global mutex.");
       return status;
-    } else {
-      VLIMIT_DEBUG_SYSLOG("vlimit_init: ", "Old Shared memory block, destroyed.", p);
     }
+#endif
+  }
+  if (retained != NULL) {
+    retained->mutex = vlimit_mutex;
+    retained->stripes = vlimit_mutex_stripes;
+  }
+
+  if (shm_size == 0) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ",
+                        "No VlimitIP/VlimitFile configured, shm block not created.");
+    return OK;
   }
 
   /* Create shared memory block */
-  status = apr_shm_create(&shm, shm_size, NULL, p);
-  if (status != APR_SUCCESS) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_init: ", "Error creating shm block", p);
-    return status;
+  if (!reused) {
+    // a name left over by a crashed httpd would make the create fail
+    if (vlimit_shm_file != NULL) {
+      apr_shm_remove(vlimit_shm_file, ptemp);
+    }
+    status = apr_shm_create(&shm, shm_size + VLIMIT_SHM_SLACK, vlimit_shm_file, seg_pool);
+    if (status != APR_SUCCESS) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "Error creating shm block");
+      return status;
+    }
   }
 
   /* Check size of shared memory block */
   retsize = apr_shm_size_get(shm);
-  if (retsize != shm_size) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_init: ", "Error allocating shared memory block", p);
+  if (retsize != shm_size + VLIMIT_SHM_SLACK) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "Error allocating shared memory block");
     return status;
   }
-  /* Init shm block */
-  shm_base = apr_shm_baseaddr_get(shm);
+  retsize = shm_size;
+  // every offset below is from a cache line boundary, so the 64 byte entries each fill one line
+  shm_base = apr_shm_baseaddr_get(shm) != NULL ? VLIMIT_SHM_BASE(shm) : NULL;
   if (shm_base == NULL) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_init", "Error creating status block.", p);
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "Error creating status block.");
     return status;
   }
-  memset(shm_base, 0, retsize);
+  header = (shm_header *)shm_base;
+  vlimit_lease_shm = (lease_stat *)((char *)shm_base + VLIMIT_ALIGN_LINE(sizeof(shm_header)));
+  vlimit_load_scale = &header->load_scale;
+  conf_shm = (shm_conf *)((char *)shm_base + conf_offset);
 
-  vlimit_debug_log_buf = apr_psprintf(
-      p, "Memory Allocated %d bytes (each conf takes %d bytes) MaxClient:%d", (int)retsize,
-      (int)(sizeof(shm_data) + sizeof(shm_data->file_stat_shm) + sizeof(shm_data->ip_stat_shm)), MAX_CLIENTS);
-  VLIMIT_DEBUG_SYSLOG("vlimit_init: ", vlimit_debug_log_buf, p);
+  if (reused) {
+    // counts of the children of the previous generation are still in the slots, they drop them there
+    header->restarts++;
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "shm block kept across %u restarts.", header->restarts);
+  } else {
+    /* Init shm block, zero means VLIMIT_SLOT_EMPTY and counter 0 */
+    memset(shm_base, 0, retsize);
+    header->magic = VLIMIT_SHM_MAGIC;
+    header->version = VLIMIT_SHM_VERSION;
+    header->layout = layout;
+    header->load_scale = VLIMIT_LOAD_SCALE_ONE;
+    for (t = 0; t < vlimit_lease_count; t++) {
+      vlimit_lease_shm[t].file_slot = -1;
+      vlimit_lease_shm[t].ip_slot = -1;
+    }
+    if (retained != NULL) {
+      retained->shm = shm;
+    }
+  }
+  header->lease_count = vlimit_lease_count;
+  // a reset left by vlimitctl for the previous layout is dropped, vlimitctl times out on it
+  header->reset_state = VLIMIT_RESET_FREE;
+  header->conf_count = vlimit_conf_list->nelts;
+  header->conf_offset = conf_offset;
+
+  /* Lay out the slot tables of each config on the shm block */
+  for (t = 0; t < vlimit_conf_list->nelts; t++) {
+    cfg = APR_ARRAY_IDX(vlimit_conf_list, t, vlimit_config *);
+    slots = vlimit_config_max_slots(cfg, main_cfg);
+
+    shm_data = (SHM_DATA *)apr_pcalloc(p, sizeof(*shm_data));
+    shm_data->max_slots = slots;
+    shm_data->part_slots = vlimit_config_part_slots(slots);
+    shm_data->file_lock = vlimit_stripe_base(cfg->conf_id, SET_VLIMITFILE);
+    shm_data->ip_lock = vlimit_stripe_base(cfg->conf_id, SET_VLIMITIP);
+    prefix_cfg = vlimit_config_ip_prefix(cfg, main_cfg);
+    if (cfg->ip_rate > 0) {
+      shm_data->ip_rate_emission = cfg->ip_rate_interval / cfg->ip_rate;
+      shm_data->ip_rate_interval = cfg->ip_rate_interval;
+    }
+    if (cfg->file_rate > 0) {
+      shm_data->file_rate_emission = cfg->file_rate_interval / cfg->file_rate;
+      shm_data->file_rate_interval = cfg->file_rate_interval;
+    }
+    vlimit_ip_mask(&shm_data->ip_mask4, 96 + (prefix_cfg->ip_prefix4 > 0 ? prefix_cfg->ip_prefix4 : 32));
+    vlimit_ip_mask(&shm_data->ip_mask6, prefix_cfg->ip_prefix6 > 0 ? prefix_cfg->ip_prefix6 : 128);
+    shm_data->stat_shm = (conf_stat *)((char *)shm_base + offset);
+    offset += VLIMIT_ALIGN_LINE(sizeof(conf_stat));
+    if (VLIMIT_FILE_TRACKED(cfg)) {
+      shm_data->file_stat_shm = (file_stat *)((char *)shm_base + offset);
+      offset += VLIMIT_ALIGN_LINE(sizeof(file_stat) * slots);
+      shm_data->file_name_shm = (file_name *)((char *)shm_base + offset);
+      offset += VLIMIT_ALIGN_LINE(sizeof(file_name) * slots);
+    }
+    if (VLIMIT_IP_TRACKED(cfg)) {
+      shm_data->ip_stat_shm = (ip_stat *)((char *)shm_base + offset);
+      offset += VLIMIT_ALIGN_LINE(sizeof(ip_stat) * slots);
+    }
+    cfg->limit_stat = shm_data;
+    vlimit_decide(cfg, shm_data);
+    vlimit_describe(&conf_shm[t], cfg, shm_data);
 
-  if (retsize < (sizeof(shm_data) * conf_counter)) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_init ", "Not enough memory allocated!! Giving up", p);
-    return HTTP_INTERNAL_SERVER_ERROR;
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "conf_id: %d MaxSlots:%d takes %d bytes", cfg->conf_id,
+                        slots, (int)vlimit_config_shm_size(cfg, slots));
   }
 
-  int i;
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "Memory Allocated %d bytes", (int)retsize);
 
-  for (t = 0; t <= conf_counter; t++) {
-    shm_data = shm_base + t;
-    for (i = 0; i < MAX_CLIENTS; i++) {
-      shm_data->file_stat_shm[i].filename[0] = '\0';
-      shm_data->ip_stat_shm[i].address[0] = '\0';
-      shm_data->file_stat_shm[i].counter = 0;
-      shm_data->ip_stat_shm[i].counter = 0;
+  if (vlimit_backend_used->init != NULL) {
+    status = vlimit_backend_used->init(p, s);
+    if (status != APR_SUCCESS) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "Error initializing VlimitBackend %s",
+                          vlimit_backend_used->name);
+      return status;
     }
+    apr_pool_create(&vlimit_sync_pool, p);
   }
 
-  vlimit_debug_log_buf =
-      apr_psprintf(p, "%s Version %s - Initialized [%d Conf]", MODULE_NAME, MODULE_VERSION, conf_counter);
-  VLIMIT_DEBUG_SYSLOG("vlimit_init: ", vlimit_debug_log_buf, p);
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_init: ", "%s Version %s - Initialized [%d Conf]", MODULE_NAME,
+                      MODULE_VERSION, conf_counter);
 
   return OK;
 }
 
 static void vlimit_child_init(apr_pool_t *p, server_rec *server)
 {
-  if (apr_global_mutex_child_init(&vlimit_mutex, NULL, p)) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_child_init: ", "global mutex attached.", p);
+  apr_status_t status;
+  int t;
+
+  for (t = 0; t < vlimit_mutex_stripes; t++) {
+#ifdef __APACHE24__
+    // file based mechanisms reopen their lock file
+    status = apr_global_mutex_child_init(&vlimit_mutex[t], apr_global_mutex_lockfile(vlimit_mutex[t]), p);
+#else
+    status = apr_global_mutex_child_init(&vlimit_mutex[t], NULL, p);
+#endif
+    if (status == APR_SUCCESS) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_child_init: ", "global mutex attached.");
+    } else {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_child_init: ", "global mutex %d can't be attached.", t);
+    }
   }
-  if (apr_shm_attach(&shm, NULL, p) == APR_SUCCESS) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_child_init: ", "global shared memory attached.", p);
-  } else {
-    VLIMIT_DEBUG_SYSLOG("vlimit_child_init: ", "global shared memory can't be attached.", p);
+  // the shm segment is anonymous or its file is already mapped by the parent, the child inherits the mapping
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_child_init: ", "global shared memory inherited.");
+
+  if (vlimit_log_buffer_size > 0 && vlimit_log_fp != NULL) {
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&vlimit_log_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_child_init: ",
+                          "log buffer mutex can't be created. log unbuffered.");
+      return;
+    }
+#endif
+    vlimit_log_buffer = apr_palloc(p, vlimit_log_buffer_size);
+    vlimit_log_buffer_len = 0;
+    vlimit_log_flushed = apr_time_now();
+    apr_pool_cleanup_register(p, NULL, vlimit_log_buffer_cleanup, apr_pool_cleanup_null);
+#if APR_HAS_THREADS
+    vlimit_log_stop = 0;
+    if (apr_thread_cond_create(&vlimit_log_cond, p) != APR_SUCCESS ||
+        apr_thread_create(&vlimit_log_thread, NULL, vlimit_log_flush_thread, NULL, p) != APR_SUCCESS) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_child_init: ",
+                          "log flush thread can't be started. log flushed by the next line.");
+      vlimit_log_thread = NULL;
+    } else {
+      apr_pool_pre_cleanup_register(p, NULL, vlimit_log_flush_stop);
+    }
+#endif
   }
 }
 
-static int vlimit_response_end(request_rec *r)
+/* ---------------------------- */
+/* --- Load Sampler Routine --- */
+/* ---------------------------- */
+/* busy workers of the scoreboard and optionally the load average, per mille of full load */
+static int vlimit_load_pressure(void)
+{
+
+  int max_daemons = 0;
+  int max_threads = 0;
+  int daemons = 0;
+  int threads = 0;
+  int capacity;
+  int busy = 0;
+  int pressure;
+  int status;
+  int i;
+  int j;
+  double load;
+
+  ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &max_daemons);
+  ap_mpm_query(AP_MPMQ_MAX_THREADS, &max_threads);
+  ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &daemons);
+  ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &threads);
+  // MaxRequestWorkers, prefork answers 0 threads
+  capacity = (max_daemons > 0 ? max_daemons : 1) * (max_threads > 0 ? max_threads : 1);
+
+  for (i = 0; i < daemons; i++) {
+    for (j = 0; j < threads; j++) {
+      status = ap_scoreboard_image->servers[i][j].status;
+      busy += status != SERVER_DEAD && status != SERVER_READY && status != SERVER_STARTING &&
+              status != SERVER_IDLE_KILL;
+    }
+  }
+  pressure = (int)((apr_int64_t)busy * 1000 / capacity);
+
+  if (vlimit_auto_load > 0 && getloadavg(&load, 1) == 1 && load * 1000 / vlimit_auto_load > pressure) {
+    pressure = (int)(load * 1000 / vlimit_auto_load);
+  }
+
+  return pressure > 1000 ? 1000 : pressure;
+}
+
+/* parent only, once per monitor run; tightens at once and loosens a quarter of the way per run */
+static void vlimit_load_sample(void)
 {
 
-  int counter_stat = -2;
+  apr_uint32_t scale = VLIMIT_LOAD_SCALE_ONE;
+  apr_uint32_t current;
+  int pressure;
 
-  VLIMIT_DEBUG_SYSLOG("vlimit_response_end: ", "start", r->pool);
+  if (!vlimit_auto_used || vlimit_load_scale == NULL || ap_scoreboard_image == NULL) {
+    return;
+  }
 
-  vlimit_config *cfg = (vlimit_config *)ap_get_module_config(r->per_dir_config, &vlimit_module);
+  pressure = vlimit_load_pressure();
+  if (pressure > VLIMIT_LOAD_KNEE) {
+    scale = (apr_uint32_t)((1000 - pressure) * VLIMIT_LOAD_SCALE_ONE / (1000 - VLIMIT_LOAD_KNEE));
+  }
+  current = apr_atomic_read32(vlimit_load_scale);
+  if (scale > current) {
+    scale = current + (scale - current + 3) / 4;
+  }
 
-  if (check_virtualhost_name(r)) {
-    VLIMIT_DEBUG_SYSLOG(__func__, ": access_host != server_hostname. return OK.", r->pool);
-    VLIMIT_DEBUG_SYSLOG("vlimit_response_end: ", "end", r->pool);
+  if (scale != current) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_load_sample: ", "pressure %d/1000 load_scale %u -> %u", pressure,
+                        current, scale);
+    apr_atomic_set32(vlimit_load_scale, scale);
+  }
+}
+
+/* ------------------------------- */
+/* --- vlimitctl Reset Mailbox --- */
+/* ------------------------------- */
+/* parent only, apply the reset vlimitctl left in the shm header, under the mutex of the slot; free the
+ * mailbox of a vlimitctl that went away while it held it */
+static void vlimit_apply_reset(void)
+{
+
+  static apr_uint32_t seen = VLIMIT_RESET_FREE;
+  static apr_time_t seen_since = 0;
+  shm_header *header = (shm_header *)shm_base;
+  SHM_DATA *limit_stat = NULL;
+  vlimit_config *cfg;
+  apr_uint32_t state;
+  apr_time_t now;
+  int result = -1;
+
+  if (header == NULL || vlimit_conf_list == NULL) {
+    return;
+  }
+
+  // vlimitctl holds CLAIMED and DONE for a few ms, one killed in between leaves them behind and
+  // VlimitRetain would keep them across restarts
+  state = apr_atomic_read32(&header->reset_state);
+  if (state == VLIMIT_RESET_CLAIMED || state == VLIMIT_RESET_DONE) {
+    now = apr_time_now();
+    if (state != seen) {
+      seen = state;
+      seen_since = now;
+    } else if (now - seen_since >= apr_time_from_msec(VLIMIT_RESET_STALE) &&
+               apr_atomic_cas32(&header->reset_state, VLIMIT_RESET_FREE, state) == state) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_apply_reset: ", "stale %s mailbox freed.",
+                          state == VLIMIT_RESET_CLAIMED ? "claimed" : "done");
+      seen = VLIMIT_RESET_FREE;
+    }
+    return;
+  }
+  seen = state;
+
+  if (apr_atomic_cas32(&header->reset_state, VLIMIT_RESET_BUSY, VLIMIT_RESET_PENDING) != VLIMIT_RESET_PENDING) {
+    return;
+  }
+
+  if (header->reset_conf >= 0 && header->reset_conf < vlimit_conf_list->nelts) {
+    cfg = APR_ARRAY_IDX(vlimit_conf_list, header->reset_conf, vlimit_config *);
+    limit_stat = cfg->limit_stat;
+  }
+  if (limit_stat != NULL && header->reset_slot >= 0 && header->reset_slot < limit_stat->max_slots) {
+    if (header->reset_table == VLIMIT_RESET_IP && limit_stat->ip_stat_shm != NULL) {
+      result = reset_ip_counter(limit_stat, header->reset_slot);
+    } else if (header->reset_table == VLIMIT_RESET_FILE && limit_stat->file_stat_shm != NULL) {
+      result = reset_file_counter(limit_stat, header->reset_slot);
+    }
+  }
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_apply_reset: ", "conf_id: %d table: %s slot: %d result: %d",
+                      header->reset_conf, header->reset_table == VLIMIT_RESET_IP ? "ip" : "file", header->reset_slot,
+                      result);
+
+  header->reset_result = result;
+  apr_atomic_set32(&header->reset_state, VLIMIT_RESET_DONE);
+}
+
+/* -------------------------------------------- */
+/* --- Stale Count Sweep or ap_hook_monitor --- */
+/* -------------------------------------------- */
+#ifdef __APACHE24__
+static int vlimit_monitor(apr_pool_t *p, server_rec *s)
+#else
+static int vlimit_monitor(apr_pool_t *p)
+#endif
+{
+  static apr_time_t swept = 0;
+  apr_time_t now = apr_time_now();
+
+  vlimit_backend_sync(p);
+  vlimit_load_sample();
+  vlimit_apply_reset();
+
+  if (vlimit_lease_shm == NULL || now - swept < VLIMIT_LEASE_SWEEP_INTERVAL) {
+    return DECLINED;
+  }
+  swept = now;
+  sweep_leases();
+
+  return DECLINED;
+}
+
+/* ---------------------------------------------------------- */
+/* --- VlimitIPScope connection or ap_hook_pre_connection --- */
+/* ---------------------------------------------------------- */
+/* drop the count of the connection, runs in the thread of its master connection */
+static apr_status_t vlimit_conn_cleanup(void *data)
+{
+
+  vlimit_conn_note *cnote = (vlimit_conn_note *)data;
+
+  if (apr_atomic_read32(&cnote->state) != VLIMIT_CONN_COUNTED) {
+    return APR_SUCCESS;
+  }
+
+  if (cnote->lease >= 0) {
+    release_lease(cnote->lease);
+    cnote->lease = -1;
+  }
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_conn_cleanup: ", "connection scope type IP: ip_count--");
+  dec_ip_counter(cnote->srv_cfg->limit_stat, cnote->ip_slot, cnote->ip_gen);
+  cnote->ip_slot = -1;
+  apr_atomic_set32(&cnote->state, VLIMIT_CONN_FREE);
+
+  return APR_SUCCESS;
+}
+
+/* The note and its cleanup are set up here, on the master connection before any request, so that HTTP/2
+ * streams of other threads never touch the pool of the master */
+static int vlimit_pre_connection(conn_rec *c, void *csd)
+{
+
+  vlimit_conn_note *cnote;
+
+  if (!vlimit_ip_scope_conn || vlimit_lease_shm == NULL) {
+    return OK;
+  }
+#ifdef VLIMIT_HAVE_CONN_MASTER
+  if (c->master != NULL) {
     return OK;
   }
+#endif
+
+  cnote = (vlimit_conn_note *)apr_pcalloc(c->pool, sizeof(*cnote));
+  cnote->ip_slot = -1;
+  cnote->lease = -1;
+  ap_set_module_config(c->conn_config, &vlimit_module, cnote);
+  apr_pool_cleanup_register(c->pool, cnote, vlimit_conn_cleanup, apr_pool_cleanup_null);
+
+  return OK;
+}
+
+static int vlimit_response_end(request_rec *r)
+{
 
+  int ip_count = 0;
+  int file_count = 0;
+  vlimit_count *count;
+  vlimit_config *cfg;
   SHM_DATA *limit_stat;
-  limit_stat = shm_base + cfg->conf_id;
 
-  // vlimit_mutex lock
-  VLIMIT_DEBUG_SYSLOG("vlimit_response_end: ", "vlimit_mutex locked.", r->pool);
-  if (apr_global_mutex_lock(vlimit_mutex) != APR_SUCCESS) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_response_end: ", "vlimit_mutex lock failed.", r->pool);
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_response_end: ", "start");
+
+  vlimit_request_note *note = (vlimit_request_note *)ap_get_module_config(r->request_config, &vlimit_module);
+
+  // VlimitIPScope connection: the connection keeps its count, only the request leaves it
+  if (note != NULL && note->conn != NULL) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_response_end: ", "connection scope: active--");
+    apr_atomic_dec32(&note->conn->active);
+    note->conn = NULL;
+  }
+
+  if (note != NULL && note->srv_ip_slot >= 0) {
+    if (note->srv_lease >= 0) {
+      release_lease(note->srv_lease);
+      note->srv_lease = -1;
+    }
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_response_end: ", "server scope type IP: ip_count--");
+    ip_count = dec_ip_counter(note->srv_cfg->limit_stat, note->srv_ip_slot, note->srv_ip_gen);
+    note->srv_ip_slot = -1;
+    vlimit_logging("RESULT: END DEC", r, note->srv_cfg, ip_count, 0);
+  }
+
+  if (note == NULL || note->counts == NULL) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_response_end: ", "no counter incremented. return OK.");
     return OK;
   }
 
-  if (cfg->file_limit > 0) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_response_end: ", "type FILE: file_count--", r->pool);
-    if (get_file_counter(limit_stat, r) > 0) {
-      counter_stat = dec_file_counter(limit_stat, r);
+  // one entry per config of the section chain and VlimitKey checked in fixups
+  for (count = note->counts; count != NULL; count = count->next) {
+    if (count->file_slot < 0 && count->ip_slot < 0) {
+      continue;
     }
-    if (get_file_counter(limit_stat, r) == 0) {
-      unset_file_counter(limit_stat, r);
+
+    cfg = count->cfg;
+    limit_stat = cfg->limit_stat;
+    ip_count = 0;
+    file_count = 0;
+
+    // give up the lease first, a child dying in between leaks a count instead of dropping one twice
+    if (count->lease >= 0) {
+      release_lease(count->lease);
+      count->lease = -1;
     }
-  }
-  if (cfg->ip_limit > 0) {
 
-    VLIMIT_DEBUG_SYSLOG("vlimit_response_end: ", "type IP: ip_count--", r->pool);
-    if (get_ip_counter(limit_stat, r) > 0) {
-      counter_stat = dec_ip_counter(limit_stat, r);
+    if (count->file_slot >= 0) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_response_end: ", "type FILE: file_count--");
+      file_count = dec_file_counter(limit_stat, count->file_slot, count->file_gen);
+      count->file_slot = -1;
     }
-    if (get_ip_counter(limit_stat, r) == 0) {
-      unset_ip_counter(limit_stat, r);
+    if (count->ip_slot >= 0) {
+      VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_response_end: ", "type IP: ip_count--");
+      ip_count = dec_ip_counter(limit_stat, count->ip_slot, count->ip_gen);
+      count->ip_slot = -1;
     }
-  }
 
-  // when decrement counter, write log
-  if (counter_stat != -2) {
-    vlimit_logging("RESULT: END DEC", r, cfg, limit_stat);
-  }
+    // when decrement counter, write log
+    vlimit_logging("RESULT: END DEC", r, cfg, ip_count, file_count);
 
-  // vlimit_mutex unlock
-  VLIMIT_DEBUG_SYSLOG("vlimit_response_end: ", "vlimit_mutex unlocked.", r->pool);
-  if (apr_global_mutex_unlock(vlimit_mutex) != APR_SUCCESS) {
-    VLIMIT_DEBUG_SYSLOG("vlimit_response_end: ", "vlimit_mutex unlock failed.", r->pool);
-    return OK;
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "vlimit_response_end: ",
+                        "conf_id: %d name: %s  uri: %s ip_count: %d/%d file_count: %d/%d", cfg->conf_id,
+                        r->server->server_hostname, r->filename, ip_count, cfg->ip_limit, file_count, cfg->file_limit);
   }
+  note->counts = NULL;
 
-  vlimit_debug_log_buf =
-      apr_psprintf(r->pool, "conf_id: %d name: %s  uri: %s ip_count: %d/%d file_count: %d/%d", cfg->conf_id,
-                   r->server->server_hostname, r->filename, get_ip_counter(limit_stat, r), cfg->ip_limit,
-                   get_file_counter(limit_stat, r), cfg->file_limit);
-  VLIMIT_DEBUG_SYSLOG("vlimit_response_end: ", vlimit_debug_log_buf, r->pool);
-  VLIMIT_DEBUG_SYSLOG("vlimit_response_end: ", "end", r->pool);
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "vlimit_response_end: ", "end");
   return OK;
 }
 
@@ -1129,12 +3863,16 @@ static int vlimit_response_end(request_rec *r)
 /* ---------------------- */
 static void vlimit_register_hooks(apr_pool_t *p)
 {
-  // static const char * const after_me[] = { "mod_cache.c", NULL };
+  ap_hook_pre_config(vlimit_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_post_config(vlimit_init, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_child_init(vlimit_child_init, NULL, NULL, APR_HOOK_MIDDLE);
-  // ap_hook_quick_handler(vlimit_quick_handler, NULL, after_me, APR_HOOK_FIRST);
+  ap_hook_pre_connection(vlimit_pre_connection, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_quick_handler(vlimit_quick_handler, NULL, NULL, APR_HOOK_FIRST);
   ap_hook_fixups(vlimit_handler, NULL, NULL, APR_HOOK_LAST);
+  ap_hook_handler(vlimit_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  APR_OPTIONAL_HOOK(ap, status_hook, vlimit_mod_status_hook, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_log_transaction(vlimit_response_end, NULL, NULL, APR_HOOK_FIRST);
+  ap_hook_monitor(vlimit_monitor, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 /* ------------------------------ */
@@ -1142,7 +3880,7 @@ static void vlimit_register_hooks(apr_pool_t *p)
 /* ------------------------------ */
 module AP_MODULE_DECLARE_DATA vlimit_module = {STANDARD20_MODULE_STUFF,
                                                vlimit_create_dir_config,    /* create per-dir config structures   */
-                                               NULL,                        /* merge  per-dir  config structures  */
+                                               vlimit_merge_dir_config,     /* merge  per-dir  config structures  */
                                                vlimit_create_server_config, /* create per-server config structures  */
                                                NULL,                        /* merge  per-server config structures  */
                                                vlimit_cmds,                 /* table of config file commands    */
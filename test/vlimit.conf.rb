@@ -47,6 +47,41 @@
 #  Target Information  SSL: #{get_config('TargetisSSL').to_s}
 #EOS
 
+# The paths of vlimit.test.rb expect an httpd.conf with these sections, DocumentRoot "/var/www/html":
+#
+#   # server context, RealPath only
+#   VlimitFile 1 /var/www/html/section/limited.html
+#
+#   # a server limit plus a section limit
+#   <Directory "/var/www/html/section">
+#     VlimitIP 10
+#   </Directory>
+#
+#   # a Directory nested inside a Location, the inner one with the lower limit
+#   <Location "/nested/">
+#     VlimitFile 10
+#   </Location>
+#   <Directory "/var/www/html/nested/inner">
+#     VlimitIP 1
+#   </Directory>
+#
+#   # a section that sets nothing keeps the limit of the enclosing one
+#   <Directory "/var/www/html/plain">
+#     VlimitIP 1
+#   </Directory>
+#   <Directory "/var/www/html/plain/sub">
+#     DirectoryIndex index.html
+#   </Directory>
+#
+#   # a server VlimitKey under a section with a limit of its own, mod_setenvif
+#   SetEnvIf Request_URI "^/key/" VLIMIT_KEY=key
+#   VlimitKey tagged "%{reqenv:VLIMIT_KEY}" 1
+#   <Directory "/var/www/html/key">
+#     VlimitIP 10
+#   </Directory>
+#
+# with an index.html in each directory and /section/limited.html, /section/other.html.
+
 # defined ab config pattern
 add_config(
   "TotalRequests"         => 2,                         # int
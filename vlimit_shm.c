@@ -0,0 +1,994 @@
+/*
+// -------------------------------------------------------------------
+// vlimit_shm
+//   Slot tables of mod_vlimit on shared memory, see vlimit_shm.h
+// -------------------------------------------------------------------
+*/
+
+#include "vlimit_shm.h"
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef VLIMIT_HAVE_WAIT
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <apr_strings.h>
+#include <apr_time.h>
+
+int vlimit_debug_level = VLIMIT_DEBUG_TRACE;
+int vlimit_atomic = 0;
+int vlimit_overflow_evict = 0;
+int vlimit_wait_ms = 0;
+int vlimit_wait_max = 0;
+apr_global_mutex_t **vlimit_mutex = NULL;
+int vlimit_mutex_stripes = 1;
+
+/* ------------------------------- */
+/* --- Flag File Cache Routine --- */
+/* ------------------------------- */
+static volatile apr_uint32_t vlimit_flags = 0;
+static volatile apr_uint32_t vlimit_flags_checked = 0;
+
+apr_uint32_t vlimit_flag_state(void)
+{
+  apr_uint32_t flags = 0;
+  apr_uint32_t now = (apr_uint32_t)apr_time_sec(apr_time_now());
+  apr_uint32_t checked = apr_atomic_read32(&vlimit_flags_checked);
+
+  // one thread refreshes, the others keep using the previous state
+  if (now == checked || apr_atomic_cas32(&vlimit_flags_checked, now, checked) != checked) {
+    return apr_atomic_read32(&vlimit_flags);
+  }
+
+  if (access(VLIMIT_DEBUG_FLAG_FILE, F_OK) == 0) {
+    flags |= VLIMIT_FLAG_DEBUG;
+  }
+  if (access(VLIMIT_LOG_FLAG_FILE, F_OK) == 0) {
+    flags |= VLIMIT_FLAG_LOG;
+  }
+
+  apr_atomic_set32(&vlimit_flags, flags);
+
+  return flags;
+}
+
+/* --------------------------------------- */
+/* --- Debug in SYSLOG Logging Routine --- */
+/* --------------------------------------- */
+static volatile apr_uint32_t vlimit_syslog_opened = 0;
+
+void vlimit_debug_syslog(const char *key, const char *fmt, ...)
+{
+  char vlimit_buf[VLIMIT_DEBUG_MAX_LINE];
+  va_list args;
+
+  // the syslog connection stays open for the life of the process
+  if (apr_atomic_cas32(&vlimit_syslog_opened, 1, 0) == 0) {
+    openlog(NULL, LOG_PID, LOG_SYSLOG);
+  }
+
+  va_start(args, fmt);
+  apr_vsnprintf(vlimit_buf, sizeof(vlimit_buf), fmt, args);
+  va_end(args);
+
+  syslog(LOG_SYSLOG | LOG_DEBUG, MODULE_NAME ": %s%s", key, vlimit_buf);
+}
+
+/* ------------------------------- */
+/* --- Slot Hash Index Routine --- */
+/* ------------------------------- */
+/* FNV-1a, 64 bit for file keys which are compared by hash alone */
+apr_uint64_t vlimit_hash_string64(const char *key)
+{
+  apr_uint64_t hash = 14695981039346656037ULL;
+
+  while (*key != '\0') {
+    hash ^= (unsigned char)*key++;
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+/* FNV-1a, the hash is stored in the slot to skip the key compare on mismatch */
+apr_uint32_t vlimit_hash_bytes(const void *key, apr_size_t len)
+{
+  apr_uint32_t hash = 2166136261U;
+  const unsigned char *p = (const unsigned char *)key;
+
+  while (len-- > 0) {
+    hash ^= *p++;
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+/* round up to a power of 2 for the hash index mask */
+int vlimit_slot_size(int slots)
+{
+  int size = 1;
+
+  while (size < slots) {
+    size <<= 1;
+  }
+
+  return size;
+}
+
+/* ------------------------------- */
+/* --- Rate Limiting Routine --- */
+/* ------------------------------- */
+/* milliseconds of a clock shared by all processes, wraps every 49 days */
+apr_uint32_t vlimit_rate_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    return (apr_uint32_t)ts.tv_sec * 1000U + (apr_uint32_t)(ts.tv_nsec / 1000000);
+  }
+#endif
+
+  return (apr_uint32_t)apr_time_as_msec(apr_time_now());
+}
+
+/* GCRA on a slot pinned by our count, returns 0 when allowed or the ms until the next request is */
+apr_uint32_t vlimit_rate_check(volatile apr_uint32_t *tat, apr_uint32_t emission, apr_uint32_t interval)
+{
+  apr_uint32_t now = vlimit_rate_now();
+  apr_uint32_t old;
+  apr_uint32_t next;
+
+  do {
+    old = apr_atomic_read32(tat);
+    next = (VLIMIT_RATE_PENDING(old, now, interval) ? old : now) + emission;
+    if (next - now > interval) {
+      // rejected requests do not use up the allowance
+      return next - now - interval;
+    }
+  } while (apr_atomic_cas32(tat, next, old) != old);
+
+  return 0;
+}
+
+/* ------------------------------ */
+/* --- Lock Striping Routine --- */
+/* ------------------------------ */
+static apr_global_mutex_t *vlimit_stripe_mutex(int stripe)
+{
+  return vlimit_mutex[stripe & (vlimit_mutex_stripes - 1)];
+}
+
+/* bucket of value when each bound is (1 << shift) times the previous, starting at 1 */
+static int vlimit_stat_bucket(apr_uint32_t value, int shift, int buckets)
+{
+  apr_uint32_t bound = 1;
+  int i = 0;
+
+  while (i < buckets - 1 && value > bound) {
+    bound <<= shift;
+    i++;
+  }
+
+  return i;
+}
+
+/* apr_global_mutex_lock with the wait recorded in the counter shard of slot id */
+static apr_status_t vlimit_stripe_lock(SHM_DATA *limit_stat, apr_global_mutex_t *mutex, int id)
+{
+
+  conf_stat_shard *shard = VLIMIT_STAT_SHARD(limit_stat, id);
+  apr_time_t start = apr_time_now();
+  apr_status_t status = apr_global_mutex_lock(mutex);
+  apr_uint32_t wait = (apr_uint32_t)(apr_time_now() - start);
+
+  if (status != APR_SUCCESS) {
+    apr_atomic_inc32(&limit_stat->stat_shm->lock_failures);
+    return status;
+  }
+
+  apr_atomic_inc32(&shard->lock_wait[vlimit_stat_bucket(wait, 2, VLIMIT_LOCK_WAIT_BUCKETS)]);
+  apr_atomic_add32(&shard->lock_wait_sum, wait);
+
+  return status;
+}
+
+static void vlimit_stat_probe(SHM_DATA *limit_stat, int id, int probes)
+{
+  conf_stat_shard *shard = VLIMIT_STAT_SHARD(limit_stat, id);
+
+  apr_atomic_inc32(&shard->probe[vlimit_stat_bucket(probes, 1, VLIMIT_PROBE_BUCKETS)]);
+  apr_atomic_add32(&shard->probe_sum, probes);
+}
+
+void vlimit_stat_sum(const conf_stat *stat, conf_stat_shard *sum)
+{
+
+  const conf_stat_shard *shard;
+  int t;
+  int i;
+
+  memset(sum, 0, sizeof(*sum));
+  for (t = 0; t < VLIMIT_STAT_SHARDS; t++) {
+    shard = &stat->shard[t];
+    sum->accepted += shard->accepted;
+    for (i = 0; i < VLIMIT_LOCK_WAIT_BUCKETS; i++) {
+      sum->lock_wait[i] += shard->lock_wait[i];
+    }
+    sum->lock_wait_sum += shard->lock_wait_sum;
+    for (i = 0; i < VLIMIT_PROBE_BUCKETS; i++) {
+      sum->probe[i] += shard->probe[i];
+    }
+    sum->probe_sum += shard->probe_sum;
+  }
+}
+
+/* counts of the key owning the slot, those inherited from evicted keys left out; count includes ours */
+static int vlimit_own_count(volatile apr_uint32_t *inherited, apr_uint32_t count)
+{
+  apr_uint32_t other = apr_atomic_read32(inherited);
+
+  return count > other ? (int)(count - other) : 1;
+}
+
+/* a request counted before its slot was evicted gives its count back from inherited too */
+static void vlimit_drop_inherited(volatile apr_uint32_t *inherited)
+{
+  apr_uint32_t old;
+
+  do {
+    old = apr_atomic_read32(inherited);
+    if (old == 0) {
+      return;
+    }
+  } while (apr_atomic_cas32(inherited, old - 1, old) != old);
+}
+
+/* -------------------------------- */
+/* --- Admission Wait Routine --- */
+/* -------------------------------- */
+/* wake whoever waits on the slot, a read of the line the drop just wrote when nobody does */
+static void vlimit_slot_notify(volatile apr_uint32_t *waiters, volatile apr_uint32_t *wake)
+{
+#ifdef VLIMIT_HAVE_WAIT
+  if (apr_atomic_read32(waiters) > 0) {
+    apr_atomic_inc32(wake);
+    syscall(SYS_futex, wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+#endif
+}
+
+/* the waiters hold their counts, so one is let in when the key minus the other waiters fits in limit;
+ * sleeps on the futex word of the slot between drops, never polls */
+static int vlimit_slot_wait(volatile apr_uint32_t *counter, volatile apr_uint32_t *inherited,
+                            volatile apr_uint32_t *remote, volatile apr_uint32_t *waiters, volatile apr_uint32_t *wake,
+                            volatile apr_uint32_t *slot_gen, apr_uint32_t gen, int limit)
+{
+#ifdef VLIMIT_HAVE_WAIT
+  struct timespec timeout;
+  apr_uint32_t deadline;
+  apr_uint32_t left;
+  apr_uint32_t seen;
+  apr_uint32_t w;
+  int count;
+
+  do {
+    w = apr_atomic_read32(waiters);
+    if (w >= (apr_uint32_t)vlimit_wait_max) {
+      return -1;
+    }
+  } while (apr_atomic_cas32(waiters, w + 1, w) != w);
+
+  deadline = vlimit_rate_now() + (apr_uint32_t)vlimit_wait_ms;
+  for (;;) {
+    // read before the counts, a drop after them changes it and the futex wait returns at once
+    seen = apr_atomic_read32(wake);
+    if (apr_atomic_read32(slot_gen) != gen) {
+      // evicted while waiting, the slot counts another key now
+      break;
+    }
+    w = apr_atomic_read32(waiters);
+    count = vlimit_own_count(inherited, apr_atomic_read32(counter)) + (int)apr_atomic_read32(remote) - (int)w + 1;
+    if (count <= limit) {
+      if (apr_atomic_cas32(waiters, w - 1, w) == w) {
+        return count;
+      }
+      continue;
+    }
+
+    left = deadline - vlimit_rate_now();
+    if ((apr_int32_t)left <= 0) {
+      break;
+    }
+    timeout.tv_sec = left / 1000;
+    timeout.tv_nsec = (long)(left % 1000) * 1000000L;
+    syscall(SYS_futex, wake, FUTEX_WAIT, seen, &timeout, NULL, 0);
+  }
+
+  apr_atomic_dec32(waiters);
+  return -2;
+#else
+  return -1;
+#endif
+}
+
+/* -------------- */
+/* file stat data */
+/* -------------- */
+/* probe the partition of the home slot until the key or an empty slot is found */
+static int get_file_slot_id_by_key(SHM_DATA *limit_stat, apr_uint64_t key)
+{
+
+  int i;
+  int id = VLIMIT_SLOT_HOME(limit_stat, VLIMIT_FILE_KEY_HASH(key));
+  file_stat *slot;
+
+  for (i = 0; i < limit_stat->part_slots; i++, id = VLIMIT_SLOT_NEXT(limit_stat, id)) {
+    slot = &limit_stat->file_stat_shm[id];
+    if (slot->state == VLIMIT_SLOT_EMPTY) {
+      break;
+    }
+    if (slot->state == VLIMIT_SLOT_USED && slot->key == key) {
+      vlimit_stat_probe(limit_stat, id, i + 1);
+      return id;
+    }
+  }
+
+  vlimit_stat_probe(limit_stat, id, i < limit_stat->part_slots ? i + 1 : i);
+  return -1;
+}
+
+/* first reusable (deleted or empty) slot in the probe sequence of key */
+static int get_file_empty_slot_id_by_key(SHM_DATA *limit_stat, apr_uint64_t key)
+{
+
+  int i;
+  int id = VLIMIT_SLOT_HOME(limit_stat, VLIMIT_FILE_KEY_HASH(key));
+
+  apr_uint32_t now = vlimit_rate_now();
+  file_stat *slot;
+
+  for (i = 0; i < limit_stat->part_slots; i++, id = VLIMIT_SLOT_NEXT(limit_stat, id)) {
+    slot = &limit_stat->file_stat_shm[id];
+    if (slot->state != VLIMIT_SLOT_USED) {
+      return id;
+    }
+    // kept for its rate state only, reusable once that has expired
+    if (apr_atomic_read32(&slot->counter) == 0 &&
+        !VLIMIT_RATE_PENDING(slot->tat, now, limit_stat->file_rate_interval)) {
+      return id;
+    }
+  }
+
+  // slot full
+  return -1;
+}
+/* VlimitOverflow evict: the slot of the partition with the fewest counted requests, as in Space-Saving */
+static int get_file_evict_slot_id(SHM_DATA *limit_stat, apr_uint32_t hash)
+{
+
+  int i;
+  int id = VLIMIT_SLOT_HOME(limit_stat, hash);
+  int evict = id;
+  apr_uint32_t min = UINT_MAX;
+  apr_uint32_t count;
+
+  for (i = 0; i < limit_stat->part_slots; i++, id = VLIMIT_SLOT_NEXT(limit_stat, id)) {
+    count = apr_atomic_read32(&limit_stat->file_stat_shm[id].counter);
+    if (count < min) {
+      min = count;
+      evict = id;
+    }
+  }
+
+  return evict;
+}
+
+
+/* keep the end of long paths, it is the part that tells files apart */
+static void set_file_name(SHM_DATA *limit_stat, int id, const char *filename)
+{
+  apr_size_t len = strlen(filename);
+
+  if (len >= VLIMIT_FILE_NAME_LEN) {
+    filename += len - (VLIMIT_FILE_NAME_LEN - 1);
+  }
+  apr_cpystrn(limit_stat->file_name_shm[id].filename, filename, VLIMIT_FILE_NAME_LEN);
+}
+
+static apr_global_mutex_t *get_file_mutex(SHM_DATA *limit_stat, int id)
+{
+  return vlimit_stripe_mutex(limit_stat->file_lock + VLIMIT_SLOT_PART(limit_stat, id));
+}
+
+/* leave a tombstone, or empty slots when the probe chain ends right after them */
+static void release_file_slot(SHM_DATA *limit_stat, int id)
+{
+  limit_stat->file_stat_shm[id].key = 0;
+  limit_stat->file_stat_shm[id].inherited = 0;
+  limit_stat->file_name_shm[id].filename[0] = '\0';
+  limit_stat->file_stat_shm[id].state = VLIMIT_SLOT_DELETED;
+
+  if (limit_stat->file_stat_shm[VLIMIT_SLOT_NEXT(limit_stat, id)].state != VLIMIT_SLOT_EMPTY) {
+    return;
+  }
+
+  while (limit_stat->file_stat_shm[id].state == VLIMIT_SLOT_DELETED) {
+    limit_stat->file_stat_shm[id].state = VLIMIT_SLOT_EMPTY;
+    id = VLIMIT_SLOT_PREV(limit_stat, id);
+  }
+}
+
+/* must be called with the mutex of the slot held, returns the new counter */
+static int dec_file_slot(SHM_DATA *limit_stat, int id)
+{
+  volatile apr_uint32_t *counter = &limit_stat->file_stat_shm[id].counter;
+
+  // with a rate limit the slot stays claimed until its allowance has refilled
+  if (apr_atomic_read32(counter) > 0 && apr_atomic_dec32(counter) == 0 &&
+      !VLIMIT_RATE_PENDING(limit_stat->file_stat_shm[id].tat, vlimit_rate_now(), limit_stat->file_rate_interval)) {
+    release_file_slot(limit_stat, id);
+  }
+
+  return (int)apr_atomic_read32(counter);
+}
+
+/* the last count is dropped under the mutex so the slot can be released with it */
+static int dec_file_slot_atomic(SHM_DATA *limit_stat, int id)
+{
+  apr_uint32_t old;
+  volatile apr_uint32_t *counter = &limit_stat->file_stat_shm[id].counter;
+
+  do {
+    old = apr_atomic_read32(counter);
+    if (old <= 1) {
+      return -2;
+    }
+  } while (apr_atomic_cas32(counter, old - 1, old) != old);
+
+  return (int)old - 1;
+}
+
+/* returns the new counter and its slot in *slot_id, -1 when the partition is full and -3 when the lock failed */
+int inc_file_counter(SHM_DATA *limit_stat, apr_uint64_t key, const char *filename, int *slot_id, apr_uint32_t *gen)
+{
+
+  int id;
+  int count = -1;
+  file_stat *slot;
+  int home = VLIMIT_SLOT_HOME(limit_stat, VLIMIT_FILE_KEY_HASH(key));
+  apr_global_mutex_t *mutex = get_file_mutex(limit_stat, home);
+
+  // vlimit_mutex lock
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "inc_file_counter: ", "vlimit_mutex locked.");
+  if (vlimit_stripe_lock(limit_stat, mutex, home) != APR_SUCCESS) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "inc_file_counter: ", "vlimit_mutex lock failed.");
+    return -3;
+  }
+
+  id = get_file_slot_id_by_key(limit_stat, key);
+
+  if (id == -1) {
+    id = get_file_empty_slot_id_by_key(limit_stat, key);
+    if (id != -1) {
+      /* counter of a free slot is 0, so lock-free readers skip it until the claim is done */
+      limit_stat->file_stat_shm[id].key = key;
+      limit_stat->file_stat_shm[id].tat = vlimit_rate_now();
+      limit_stat->file_stat_shm[id].inherited = 0;
+      limit_stat->file_stat_shm[id].remote = 0;
+      limit_stat->file_stat_shm[id].published = 0;
+      set_file_name(limit_stat, id, filename);
+      limit_stat->file_stat_shm[id].state = VLIMIT_SLOT_USED;
+    }
+  }
+
+  if (id == -1 && vlimit_overflow_evict) {
+    id = get_file_evict_slot_id(limit_stat, VLIMIT_FILE_KEY_HASH(key));
+    slot = &limit_stat->file_stat_shm[id];
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "inc_file_counter: ", "partition full, slot %d (%s, counter %u) evicted.",
+                        id, limit_stat->file_name_shm[id].filename, apr_atomic_read32(&slot->counter));
+    /* lock-free readers see a deleted slot while the key changes, requests of the old key end as inherited */
+    slot->state = VLIMIT_SLOT_DELETED;
+    slot->key = key;
+    slot->tat = vlimit_rate_now();
+    set_file_name(limit_stat, id, filename);
+    apr_atomic_set32(&slot->inherited, apr_atomic_read32(&slot->counter));
+    apr_atomic_set32(&slot->remote, 0);
+    slot->published = 0;
+    apr_atomic_inc32(&slot->gen);
+    slot->state = VLIMIT_SLOT_USED;
+    apr_atomic_inc32(&limit_stat->stat_shm->evictions);
+    vlimit_slot_notify(&slot->waiters, &slot->wake);
+  }
+
+  if (id >= 0) {
+    slot = &limit_stat->file_stat_shm[id];
+    count = vlimit_own_count(&slot->inherited, apr_atomic_inc32(&slot->counter) + 1);
+    *gen = slot->gen;
+    *slot_id = id;
+  }
+
+  // vlimit_mutex unlock
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "inc_file_counter: ", "vlimit_mutex unlocked.");
+  if (apr_global_mutex_unlock(mutex) != APR_SUCCESS) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "inc_file_counter: ", "vlimit_mutex unlock failed.");
+  }
+
+  return count;
+}
+
+/* lock-free increment of a slot already claimed, -2 means retry with inc_file_counter */
+int inc_file_counter_atomic(SHM_DATA *limit_stat, apr_uint64_t key, int *slot_id, apr_uint32_t *gen)
+{
+
+  int id;
+  apr_uint32_t old;
+  file_stat *slot;
+  apr_global_mutex_t *mutex;
+
+  id = get_file_slot_id_by_key(limit_stat, key);
+
+  if (id == -1) {
+    return -2;
+  }
+
+  slot = &limit_stat->file_stat_shm[id];
+  do {
+    old = apr_atomic_read32(&slot->counter);
+    /* a slot with counter 0 may be released under its mutex at any time */
+    if (old == 0) {
+      return -2;
+    }
+  } while (apr_atomic_cas32(&slot->counter, old + 1, old) != old);
+
+  /* our count pins the slot, check it was not reused (or evicted) for another key before the cas */
+  *gen = slot->gen;
+  if (slot->state != VLIMIT_SLOT_USED || slot->key != key) {
+    mutex = get_file_mutex(limit_stat, id);
+    if (dec_file_slot_atomic(limit_stat, id) == -2 && vlimit_stripe_lock(limit_stat, mutex, id) == APR_SUCCESS) {
+      dec_file_slot(limit_stat, id);
+      apr_global_mutex_unlock(mutex);
+    }
+    return -2;
+  }
+
+  *slot_id = id;
+
+  return vlimit_own_count(&slot->inherited, old + 1);
+}
+
+/* drop the count taken by inc_file_counter, our count keeps slot_id claimed until then */
+int dec_file_counter(SHM_DATA *limit_stat, int slot_id, apr_uint32_t gen)
+{
+
+  int count;
+  apr_global_mutex_t *mutex;
+
+  if (limit_stat->file_stat_shm[slot_id].gen != gen) {
+    vlimit_drop_inherited(&limit_stat->file_stat_shm[slot_id].inherited);
+  }
+
+  count = vlimit_atomic ? dec_file_slot_atomic(limit_stat, slot_id) : -2;
+  if (count != -2) {
+    vlimit_slot_notify(&limit_stat->file_stat_shm[slot_id].waiters, &limit_stat->file_stat_shm[slot_id].wake);
+    return count;
+  }
+
+  // the last count of a slot (or VlimitAtomic Off) is dropped under the mutex of its stripe
+  mutex = get_file_mutex(limit_stat, slot_id);
+
+  // vlimit_mutex lock
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "dec_file_counter: ", "vlimit_mutex locked.");
+  if (vlimit_stripe_lock(limit_stat, mutex, slot_id) != APR_SUCCESS) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "dec_file_counter: ", "vlimit_mutex lock failed.");
+    return -3;
+  }
+
+  count = dec_file_slot(limit_stat, slot_id);
+
+  // vlimit_mutex unlock
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "dec_file_counter: ", "vlimit_mutex unlocked.");
+  if (apr_global_mutex_unlock(mutex) != APR_SUCCESS) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "dec_file_counter: ", "vlimit_mutex unlock failed.");
+  }
+  vlimit_slot_notify(&limit_stat->file_stat_shm[slot_id].waiters, &limit_stat->file_stat_shm[slot_id].wake);
+
+  return count;
+}
+
+/* vlimitctl reset, applied by the httpd parent: like an eviction the requests still running give their
+ * counts back through inherited, the key starts again from 0 at once */
+int reset_file_counter(SHM_DATA *limit_stat, int slot_id)
+{
+  file_stat *slot = &limit_stat->file_stat_shm[slot_id];
+  apr_global_mutex_t *mutex = get_file_mutex(limit_stat, slot_id);
+  apr_uint32_t count;
+
+  // claims, releases and evictions of the slot happen under the same mutex
+  if (vlimit_stripe_lock(limit_stat, mutex, slot_id) != APR_SUCCESS) {
+    return -3;
+  }
+  if (slot->state != VLIMIT_SLOT_USED) {
+    apr_global_mutex_unlock(mutex);
+    return -1;
+  }
+
+  apr_atomic_inc32(&slot->gen);
+  count = apr_atomic_read32(&slot->counter);
+  apr_atomic_set32(&slot->inherited, count);
+  apr_atomic_set32(&slot->remote, 0);
+  apr_global_mutex_unlock(mutex);
+  vlimit_slot_notify(&slot->waiters, &slot->wake);
+
+  return (int)count;
+}
+
+/* VlimitWait on the slot taken by inc_file_counter, the count is kept whatever the outcome */
+int wait_file_counter(SHM_DATA *limit_stat, int slot_id, apr_uint32_t gen, int limit)
+{
+  file_stat *slot = &limit_stat->file_stat_shm[slot_id];
+
+  return vlimit_slot_wait(&slot->counter, &slot->inherited, &slot->remote, &slot->waiters, &slot->wake, &slot->gen, gen,
+                          limit);
+}
+
+/* ------------ */
+/* ip stat data */
+/* ------------ */
+/* probe the partition of the home slot until the key or an empty slot is found */
+static int get_ip_slot_id_by_key(SHM_DATA *limit_stat, const ip_key *key, apr_uint32_t hash)
+{
+
+  int i;
+  int id = VLIMIT_SLOT_HOME(limit_stat, hash);
+  ip_stat *slot;
+
+  for (i = 0; i < limit_stat->part_slots; i++, id = VLIMIT_SLOT_NEXT(limit_stat, id)) {
+    slot = &limit_stat->ip_stat_shm[id];
+    if (slot->state == VLIMIT_SLOT_EMPTY) {
+      break;
+    }
+    if (slot->state == VLIMIT_SLOT_USED && slot->hash == hash && VLIMIT_IP_KEY_EQUAL(&slot->address, key)) {
+      vlimit_stat_probe(limit_stat, id, i + 1);
+      return id;
+    }
+  }
+
+  vlimit_stat_probe(limit_stat, id, i < limit_stat->part_slots ? i + 1 : i);
+  return -1;
+}
+
+/* first reusable (deleted or empty) slot in the probe sequence of hash */
+static int get_ip_empty_slot_id_by_hash(SHM_DATA *limit_stat, apr_uint32_t hash)
+{
+
+  int i;
+  int id = VLIMIT_SLOT_HOME(limit_stat, hash);
+
+  apr_uint32_t now = vlimit_rate_now();
+  ip_stat *slot;
+
+  for (i = 0; i < limit_stat->part_slots; i++, id = VLIMIT_SLOT_NEXT(limit_stat, id)) {
+    slot = &limit_stat->ip_stat_shm[id];
+    if (slot->state != VLIMIT_SLOT_USED) {
+      return id;
+    }
+    // kept for its rate state only, reusable once that has expired
+    if (apr_atomic_read32(&slot->counter) == 0 &&
+        !VLIMIT_RATE_PENDING(slot->tat, now, limit_stat->ip_rate_interval)) {
+      return id;
+    }
+  }
+
+  // slot full
+  return -1;
+}
+/* VlimitOverflow evict: the slot of the partition with the fewest counted requests, as in Space-Saving */
+static int get_ip_evict_slot_id(SHM_DATA *limit_stat, apr_uint32_t hash)
+{
+
+  int i;
+  int id = VLIMIT_SLOT_HOME(limit_stat, hash);
+  int evict = id;
+  apr_uint32_t min = UINT_MAX;
+  apr_uint32_t count;
+
+  for (i = 0; i < limit_stat->part_slots; i++, id = VLIMIT_SLOT_NEXT(limit_stat, id)) {
+    count = apr_atomic_read32(&limit_stat->ip_stat_shm[id].counter);
+    if (count < min) {
+      min = count;
+      evict = id;
+    }
+  }
+
+  return evict;
+}
+
+
+/* client address masked by VlimitIPPrefix, returns the slot hash of the key */
+apr_uint32_t vlimit_ip_key(SHM_DATA *limit_stat, const apr_sockaddr_t *addr, ip_key *key)
+{
+
+  int i;
+  const ip_key *mask;
+
+#if APR_HAVE_IPV6
+  if (addr->family == APR_INET6) {
+    memcpy(key->word, &addr->sa.sin6.sin6_addr, sizeof(key->word));
+  } else
+#endif
+  {
+    key->word[0] = 0;
+    key->word[1] = 0;
+    key->word[2] = htonl(0xffff);
+    memcpy(&key->word[3], &addr->sa.sin.sin_addr, sizeof(key->word[3]));
+  }
+
+  // v4-mapped addresses of a dual-stack listener count as IPv4
+  mask = VLIMIT_IP_KEY_IS_V4(key) ? &limit_stat->ip_mask4 : &limit_stat->ip_mask6;
+  for (i = 0; i < 4; i++) {
+    key->word[i] &= mask->word[i];
+  }
+
+  return vlimit_hash_bytes(key->word, sizeof(key->word));
+}
+
+static const char *vlimit_ip_key_format(const ip_key *key, char *buf, apr_size_t len)
+{
+  if (VLIMIT_IP_KEY_IS_V4(key)) {
+    return inet_ntop(AF_INET, &key->word[3], buf, len) ? buf : "-";
+  }
+
+  return inet_ntop(AF_INET6, key->word, buf, len) ? buf : "-";
+}
+
+const char *get_ip_key_string(const ip_key *key, apr_pool_t *p)
+{
+  char buf[INET6_ADDRSTRLEN];
+
+  return apr_pstrdup(p, vlimit_ip_key_format(key, buf, sizeof(buf)));
+}
+
+static apr_global_mutex_t *get_ip_mutex(SHM_DATA *limit_stat, int id)
+{
+  return vlimit_stripe_mutex(limit_stat->ip_lock + VLIMIT_SLOT_PART(limit_stat, id));
+}
+
+/* leave a tombstone, or empty slots when the probe chain ends right after them */
+static void release_ip_slot(SHM_DATA *limit_stat, int id)
+{
+  memset(&limit_stat->ip_stat_shm[id].address, 0, sizeof(ip_key));
+  limit_stat->ip_stat_shm[id].inherited = 0;
+  limit_stat->ip_stat_shm[id].state = VLIMIT_SLOT_DELETED;
+
+  if (limit_stat->ip_stat_shm[VLIMIT_SLOT_NEXT(limit_stat, id)].state != VLIMIT_SLOT_EMPTY) {
+    return;
+  }
+
+  while (limit_stat->ip_stat_shm[id].state == VLIMIT_SLOT_DELETED) {
+    limit_stat->ip_stat_shm[id].state = VLIMIT_SLOT_EMPTY;
+    id = VLIMIT_SLOT_PREV(limit_stat, id);
+  }
+}
+
+/* must be called with the mutex of the slot held, returns the new counter */
+static int dec_ip_slot(SHM_DATA *limit_stat, int id)
+{
+  volatile apr_uint32_t *counter = &limit_stat->ip_stat_shm[id].counter;
+
+  // with a rate limit the slot stays claimed until its allowance has refilled
+  if (apr_atomic_read32(counter) > 0 && apr_atomic_dec32(counter) == 0 &&
+      !VLIMIT_RATE_PENDING(limit_stat->ip_stat_shm[id].tat, vlimit_rate_now(), limit_stat->ip_rate_interval)) {
+    release_ip_slot(limit_stat, id);
+  }
+
+  return (int)apr_atomic_read32(counter);
+}
+
+/* the last count is dropped under the mutex so the slot can be released with it */
+static int dec_ip_slot_atomic(SHM_DATA *limit_stat, int id)
+{
+  apr_uint32_t old;
+  volatile apr_uint32_t *counter = &limit_stat->ip_stat_shm[id].counter;
+
+  do {
+    old = apr_atomic_read32(counter);
+    if (old <= 1) {
+      return -2;
+    }
+  } while (apr_atomic_cas32(counter, old - 1, old) != old);
+
+  return (int)old - 1;
+}
+
+/* returns the new counter and its slot in *slot_id, -1 when the partition is full and -3 when the lock failed */
+int inc_ip_counter(SHM_DATA *limit_stat, const ip_key *key, apr_uint32_t hash, int *slot_id, apr_uint32_t *gen)
+{
+
+  int id;
+  int count = -1;
+  ip_stat *slot;
+  char addr[INET6_ADDRSTRLEN];
+  int home = VLIMIT_SLOT_HOME(limit_stat, hash);
+  apr_global_mutex_t *mutex = get_ip_mutex(limit_stat, home);
+
+  // vlimit_mutex lock
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "inc_ip_counter: ", "vlimit_mutex locked.");
+  if (vlimit_stripe_lock(limit_stat, mutex, home) != APR_SUCCESS) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "inc_ip_counter: ", "vlimit_mutex lock failed.");
+    return -3;
+  }
+
+  id = get_ip_slot_id_by_key(limit_stat, key, hash);
+
+  if (id == -1) {
+    id = get_ip_empty_slot_id_by_hash(limit_stat, hash);
+    if (id != -1) {
+      /* counter of a free slot is 0, so lock-free readers skip it until the claim is done */
+      limit_stat->ip_stat_shm[id].address = *key;
+      limit_stat->ip_stat_shm[id].tat = vlimit_rate_now();
+      limit_stat->ip_stat_shm[id].hash = hash;
+      limit_stat->ip_stat_shm[id].inherited = 0;
+      limit_stat->ip_stat_shm[id].remote = 0;
+      limit_stat->ip_stat_shm[id].published = 0;
+      limit_stat->ip_stat_shm[id].state = VLIMIT_SLOT_USED;
+    }
+  }
+
+  if (id == -1 && vlimit_overflow_evict) {
+    id = get_ip_evict_slot_id(limit_stat, hash);
+    slot = &limit_stat->ip_stat_shm[id];
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "inc_ip_counter: ", "partition full, slot %d (%s, counter %u) evicted.", id,
+                        vlimit_ip_key_format(&slot->address, addr, sizeof(addr)), apr_atomic_read32(&slot->counter));
+    /* lock-free readers see a deleted slot while the key changes, requests of the old key end as inherited */
+    slot->state = VLIMIT_SLOT_DELETED;
+    slot->address = *key;
+    slot->hash = hash;
+    slot->tat = vlimit_rate_now();
+    apr_atomic_set32(&slot->inherited, apr_atomic_read32(&slot->counter));
+    apr_atomic_set32(&slot->remote, 0);
+    slot->published = 0;
+    apr_atomic_inc32(&slot->gen);
+    slot->state = VLIMIT_SLOT_USED;
+    apr_atomic_inc32(&limit_stat->stat_shm->evictions);
+    vlimit_slot_notify(&slot->waiters, &slot->wake);
+  }
+
+  if (id >= 0) {
+    slot = &limit_stat->ip_stat_shm[id];
+    count = vlimit_own_count(&slot->inherited, apr_atomic_inc32(&slot->counter) + 1);
+    *gen = slot->gen;
+    *slot_id = id;
+  }
+
+  // vlimit_mutex unlock
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "inc_ip_counter: ", "vlimit_mutex unlocked.");
+  if (apr_global_mutex_unlock(mutex) != APR_SUCCESS) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "inc_ip_counter: ", "vlimit_mutex unlock failed.");
+  }
+
+  return count;
+}
+
+/* lock-free increment of a slot already claimed, -2 means retry with inc_ip_counter */
+int inc_ip_counter_atomic(SHM_DATA *limit_stat, const ip_key *key, apr_uint32_t hash, int *slot_id, apr_uint32_t *gen)
+{
+
+  int id;
+  apr_uint32_t old;
+  ip_stat *slot;
+  apr_global_mutex_t *mutex;
+
+  id = get_ip_slot_id_by_key(limit_stat, key, hash);
+
+  if (id == -1) {
+    return -2;
+  }
+
+  slot = &limit_stat->ip_stat_shm[id];
+  do {
+    old = apr_atomic_read32(&slot->counter);
+    /* a slot with counter 0 may be released under its mutex at any time */
+    if (old == 0) {
+      return -2;
+    }
+  } while (apr_atomic_cas32(&slot->counter, old + 1, old) != old);
+
+  /* our count pins the slot, check it was not reused (or evicted) for another key before the cas */
+  *gen = slot->gen;
+  if (slot->state != VLIMIT_SLOT_USED || slot->hash != hash || !VLIMIT_IP_KEY_EQUAL(&slot->address, key)) {
+    mutex = get_ip_mutex(limit_stat, id);
+    if (dec_ip_slot_atomic(limit_stat, id) == -2 && vlimit_stripe_lock(limit_stat, mutex, id) == APR_SUCCESS) {
+      dec_ip_slot(limit_stat, id);
+      apr_global_mutex_unlock(mutex);
+    }
+    return -2;
+  }
+
+  *slot_id = id;
+
+  return vlimit_own_count(&slot->inherited, old + 1);
+}
+
+/* drop the count taken by inc_ip_counter, our count keeps slot_id claimed until then */
+int dec_ip_counter(SHM_DATA *limit_stat, int slot_id, apr_uint32_t gen)
+{
+
+  int count;
+  apr_global_mutex_t *mutex;
+
+  if (limit_stat->ip_stat_shm[slot_id].gen != gen) {
+    vlimit_drop_inherited(&limit_stat->ip_stat_shm[slot_id].inherited);
+  }
+
+  count = vlimit_atomic ? dec_ip_slot_atomic(limit_stat, slot_id) : -2;
+  if (count != -2) {
+    vlimit_slot_notify(&limit_stat->ip_stat_shm[slot_id].waiters, &limit_stat->ip_stat_shm[slot_id].wake);
+    return count;
+  }
+
+  // the last count of a slot (or VlimitAtomic Off) is dropped under the mutex of its stripe
+  mutex = get_ip_mutex(limit_stat, slot_id);
+
+  // vlimit_mutex lock
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "dec_ip_counter: ", "vlimit_mutex locked.");
+  if (vlimit_stripe_lock(limit_stat, mutex, slot_id) != APR_SUCCESS) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "dec_ip_counter: ", "vlimit_mutex lock failed.");
+    return -3;
+  }
+
+  count = dec_ip_slot(limit_stat, slot_id);
+
+  // vlimit_mutex unlock
+  VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_TRACE, "dec_ip_counter: ", "vlimit_mutex unlocked.");
+  if (apr_global_mutex_unlock(mutex) != APR_SUCCESS) {
+    VLIMIT_DEBUG_SYSLOG(VLIMIT_DEBUG_INFO, "dec_ip_counter: ", "vlimit_mutex unlock failed.");
+  }
+  vlimit_slot_notify(&limit_stat->ip_stat_shm[slot_id].waiters, &limit_stat->ip_stat_shm[slot_id].wake);
+
+  return count;
+}
+
+/* vlimitctl reset, applied by the httpd parent: like an eviction the requests still running give their
+ * counts back through inherited, the key starts again from 0 at once */
+int reset_ip_counter(SHM_DATA *limit_stat, int slot_id)
+{
+  ip_stat *slot = &limit_stat->ip_stat_shm[slot_id];
+  apr_global_mutex_t *mutex = get_ip_mutex(limit_stat, slot_id);
+  apr_uint32_t count;
+
+  // claims, releases and evictions of the slot happen under the same mutex
+  if (vlimit_stripe_lock(limit_stat, mutex, slot_id) != APR_SUCCESS) {
+    return -3;
+  }
+  if (slot->state != VLIMIT_SLOT_USED) {
+    apr_global_mutex_unlock(mutex);
+    return -1;
+  }
+
+  apr_atomic_inc32(&slot->gen);
+  count = apr_atomic_read32(&slot->counter);
+  apr_atomic_set32(&slot->inherited, count);
+  apr_atomic_set32(&slot->remote, 0);
+  apr_global_mutex_unlock(mutex);
+  vlimit_slot_notify(&slot->waiters, &slot->wake);
+
+  return (int)count;
+}
+
+/* VlimitWait on the slot taken by inc_ip_counter, the count is kept whatever the outcome */
+int wait_ip_counter(SHM_DATA *limit_stat, int slot_id, apr_uint32_t gen, int limit)
+{
+  ip_stat *slot = &limit_stat->ip_stat_shm[slot_id];
+
+  return vlimit_slot_wait(&slot->counter, &slot->inherited, &slot->remote, &slot->waiters, &slot->wake, &slot->gen, gen,
+                          limit);
+}
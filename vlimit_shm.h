@@ -0,0 +1,291 @@
+/*
+// -------------------------------------------------------------------
+// vlimit_shm
+//   Slot tables of mod_vlimit on shared memory: hash index, counters,
+//      rate state and lock stripes, keyed by client address or file key
+//
+//   Only needs APR, so the benchmark in bench/ links it without httpd
+// -------------------------------------------------------------------
+*/
+
+#ifndef VLIMIT_SHM_H
+#define VLIMIT_SHM_H
+
+#include <apr_atomic.h>
+#include <apr_global_mutex.h>
+#include <apr_network_io.h>
+#include <apr_pools.h>
+#include <apr_shm.h>
+
+#define MODULE_NAME "mod_vlimit"
+#define VLIMIT_FILE_NAME_LEN 64
+#define VLIMIT_MIN_PART_SLOTS 64
+#define VLIMIT_LOG_FLAG_FILE "/tmp/VLIMIT_LOG"
+#define VLIMIT_DEBUG_FLAG_FILE "/tmp/VLIMIT_DEBUG"
+
+/* slots, leases and the tables on shm start on their own cache line, so children on other cores
+ * updating neighbouring entries do not invalidate each other's lines */
+#define VLIMIT_CACHE_LINE 64
+#define VLIMIT_ALIGN_LINE(size) APR_ALIGN(size, VLIMIT_CACHE_LINE)
+/* apr_shm_baseaddr_get() of an anonymous block is a few bytes past its page, so every block is created
+ * VLIMIT_SHM_SLACK larger than its layout and the layout starts at the first line boundary of it */
+#define VLIMIT_SHM_SLACK (VLIMIT_CACHE_LINE - 1)
+#define VLIMIT_SHM_BASE(shm) ((char *)VLIMIT_ALIGN_LINE((apr_uintptr_t)apr_shm_baseaddr_get(shm)))
+#define VLIMIT_LINE_SIZED(type) typedef char type##_fills_a_cache_line[sizeof(type) == VLIMIT_CACHE_LINE ? 1 : -1]
+
+/* slot state of the open addressing hash index */
+#define VLIMIT_SLOT_EMPTY 0
+#define VLIMIT_SLOT_USED 1
+#define VLIMIT_SLOT_DELETED 2
+
+/* binary client address in network byte order, IPv4 is stored as ::ffff:a.b.c.d */
+typedef struct ip_key_data {
+  apr_uint32_t word[4];
+} ip_key;
+
+#define VLIMIT_IP_KEY_EQUAL(a, b)                                                                                      \
+  ((a)->word[0] == (b)->word[0] && (a)->word[1] == (b)->word[1] && (a)->word[2] == (b)->word[2] &&                     \
+   (a)->word[3] == (b)->word[3])
+#define VLIMIT_IP_KEY_IS_V4(a) ((a)->word[0] == 0 && (a)->word[1] == 0 && (a)->word[2] == htonl(0xffff))
+
+typedef struct ip_data {
+  apr_uint32_t hash; /* precomputed hash of address */
+  int state;         /* VLIMIT_SLOT_EMPTY / USED / DELETED */
+  ip_key address;    /* masked by VlimitIPPrefix */
+  apr_uint32_t counter;
+  apr_uint32_t tat;       /* VlimitIPRate theoretical arrival time, vlimit_rate_now() ms */
+  apr_uint32_t gen;       /* bumped when VlimitOverflow evict hands the slot to another key */
+  apr_uint32_t inherited; /* part of counter still held by requests of evicted keys */
+  apr_uint32_t remote;    /* counts of the other nodes, set by the VlimitBackend sync */
+  apr_uint32_t published; /* counter this node added to the current sync window */
+  apr_uint32_t waiters;   /* requests parked by VlimitWait, their counts are in counter */
+  apr_uint32_t wake;      /* futex word of the waiters, bumped by every drop while there are some */
+  char pad[VLIMIT_CACHE_LINE - 56];
+} ip_stat;
+VLIMIT_LINE_SIZED(ip_stat);
+
+typedef struct file_data {
+  apr_uint64_t key; /* 64 bit hash of r->filename, the slot hash is folded from it */
+  int state;        /* VLIMIT_SLOT_EMPTY / USED / DELETED */
+  apr_uint32_t counter;
+  apr_uint32_t tat;       /* VlimitFileRate theoretical arrival time, vlimit_rate_now() ms */
+  apr_uint32_t gen;       /* bumped when VlimitOverflow evict hands the slot to another key */
+  apr_uint32_t inherited; /* part of counter still held by requests of evicted keys */
+  apr_uint32_t remote;    /* counts of the other nodes, set by the VlimitBackend sync */
+  apr_uint32_t published; /* counter this node added to the current sync window */
+  apr_uint32_t waiters;   /* requests parked by VlimitWait, their counts are in counter */
+  apr_uint32_t wake;      /* futex word of the waiters, bumped by every drop while there are some */
+  char pad[VLIMIT_CACHE_LINE - 44];
+} file_stat;
+VLIMIT_LINE_SIZED(file_stat);
+
+/* only read by the slot list dump, kept apart so lookups stay in the dense file_stat array */
+typedef struct file_name_data {
+  char filename[VLIMIT_FILE_NAME_LEN]; /* tail of r->filename */
+} file_name;
+
+/* head of the shm block, versioned so that a block kept by VlimitRetain or read by vlimitctl is never
+ * taken for another layout. The lease table follows it, then conf_count shm_conf, then the tables */
+#define VLIMIT_SHM_MAGIC 0x564c4d54U /* "VLMT" */
+#define VLIMIT_SHM_VERSION 7         /* bump whenever a struct on shm changes */
+
+typedef struct shm_header_data {
+  apr_uint32_t magic;       /* VLIMIT_SHM_MAGIC */
+  apr_uint32_t version;     /* VLIMIT_SHM_VERSION */
+  apr_uint64_t layout;      /* vlimit_shm_layout() of the configs the block was laid out for */
+  apr_uint32_t restarts;    /* graceful restarts the block was kept across */
+  apr_uint32_t load_scale;  /* VlimitIP auto, VLIMIT_LOAD_SCALE_ONE when idle down to 0 at full load */
+  apr_uint32_t lease_count; /* lease_stat entries after the header */
+  apr_uint32_t conf_count;  /* shm_conf entries at conf_offset */
+  apr_uint64_t conf_offset; /* from the start of the block */
+  apr_uint32_t reset_state; /* VLIMIT_RESET_*, the mailbox of vlimitctl reset */
+  int reset_conf;           /* conf_id of the slot to reset */
+  int reset_table;          /* VLIMIT_RESET_IP / VLIMIT_RESET_FILE */
+  int reset_slot;           /* slot to reset */
+  int reset_result;         /* reset_*_counter() of the slot, set before VLIMIT_RESET_DONE */
+} shm_header;
+
+/* vlimitctl cannot take vlimit_mutex, it leaves one reset at a time in the header and the httpd parent
+ * applies it under the mutex of the slot: FREE -> CLAIMED -> PENDING by vlimitctl, PENDING -> BUSY ->
+ * DONE by the parent, DONE -> FREE by vlimitctl once it has the result. The parent frees a CLAIMED or
+ * DONE left for VLIMIT_RESET_STALE ms, the vlimitctl holding it is gone */
+#define VLIMIT_RESET_FREE 0
+#define VLIMIT_RESET_CLAIMED 1
+#define VLIMIT_RESET_PENDING 2
+#define VLIMIT_RESET_BUSY 3
+#define VLIMIT_RESET_DONE 4
+#define VLIMIT_RESET_STALE 5000 /* ms, vlimitctl holds CLAIMED or DONE for microseconds to a poll */
+
+#define VLIMIT_RESET_IP 0
+#define VLIMIT_RESET_FILE 1
+
+#define VLIMIT_LOAD_SCALE_ONE 1024
+
+/* counts held by one in-flight request, so the monitor can give back those of a child that died */
+typedef struct lease_data {
+  apr_uint32_t pid;        /* owner process, 0 when free */
+  apr_uint32_t generation; /* ap_my_generation of the owner, tells it from a later process given its pid */
+  apr_uint32_t touched;    /* vlimit_rate_now() of the claim */
+  int conf_id;             /* config the counts were taken for */
+  int file_slot;           /* file_stat slot, -1 none */
+  int ip_slot;             /* ip_stat slot, -1 none */
+  apr_uint32_t file_gen;   /* gen of file_slot when counted */
+  apr_uint32_t ip_gen;     /* gen of ip_slot when counted */
+  char pad[VLIMIT_CACHE_LINE - 32];
+} lease_stat;
+VLIMIT_LINE_SIZED(lease_stat);
+
+/* where the tables of one config are, rewritten at every startup, so vlimitctl needs no httpd config */
+typedef struct shm_conf_data {
+  int conf_id;
+  int max_slots;
+  int part_slots;
+  int ip_limit;                         /* VlimitIP, the max of VlimitIP auto, 0 none */
+  int file_limit;                       /* VlimitFile, 0 none */
+  int pad;
+  apr_uint64_t stat_offset;             /* conf_stat, from the start of the block */
+  apr_uint64_t ip_offset;               /* ip_stat table, 0 none */
+  apr_uint64_t file_offset;             /* file_stat table, 0 none */
+  apr_uint64_t name_offset;             /* file_name table, 0 none */
+  char full_path[VLIMIT_FILE_NAME_LEN]; /* tail of the RealPath, or the VlimitKey name, empty none */
+} shm_conf;
+
+/* histogram buckets, the upper bound of each is 4 (lock wait us) / 2 (probe slots) times the previous, last open */
+#define VLIMIT_LOCK_WAIT_BUCKETS 9 /* 1us .. 65536us */
+#define VLIMIT_PROBE_BUCKETS 8     /* 1 .. 64 slots */
+
+/* counters bumped by every request, spread over VLIMIT_STAT_SHARDS copies by slot so that requests for
+ * different keys do not all update one line; readers add them up with vlimit_stat_sum() */
+#define VLIMIT_STAT_SHARDS 16
+#define VLIMIT_STAT_HOT_WORDS (3 + VLIMIT_LOCK_WAIT_BUCKETS + VLIMIT_PROBE_BUCKETS)
+
+typedef struct conf_stat_shard_data {
+  apr_uint32_t accepted;      /* requests passed by vlimit_check_limit */
+  apr_uint32_t lock_wait[VLIMIT_LOCK_WAIT_BUCKETS];
+  apr_uint32_t lock_wait_sum; /* us, wraps like a 32 bit counter */
+  apr_uint32_t probe[VLIMIT_PROBE_BUCKETS];
+  apr_uint32_t probe_sum;     /* slots looked at by key lookups */
+  char pad[VLIMIT_ALIGN_LINE(4 * VLIMIT_STAT_HOT_WORDS) - 4 * VLIMIT_STAT_HOT_WORDS];
+} conf_stat_shard;
+typedef char conf_stat_shard_fills_cache_lines[sizeof(conf_stat_shard) % VLIMIT_CACHE_LINE == 0 ? 1 : -1];
+
+#define VLIMIT_STAT_SHARD(limit_stat, id) (&(limit_stat)->stat_shm->shard[(id) & (VLIMIT_STAT_SHARDS - 1)])
+
+/* per config counters on shared memory, read by the vlimit-status handler, mod_status and vlimitctl */
+typedef struct conf_stat_data {
+  apr_uint32_t ip_rejects;    /* 503 by VlimitIP */
+  apr_uint32_t file_rejects;  /* 503 by VlimitFile */
+  apr_uint32_t rate_rejects;  /* 503 by VlimitIPRate / VlimitFileRate */
+  apr_uint32_t full_rejects;  /* 503 because a slot table or partition is full */
+  apr_uint32_t evictions;     /* slots handed to another key by VlimitOverflow evict */
+  apr_uint32_t lock_failures; /* vlimit_mutex lock errors */
+  apr_uint32_t waited;        /* requests let in after a VlimitWait */
+  apr_uint32_t wait_timeouts; /* 503 after a VlimitWait of the whole time */
+  char pad[VLIMIT_CACHE_LINE - 32];
+  conf_stat_shard shard[VLIMIT_STAT_SHARDS];
+} conf_stat;
+
+/* slot tables of one config, the arrays live on shared memory */
+typedef struct shm_data_str {
+  int max_slots;            /* slots per table, power of 2 */
+  int part_slots;           /* slots per lock stripe partition, power of 2 */
+  int file_lock;            /* stripe of the first file table partition */
+  int ip_lock;              /* stripe of the first ip table partition */
+  ip_key ip_mask4;          /* VlimitIPPrefix of IPv4 addresses as a mask */
+  ip_key ip_mask6;          /* VlimitIPPrefix of IPv6 addresses as a mask */
+  apr_uint32_t file_rate_emission; /* VlimitFileRate ms per request, 0 when unset */
+  apr_uint32_t file_rate_interval; /* VlimitFileRate interval ms */
+  apr_uint32_t ip_rate_emission;   /* VlimitIPRate ms per request, 0 when unset */
+  apr_uint32_t ip_rate_interval;   /* VlimitIPRate interval ms */
+  file_stat *file_stat_shm; /* NULL unless VlimitFile is set */
+  file_name *file_name_shm; /* filenames of file_stat_shm slots */
+  ip_stat *ip_stat_shm;     /* NULL unless VlimitIP is set */
+  conf_stat *stat_shm;      /* request, lock and probe counters */
+} SHM_DATA;
+
+/* probing wraps inside the lock stripe partition of the home slot */
+#define VLIMIT_SLOT_HOME(limit_stat, hash) ((int)((hash) & ((limit_stat)->max_slots - 1)))
+#define VLIMIT_SLOT_PART(limit_stat, id) ((id) / (limit_stat)->part_slots)
+#define VLIMIT_SLOT_NEXT(limit_stat, id)                                                                            \
+  (((id) & ~((limit_stat)->part_slots - 1)) | (((id) + 1) & ((limit_stat)->part_slots - 1)))
+#define VLIMIT_SLOT_PREV(limit_stat, id)                                                                            \
+  (((id) & ~((limit_stat)->part_slots - 1)) | (((id) - 1) & ((limit_stat)->part_slots - 1)))
+
+#define VLIMIT_FILE_KEY_HASH(key) ((apr_uint32_t)((key) ^ ((key) >> 32)))
+
+/* a tat more than one interval ahead is left over from before the clock wrapped */
+#define VLIMIT_RATE_PENDING(tat, now, interval)                                                                        \
+  ((apr_int32_t)((tat) - (now)) > 0 && (apr_uint32_t)((tat) - (now)) <= (interval))
+
+/* flag files are checked at most once a second per process, not on every call */
+#define VLIMIT_FLAG_DEBUG 0x01
+#define VLIMIT_FLAG_LOG 0x02
+
+/* VlimitDebugLevel, lines above it are dropped before their arguments are formatted */
+#define VLIMIT_DEBUG_NONE 0
+#define VLIMIT_DEBUG_INFO 1  /* decisions, configuration and errors */
+#define VLIMIT_DEBUG_TRACE 2 /* every step of a request, including the lock traces */
+#define VLIMIT_DEBUG_MAX_LINE 1024
+
+#define VLIMIT_DEBUG_SYSLOG(level, key, ...)                                                                           \
+  do {                                                                                                                 \
+    if (vlimit_debug_level >= (level) && (vlimit_flag_state() & VLIMIT_FLAG_DEBUG)) {                                  \
+      vlimit_debug_syslog((key), __VA_ARGS__);                                                                         \
+    }                                                                                                                  \
+  } while (0)
+
+
+// VlimitDebugLevel
+extern int vlimit_debug_level;
+
+// VlimitAtomic: update claimed slots without vlimit_mutex
+extern int vlimit_atomic;
+
+// VlimitOverflow evict: a full partition hands its least counted slot to the new key instead of 503
+extern int vlimit_overflow_evict;
+
+// VlimitWait: requests over a limit wait up to vlimit_wait_ms, at most vlimit_wait_max per slot
+#ifdef __linux__
+#define VLIMIT_HAVE_WAIT 1
+#endif
+extern int vlimit_wait_ms;
+extern int vlimit_wait_max;
+
+// grobal mutex, VlimitMutexStripes of them
+extern apr_global_mutex_t **vlimit_mutex;
+extern int vlimit_mutex_stripes;
+
+apr_uint32_t vlimit_flag_state(void);
+void vlimit_debug_syslog(const char *key, const char *fmt, ...);
+
+apr_uint64_t vlimit_hash_string64(const char *key);
+apr_uint32_t vlimit_hash_bytes(const void *key, apr_size_t len);
+int vlimit_slot_size(int slots);
+
+/* the shards of stat added up into sum */
+void vlimit_stat_sum(const conf_stat *stat, conf_stat_shard *sum);
+
+apr_uint32_t vlimit_rate_now(void);
+apr_uint32_t vlimit_rate_check(volatile apr_uint32_t *tat, apr_uint32_t emission, apr_uint32_t interval);
+
+/* inc_* return the new count of the key and its slot, -1 when the partition is full, -3 when the lock failed;
+ * the atomic variants return -2 when the slot is not claimed yet, to be retried with the locked one.
+ * wait_* park a request holding a count until the key is back under limit and return the count it is let in
+ * with, -1 when vlimit_wait_max requests already wait on the slot, -2 after vlimit_wait_ms.
+ * reset_* forget the counts of a used slot under its mutex and return how many, -1 when the slot is not used and
+ * -3 when the lock failed; they need the vlimit_mutex of httpd, vlimitctl goes through the header mailbox */
+int inc_file_counter(SHM_DATA *limit_stat, apr_uint64_t key, const char *filename, int *slot_id, apr_uint32_t *gen);
+int inc_file_counter_atomic(SHM_DATA *limit_stat, apr_uint64_t key, int *slot_id, apr_uint32_t *gen);
+int dec_file_counter(SHM_DATA *limit_stat, int slot_id, apr_uint32_t gen);
+int wait_file_counter(SHM_DATA *limit_stat, int slot_id, apr_uint32_t gen, int limit);
+int reset_file_counter(SHM_DATA *limit_stat, int slot_id);
+
+apr_uint32_t vlimit_ip_key(SHM_DATA *limit_stat, const apr_sockaddr_t *addr, ip_key *key);
+const char *get_ip_key_string(const ip_key *key, apr_pool_t *p);
+int inc_ip_counter(SHM_DATA *limit_stat, const ip_key *key, apr_uint32_t hash, int *slot_id, apr_uint32_t *gen);
+int inc_ip_counter_atomic(SHM_DATA *limit_stat, const ip_key *key, apr_uint32_t hash, int *slot_id, apr_uint32_t *gen);
+int dec_ip_counter(SHM_DATA *limit_stat, int slot_id, apr_uint32_t gen);
+int wait_ip_counter(SHM_DATA *limit_stat, int slot_id, apr_uint32_t gen, int limit);
+int reset_ip_counter(SHM_DATA *limit_stat, int slot_id);
+
+#endif
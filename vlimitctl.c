@@ -0,0 +1,409 @@
+/*
+// -------------------------------------------------------------------
+// vlimitctl
+//   List, watch and reset the counters of a running mod_vlimit from
+//      outside of httpd, through the shm block named by VlimitShmFile
+//
+//   The tables are copied before they are reported, no vlimit_mutex
+//   is taken and no request waits on it. reset leaves the slot in the
+//   mailbox of the shm header, the httpd parent resets it under the
+//   mutex of the slot, the way an eviction does.
+//
+//   usage: vlimitctl -f shmfile [-c conf_id] [-t ip|file] [-n top] [-s count|slot] [-i ms] [list|watch]
+//          vlimitctl -f shmfile reset conf_id ip|file slot
+// -------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_general.h>
+#include <apr_getopt.h>
+#include <apr_strings.h>
+#include <apr_shm.h>
+#include <apr_time.h>
+
+#include "vlimit_shm.h"
+
+#define CTL_DEFAULT_TOP 20
+#define CTL_DEFAULT_INTERVAL 1000
+#define CTL_MIN_INTERVAL 10
+#define CTL_RESET_POLL 10      /* ms between looks at the reset mailbox */
+#define CTL_RESET_TIMEOUT 5000 /* ms the httpd parent gets to take a reset, its monitor runs once a second */
+
+/* one used slot of a copied table */
+typedef struct ctl_entry_str {
+  int slot;
+  apr_uint32_t count; /* counter less inherited, the requests of the key */
+  apr_uint32_t inherited;
+  apr_uint32_t remote;
+  apr_uint32_t waiters;
+  const char *key;
+} ctl_entry;
+
+static const char *ctl_file = NULL;
+static const char *ctl_table = NULL;
+static int ctl_conf = -1;
+static int ctl_top = CTL_DEFAULT_TOP;
+static int ctl_by_slot = 0;
+static int ctl_interval = CTL_DEFAULT_INTERVAL;
+
+static char *ctl_base;
+static apr_size_t ctl_size;
+static shm_header *ctl_header;
+
+static void ctl_usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s -f shmfile [-c conf_id] [-t ip|file] [-n top] [-s count|slot] [-i ms] [list|watch]\n"
+          "       %s -f shmfile reset conf_id ip|file slot\n"
+          "  -f  VlimitShmFile of the httpd\n"
+          "  -c  only this config (default all)\n"
+          "  -t  only this table (default both)\n"
+          "  -n  slots listed per table, 0 for all (default 20)\n"
+          "  -s  order by count or slot (default count)\n"
+          "  -i  watch refresh interval in ms (default 1000)\n",
+          prog, prog);
+  exit(2);
+}
+
+static int ctl_options(int argc, const char *const *argv, apr_pool_t *p)
+{
+  apr_getopt_t *opt;
+  apr_status_t status;
+  const char *arg;
+  char ch;
+
+  apr_getopt_init(&opt, p, argc, argv);
+  while ((status = apr_getopt(opt, "f:c:t:n:s:i:", &ch, &arg)) == APR_SUCCESS) {
+    switch (ch) {
+    case 'f':
+      ctl_file = arg;
+      break;
+    case 'c':
+      ctl_conf = atoi(arg);
+      break;
+    case 't':
+      ctl_table = arg;
+      break;
+    case 'n':
+      ctl_top = atoi(arg);
+      break;
+    case 's':
+      ctl_by_slot = strcmp(arg, "slot") == 0;
+      if (!ctl_by_slot && strcmp(arg, "count") != 0) {
+        ctl_usage(argv[0]);
+      }
+      break;
+    case 'i':
+      ctl_interval = atoi(arg);
+      break;
+    }
+  }
+
+  if (status != APR_EOF || ctl_file == NULL || ctl_top < 0 || ctl_interval < CTL_MIN_INTERVAL ||
+      (ctl_table != NULL && strcmp(ctl_table, "ip") != 0 && strcmp(ctl_table, "file") != 0)) {
+    ctl_usage(argv[0]);
+  }
+
+  return opt->ind;
+}
+
+/* the block has to be laid out by this very version, and every offset it gives has to be inside */
+static int ctl_check(void)
+{
+
+  shm_conf *conf;
+  apr_uint32_t t;
+
+  if (ctl_size < sizeof(shm_header) || ctl_header->magic != VLIMIT_SHM_MAGIC) {
+    fprintf(stderr, "%s: not a mod_vlimit shm block\n", ctl_file);
+    return -1;
+  }
+  if (ctl_header->version != VLIMIT_SHM_VERSION) {
+    fprintf(stderr, "%s: shm layout version %u, this vlimitctl reads %u\n", ctl_file, ctl_header->version,
+            VLIMIT_SHM_VERSION);
+    return -1;
+  }
+  if (ctl_header->conf_offset + (apr_uint64_t)sizeof(shm_conf) * ctl_header->conf_count > ctl_size) {
+    fprintf(stderr, "%s: config table out of the block\n", ctl_file);
+    return -1;
+  }
+
+  conf = (shm_conf *)(ctl_base + ctl_header->conf_offset);
+  for (t = 0; t < ctl_header->conf_count; t++) {
+    if (conf[t].max_slots < 1 || conf[t].stat_offset + sizeof(conf_stat) > ctl_size ||
+        conf[t].ip_offset + (apr_uint64_t)sizeof(ip_stat) * conf[t].max_slots > ctl_size ||
+        conf[t].file_offset + (apr_uint64_t)sizeof(file_stat) * conf[t].max_slots > ctl_size ||
+        conf[t].name_offset + (apr_uint64_t)sizeof(file_name) * conf[t].max_slots > ctl_size) {
+      fprintf(stderr, "%s: tables of conf %d out of the block\n", ctl_file, conf[t].conf_id);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* the SHM_DATA the slot routines of vlimit_shm.c work on */
+static void ctl_shm_data(shm_conf *conf, SHM_DATA *limit_stat)
+{
+  memset(limit_stat, 0, sizeof(*limit_stat));
+  limit_stat->max_slots = conf->max_slots;
+  limit_stat->part_slots = conf->part_slots;
+  limit_stat->stat_shm = (conf_stat *)(ctl_base + conf->stat_offset);
+  if (conf->ip_offset > 0) {
+    limit_stat->ip_stat_shm = (ip_stat *)(ctl_base + conf->ip_offset);
+  }
+  if (conf->file_offset > 0) {
+    limit_stat->file_stat_shm = (file_stat *)(ctl_base + conf->file_offset);
+    limit_stat->file_name_shm = (file_name *)(ctl_base + conf->name_offset);
+  }
+}
+
+static int ctl_compare(const void *a, const void *b)
+{
+  const ctl_entry *x = (const ctl_entry *)a;
+  const ctl_entry *y = (const ctl_entry *)b;
+
+  if (!ctl_by_slot && x->count != y->count) {
+    return x->count > y->count ? -1 : 1;
+  }
+
+  return x->slot - y->slot;
+}
+
+static ctl_entry *ctl_snapshot_ip(SHM_DATA *limit_stat, int *used, apr_pool_t *p)
+{
+
+  ip_stat *copy = (ip_stat *)apr_palloc(p, sizeof(ip_stat) * limit_stat->max_slots);
+  ctl_entry *entries = (ctl_entry *)apr_palloc(p, sizeof(ctl_entry) * limit_stat->max_slots);
+  int i;
+
+  memcpy(copy, limit_stat->ip_stat_shm, sizeof(ip_stat) * limit_stat->max_slots);
+  *used = 0;
+  for (i = 0; i < limit_stat->max_slots; i++) {
+    if (copy[i].state != VLIMIT_SLOT_USED) {
+      continue;
+    }
+    entries[*used].slot = i;
+    entries[*used].count = copy[i].counter > copy[i].inherited ? copy[i].counter - copy[i].inherited : 0;
+    entries[*used].inherited = copy[i].inherited;
+    entries[*used].remote = copy[i].remote;
+    entries[*used].waiters = copy[i].waiters;
+    entries[*used].key = get_ip_key_string(&copy[i].address, p);
+    (*used)++;
+  }
+
+  return entries;
+}
+
+static ctl_entry *ctl_snapshot_file(SHM_DATA *limit_stat, int *used, apr_pool_t *p)
+{
+
+  file_stat *copy = (file_stat *)apr_palloc(p, sizeof(file_stat) * limit_stat->max_slots);
+  ctl_entry *entries = (ctl_entry *)apr_palloc(p, sizeof(ctl_entry) * limit_stat->max_slots);
+  int i;
+
+  memcpy(copy, limit_stat->file_stat_shm, sizeof(file_stat) * limit_stat->max_slots);
+  *used = 0;
+  for (i = 0; i < limit_stat->max_slots; i++) {
+    if (copy[i].state != VLIMIT_SLOT_USED) {
+      continue;
+    }
+    entries[*used].slot = i;
+    entries[*used].count = copy[i].counter > copy[i].inherited ? copy[i].counter - copy[i].inherited : 0;
+    entries[*used].inherited = copy[i].inherited;
+    entries[*used].remote = copy[i].remote;
+    entries[*used].waiters = copy[i].waiters;
+    // the name may be rewritten meanwhile, it is only as exact as the copy
+    entries[*used].key = apr_pstrndup(p, limit_stat->file_name_shm[i].filename, VLIMIT_FILE_NAME_LEN);
+    (*used)++;
+  }
+
+  return entries;
+}
+
+static void ctl_print_table(const char *name, int limit, ctl_entry *entries, int used, int slots)
+{
+  int n = ctl_top > 0 && ctl_top < used ? ctl_top : used;
+  int i;
+
+  qsort(entries, used, sizeof(ctl_entry), ctl_compare);
+  printf("  %s limit %d slots %d used %d\n", name, limit, slots, used);
+  for (i = 0; i < n; i++) {
+    printf("    %7d %7u  inherited %u remote %u waiters %u  %s\n", entries[i].slot, entries[i].count,
+           entries[i].inherited, entries[i].remote, entries[i].waiters, entries[i].key);
+  }
+}
+
+static void ctl_list(apr_pool_t *p)
+{
+
+  shm_conf *conf = (shm_conf *)(ctl_base + ctl_header->conf_offset);
+  SHM_DATA limit_stat;
+  ctl_entry *entries;
+  conf_stat stat;
+  conf_stat_shard hot;
+  apr_uint32_t t;
+  int used;
+
+  printf("restarts %u load_scale %u/%u leases %u\n", ctl_header->restarts, ctl_header->load_scale,
+         VLIMIT_LOAD_SCALE_ONE, ctl_header->lease_count);
+  for (t = 0; t < ctl_header->conf_count; t++) {
+    if (ctl_conf >= 0 && conf[t].conf_id != ctl_conf) {
+      continue;
+    }
+    ctl_shm_data(&conf[t], &limit_stat);
+    stat = *limit_stat.stat_shm;
+    vlimit_stat_sum(&stat, &hot);
+    printf("conf %d %s accepted %u rejects ip %u file %u rate %u full %u evictions %u\n", conf[t].conf_id,
+           conf[t].full_path[0] ? conf[t].full_path : "-", hot.accepted, stat.ip_rejects, stat.file_rejects,
+           stat.rate_rejects, stat.full_rejects, stat.evictions);
+
+    if (limit_stat.ip_stat_shm != NULL && (ctl_table == NULL || strcmp(ctl_table, "ip") == 0)) {
+      entries = ctl_snapshot_ip(&limit_stat, &used, p);
+      ctl_print_table("ip", conf[t].ip_limit, entries, used, limit_stat.max_slots);
+    }
+    if (limit_stat.file_stat_shm != NULL && (ctl_table == NULL || strcmp(ctl_table, "file") == 0)) {
+      entries = ctl_snapshot_file(&limit_stat, &used, p);
+      ctl_print_table("file", conf[t].file_limit, entries, used, limit_stat.max_slots);
+    }
+  }
+}
+
+/* until interrupted, one pool per refresh */
+static void ctl_watch(apr_pool_t *p)
+{
+  apr_pool_t *frame;
+  char date[APR_RFC822_DATE_LEN];
+
+  apr_pool_create(&frame, p);
+  for (;;) {
+    apr_rfc822_date(date, apr_time_now());
+    printf("\033[H\033[2J%s  every %d ms\n", date, ctl_interval);
+    ctl_list(frame);
+    fflush(stdout);
+    apr_pool_clear(frame);
+    apr_sleep(apr_time_from_msec(ctl_interval));
+  }
+}
+
+static int ctl_reset(const char *conf_arg, const char *table, const char *slot_arg)
+{
+
+  shm_conf *conf = (shm_conf *)(ctl_base + ctl_header->conf_offset);
+  SHM_DATA limit_stat;
+  int conf_id = atoi(conf_arg);
+  int slot = atoi(slot_arg);
+  int count = -1;
+  int waited;
+  apr_uint32_t state;
+  apr_uint32_t t;
+
+  for (t = 0; t < ctl_header->conf_count && conf[t].conf_id != conf_id; t++) {
+  }
+  if (t == ctl_header->conf_count) {
+    fprintf(stderr, "no conf %d\n", conf_id);
+    return 1;
+  }
+  ctl_shm_data(&conf[t], &limit_stat);
+  if (slot < 0 || slot >= limit_stat.max_slots) {
+    fprintf(stderr, "slot %d out of 0..%d\n", slot, limit_stat.max_slots - 1);
+    return 1;
+  }
+
+  if (!(strcmp(table, "ip") == 0 && limit_stat.ip_stat_shm != NULL) &&
+      !(strcmp(table, "file") == 0 && limit_stat.file_stat_shm != NULL)) {
+    fprintf(stderr, "conf %d has no %s table\n", conf_id, table);
+    return 1;
+  }
+
+  // the slot is reset under its mutex by the httpd parent, one reset at a time
+  if (apr_atomic_cas32(&ctl_header->reset_state, VLIMIT_RESET_CLAIMED, VLIMIT_RESET_FREE) != VLIMIT_RESET_FREE) {
+    fprintf(stderr, "another reset is in progress\n");
+    return 1;
+  }
+  ctl_header->reset_conf = conf_id;
+  ctl_header->reset_table = strcmp(table, "ip") == 0 ? VLIMIT_RESET_IP : VLIMIT_RESET_FILE;
+  ctl_header->reset_slot = slot;
+  // the parent frees a claim older than VLIMIT_RESET_STALE, stop here if that was this one
+  if (apr_atomic_cas32(&ctl_header->reset_state, VLIMIT_RESET_PENDING, VLIMIT_RESET_CLAIMED) != VLIMIT_RESET_CLAIMED) {
+    fprintf(stderr, "httpd withdrew the reset, try again\n");
+    return 1;
+  }
+
+  for (waited = 0; (state = apr_atomic_read32(&ctl_header->reset_state)) != VLIMIT_RESET_DONE;
+       waited += CTL_RESET_POLL) {
+    if (state != VLIMIT_RESET_PENDING && state != VLIMIT_RESET_BUSY) {
+      fprintf(stderr, "httpd withdrew the reset, try again\n");
+      return 1;
+    }
+    // withdraw it unless the parent has started on it
+    if (waited >= CTL_RESET_TIMEOUT &&
+        apr_atomic_cas32(&ctl_header->reset_state, VLIMIT_RESET_FREE, VLIMIT_RESET_PENDING) == VLIMIT_RESET_PENDING) {
+      fprintf(stderr, "httpd did not take the reset within %d ms, is it running?\n", CTL_RESET_TIMEOUT);
+      return 1;
+    }
+    apr_sleep(apr_time_from_msec(CTL_RESET_POLL));
+  }
+  count = ctl_header->reset_result;
+  apr_atomic_cas32(&ctl_header->reset_state, VLIMIT_RESET_FREE, VLIMIT_RESET_DONE);
+
+  if (count == -3) {
+    fprintf(stderr, "conf %d %s slot %d: vlimit_mutex lock failed\n", conf_id, table, slot);
+    return 1;
+  }
+  if (count < 0) {
+    fprintf(stderr, "conf %d %s slot %d is not used\n", conf_id, table, slot);
+    return 1;
+  }
+
+  printf("conf %d %s slot %d: %d counts forgotten\n", conf_id, table, slot, count);
+
+  return 0;
+}
+
+int main(int argc, const char *const *argv)
+{
+
+  apr_pool_t *p;
+  apr_shm_t *shm;
+  apr_status_t status;
+  const char *command;
+  int ind;
+
+  apr_app_initialize(&argc, &argv, NULL);
+  atexit(apr_terminate);
+  apr_pool_create(&p, NULL);
+  ind = ctl_options(argc, argv, p);
+  command = ind < argc ? argv[ind] : "list";
+
+  vlimit_debug_level = VLIMIT_DEBUG_NONE;
+  status = apr_shm_attach(&shm, ctl_file, p);
+  if (status != APR_SUCCESS) {
+    fprintf(stderr, "%s: apr_shm_attach failed: %d, is VlimitShmFile set and httpd running?\n", ctl_file, status);
+    return 1;
+  }
+  // the layout starts at the first line boundary, like in httpd
+  ctl_base = VLIMIT_SHM_BASE(shm);
+  ctl_size = apr_shm_size_get(shm) - (apr_size_t)(ctl_base - (char *)apr_shm_baseaddr_get(shm));
+  ctl_header = (shm_header *)ctl_base;
+  if (ctl_check() != 0) {
+    return 1;
+  }
+
+  if (strcmp(command, "list") == 0 && ind + 1 >= argc) {
+    ctl_list(p);
+  } else if (strcmp(command, "watch") == 0 && ind + 1 >= argc) {
+    ctl_watch(p);
+  } else if (strcmp(command, "reset") == 0 && ind + 4 == argc) {
+    return ctl_reset(argv[ind + 1], argv[ind + 2], argv[ind + 3]);
+  } else {
+    ctl_usage(argv[0]);
+  }
+
+  apr_shm_detach(shm);
+
+  return 0;
+}